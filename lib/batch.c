@@ -0,0 +1,215 @@
+/*
+ * batch.c: run many independent pipelines a few at a time
+ * Copyright (C) 2026 Colin Watson.
+ *
+ * This file is part of libpipeline.
+ *
+ * libpipeline is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * libpipeline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libpipeline; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301
+ * USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "xalloc.h"
+
+#include "pipeline-private.h"
+#include "error.h"
+
+/* A batch is a queue of pipelines waiting to be started, and the set of
+ * those currently running.  Running pipelines are waited for together by
+ * polling their wait descriptors, so that whichever finishes first makes
+ * room for the next in the queue, however long the others take.
+ */
+
+struct batch_entry {
+	pipeline *p;
+	pipeline_batch_callback_type *func;
+	void *data;
+	int wait_fd;		/* -1 if the pipeline has none */
+};
+
+struct pipeline_batch {
+	int max_running;
+	struct batch_entry *queue;
+	int nqueue, queue_max;	/* size of queue, and of allocated array */
+	int next;		/* index of the next entry to start */
+	struct batch_entry *running;
+	struct pollfd *pfds;
+	int nrunning;
+	int failures;
+};
+
+pipeline_batch *pipeline_batch_new (int max_running)
+{
+	pipeline_batch *b = XMALLOC (pipeline_batch);
+
+	if (max_running <= 0) {
+		long cpus = -1;
+#ifdef _SC_NPROCESSORS_ONLN
+		cpus = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+		max_running = cpus > 0 ? (int) cpus : 1;
+	}
+	b->max_running = max_running;
+	b->queue = NULL;
+	b->nqueue = b->queue_max = 0;
+	b->next = 0;
+	b->running = xnmalloc (max_running, sizeof *b->running);
+	b->pfds = xnmalloc (max_running, sizeof *b->pfds);
+	b->nrunning = 0;
+	b->failures = 0;
+	return b;
+}
+
+void pipeline_batch_add (pipeline_batch *b, pipeline *p,
+			 pipeline_batch_callback_type *func, void *data)
+{
+	struct batch_entry *e;
+
+	if (b->next && b->next == b->nqueue)
+		/* Everything queued so far has been started. */
+		b->next = b->nqueue = 0;
+	if (b->nqueue >= b->queue_max) {
+		b->queue_max = b->queue_max ? b->queue_max * 2 : 16;
+		b->queue = xnrealloc (b->queue, b->queue_max,
+				      sizeof *b->queue);
+	}
+	e = &b->queue[b->nqueue++];
+	e->p = p;
+	e->func = func;
+	e->data = data;
+	e->wait_fd = -1;
+}
+
+int pipeline_batch_get_max_running (pipeline_batch *b)
+{
+	return b->max_running;
+}
+
+/* Start the next pipeline in the queue. */
+static void batch_start (pipeline_batch *b)
+{
+	struct batch_entry *e = &b->running[b->nrunning++];
+
+	*e = b->queue[b->next++];
+	pipeline_start (e->p);
+	e->wait_fd = pipeline_get_wait_fd (e->p);
+	if (e->wait_fd == -1)
+		debug ("no wait descriptor for batch pipeline: %s\n",
+		       strerror (errno));
+}
+
+/* Running pipeline i has finished with status: report it, free the
+ * pipeline, and make room for another.
+ */
+static void batch_finish (pipeline_batch *b, int i, int status)
+{
+	struct batch_entry e = b->running[i];
+
+	b->running[i] = b->running[--b->nrunning];
+	if (status)
+		++b->failures;
+	if (e.func)
+		(*e.func) (e.p, status, e.data);
+	pipeline_free (e.p);
+}
+
+/* See whether running pipeline i has finished without waiting for it.
+ * Returns non-zero if it has.
+ */
+static int batch_try (pipeline_batch *b, int i)
+{
+	int status = pipeline_try_wait_all (b->running[i].p, NULL, NULL);
+
+	if (status == -1)
+		return 0;
+	batch_finish (b, i, status);
+	return 1;
+}
+
+int pipeline_batch_run (pipeline_batch *b)
+{
+	int i;
+
+	b->failures = 0;
+
+	for (;;) {
+		int ready;
+
+		while (b->nrunning < b->max_running && b->next < b->nqueue) {
+			batch_start (b);
+			/* This also closes the pipeline's input and output,
+			 * which nothing is going to use.
+			 */
+			batch_try (b, b->nrunning - 1);
+		}
+		if (!b->nrunning)
+			break;
+
+		/* Without a wait descriptor, we have no choice but to
+		 * block in pipeline_wait.
+		 */
+		for (i = 0; i < b->nrunning; ++i)
+			if (b->running[i].wait_fd == -1)
+				break;
+		if (i < b->nrunning) {
+			batch_finish (b, i, pipeline_wait (b->running[i].p));
+			continue;
+		}
+
+		for (i = 0; i < b->nrunning; ++i) {
+			b->pfds[i].fd = b->running[i].wait_fd;
+			b->pfds[i].events = POLLIN;
+			b->pfds[i].revents = 0;
+		}
+		ready = poll (b->pfds, b->nrunning, -1);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			error (FATAL, errno, "poll failed");
+		}
+
+		/* Finishing a pipeline moves the last one into its place,
+		 * so go backwards to see each of them once.
+		 */
+		for (i = b->nrunning - 1; i >= 0; --i)
+			if (b->pfds[i].revents)
+				batch_try (b, i);
+	}
+
+	return b->failures;
+}
+
+void pipeline_batch_free (pipeline_batch *b)
+{
+	int i;
+
+	if (!b)
+		return;
+	for (i = b->next; i < b->nqueue; ++i)
+		pipeline_free (b->queue[i].p);
+	free (b->queue);
+	free (b->running);
+	free (b->pfds);
+	free (b);
+}
@@ -30,22 +30,36 @@
 #include <string.h>
 #include <errno.h>
 
+#ifdef USE_POSIX_THREADS
+#  include <pthread.h>
+#endif
+
 #include "pipeline-private.h"
 
 int debug_level = 0;
 
+static void read_debug_level (void)
+{
+	const char *pipeline_debug = getenv ("PIPELINE_DEBUG");
+
+	if (pipeline_debug && !strcmp (pipeline_debug, "1"))
+		debug_level = 1;
+}
+
 void init_debug (void)
 {
+#ifdef USE_POSIX_THREADS
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once (&once, read_debug_level);
+#else
 	static int inited = 0;
-	const char *pipeline_debug;
 
 	if (inited)
 		return;
 	inited = 1;
-
-	pipeline_debug = getenv ("PIPELINE_DEBUG");
-	if (pipeline_debug && !strcmp (pipeline_debug, "1"))
-		debug_level = 1;
+	read_debug_level ();
+#endif
 }
 
 static void vdebug (const char *message, va_list args)
@@ -0,0 +1,406 @@
+/*
+ * graph.c: run pipelines connected in a directed acyclic graph
+ * Copyright (C) 2026 Colin Watson.
+ *
+ * This file is part of libpipeline.
+ *
+ * libpipeline is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * libpipeline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libpipeline; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301
+ * USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "xalloc.h"
+
+#include "pipeline-private.h"
+#include "error.h"
+
+/* A graph is a set of pipelines (vertices) and byte streams between them
+ * (edges).  Nothing is connected until the graph is run, when each edge
+ * becomes a pipeline_connect() or pipeline_merge() connection according to
+ * how many edges lead into its destination, and a single pipeline_pump()
+ * loop moves data along all of them.
+ *
+ * Built-in tee and merge vertices are pipelines with no commands.  Where
+ * possible they are folded away before running, so that their neighbours
+ * are connected to each other directly: a tee with one input just gives
+ * its source more sinks, and a merge with one output just gives its sink
+ * more sources.  Otherwise, a zero-command vertex passes data through a
+ * pipe of its own.
+ */
+
+enum graph_builtin {
+	GRAPH_PIPELINE,		/* added by the caller */
+	GRAPH_TEE,
+	GRAPH_MERGE,
+	GRAPH_PASSTHROUGH	/* added to keep a merge's source apart */
+};
+
+struct graph_vertex {
+	pipeline *p;
+	enum graph_builtin builtin;
+	int folded;		/* non-zero if folded into its neighbours */
+	int status;		/* -1 until waited for */
+};
+
+struct graph_edge {
+	int from, to;		/* indices into vertices */
+};
+
+struct pipeline_graph {
+	struct graph_vertex *vertices;
+	int nvertices, vertices_max;	/* used and allocated sizes */
+	struct graph_edge *edges;
+	int nedges, edges_max;		/* ditto */
+	int run;			/* non-zero once run */
+};
+
+pipeline_graph *pipeline_graph_new (void)
+{
+	pipeline_graph *g = XMALLOC (pipeline_graph);
+
+	g->vertices = NULL;
+	g->nvertices = g->vertices_max = 0;
+	g->edges = NULL;
+	g->nedges = g->edges_max = 0;
+	g->run = 0;
+	return g;
+}
+
+/* Return the index of p among g's vertices, or -1 if it isn't one. */
+static int graph_find (pipeline_graph *g, pipeline *p)
+{
+	int i;
+
+	for (i = 0; i < g->nvertices; ++i) {
+		if (g->vertices[i].p == p)
+			return i;
+	}
+	return -1;
+}
+
+static pipeline *graph_add_vertex (pipeline_graph *g, pipeline *p,
+				   enum graph_builtin builtin)
+{
+	struct graph_vertex *v;
+
+	assert (!g->run);
+	if (g->nvertices >= g->vertices_max) {
+		g->vertices_max = g->vertices_max ? g->vertices_max * 2 : 16;
+		g->vertices = xnrealloc (g->vertices, g->vertices_max,
+					 sizeof *g->vertices);
+	}
+	v = &g->vertices[g->nvertices++];
+	v->p = p;
+	v->builtin = builtin;
+	v->folded = 0;
+	v->status = -1;
+	return p;
+}
+
+static void graph_add_edge (pipeline_graph *g, int from, int to)
+{
+	if (g->nedges >= g->edges_max) {
+		g->edges_max = g->edges_max ? g->edges_max * 2 : 16;
+		g->edges = xnrealloc (g->edges, g->edges_max,
+				      sizeof *g->edges);
+	}
+	g->edges[g->nedges].from = from;
+	g->edges[g->nedges].to = to;
+	++g->nedges;
+}
+
+void pipeline_graph_add (pipeline_graph *g, pipeline *p, ...)
+{
+	va_list argv;
+	pipeline *arg;
+
+	va_start (argv, p);
+	for (arg = p; arg; arg = va_arg (argv, pipeline *)) {
+		/* The graph makes all the connections itself. */
+		assert (!arg->pids); /* not started */
+		assert (!arg->source && !arg->nsources && !arg->nsinks);
+		assert (graph_find (g, arg) == -1);
+		graph_add_vertex (g, arg, GRAPH_PIPELINE);
+	}
+	va_end (argv);
+}
+
+pipeline *pipeline_graph_add_tee (pipeline_graph *g)
+{
+	return graph_add_vertex (g, pipeline_new (), GRAPH_TEE);
+}
+
+pipeline *pipeline_graph_add_merge (pipeline_graph *g, const char *delim,
+				    size_t delimlen)
+{
+	pipeline *p = pipeline_new ();
+
+	pipeline_set_merge_delimiter (p, delim, delimlen);
+	return graph_add_vertex (g, p, GRAPH_MERGE);
+}
+
+/* Return the index of the edge from vertex from to vertex to, or -1. */
+static int graph_find_edge (pipeline_graph *g, int from, int to)
+{
+	int i;
+
+	for (i = 0; i < g->nedges; ++i) {
+		if (g->edges[i].from == from && g->edges[i].to == to)
+			return i;
+	}
+	return -1;
+}
+
+void pipeline_graph_connect (pipeline_graph *g, pipeline *from, pipeline *to)
+{
+	int i = graph_find (g, from), j = graph_find (g, to);
+
+	assert (!g->run);
+	assert (i != -1 && j != -1);
+	assert (i != j);
+	assert (graph_find_edge (g, i, j) == -1);
+	graph_add_edge (g, i, j);
+}
+
+/* Count the edges into (if in is non-zero) or out of vertex i. */
+static int graph_degree (pipeline_graph *g, int i, int in)
+{
+	int k, n = 0;
+
+	for (k = 0; k < g->nedges; ++k) {
+		if ((in ? g->edges[k].to : g->edges[k].from) == i)
+			++n;
+	}
+	return n;
+}
+
+static void graph_remove_edge (pipeline_graph *g, int k)
+{
+	g->edges[k] = g->edges[--g->nedges];
+}
+
+/* Fold the tee or merge vertex i into its neighbours if it can be done
+ * without changing what any vertex receives.  Returns non-zero if it was.
+ */
+static int graph_fold (pipeline_graph *g, int i)
+{
+	struct graph_vertex *v = &g->vertices[i];
+	int k, other = -1;
+
+	if (v->builtin == GRAPH_TEE) {
+		/* Hand each of its outputs to its only input. */
+		if (graph_degree (g, i, 1) != 1 || !graph_degree (g, i, 0))
+			return 0;
+		for (k = 0; k < g->nedges; ++k) {
+			if (g->edges[k].to == i)
+				other = g->edges[k].from;
+		}
+		for (k = 0; k < g->nedges; ++k) {
+			if (g->edges[k].from == i &&
+			    graph_find_edge (g, other, g->edges[k].to) != -1)
+				return 0;
+		}
+		for (k = g->nedges - 1; k >= 0; --k) {
+			if (g->edges[k].to == i)
+				graph_remove_edge (g, k);
+			else if (g->edges[k].from == i)
+				g->edges[k].from = other;
+		}
+	} else if (v->builtin == GRAPH_MERGE) {
+		/* Hand each of its inputs to its only output, if that has
+		 * no others.
+		 */
+		if (graph_degree (g, i, 0) != 1 || !graph_degree (g, i, 1))
+			return 0;
+		for (k = 0; k < g->nedges; ++k) {
+			if (g->edges[k].from == i)
+				other = g->edges[k].to;
+		}
+		if (graph_degree (g, other, 1) != 1 ||
+		    g->vertices[other].p->merge_delim)
+			return 0;
+		pipeline_set_merge_delimiter (g->vertices[other].p,
+					      v->p->merge_delim,
+					      v->p->merge_delimlen);
+		for (k = g->nedges - 1; k >= 0; --k) {
+			if (g->edges[k].from == i)
+				graph_remove_edge (g, k);
+			else if (g->edges[k].to == i)
+				g->edges[k].to = other;
+		}
+	} else
+		return 0;
+
+	debug ("folding pipeline graph vertex %d\n", i);
+	v->folded = 1;
+	return 1;
+}
+
+/* Return g's vertices, leaving out any that have been folded, in an order
+ * in which each comes after all those with edges into it, and set *n to
+ * their number.
+ */
+static int *graph_sort (pipeline_graph *g, int *n)
+{
+	int *order = xnmalloc (g->nvertices, sizeof *order);
+	int *indegree = xcalloc (g->nvertices, sizeof *indegree);
+	int head, i, k;
+
+	for (k = 0; k < g->nedges; ++k)
+		++indegree[g->edges[k].to];
+	*n = 0;
+	for (i = 0; i < g->nvertices; ++i) {
+		if (!g->vertices[i].folded && !indegree[i])
+			order[(*n)++] = i;
+	}
+	for (head = 0; head < *n; ++head) {
+		for (k = 0; k < g->nedges; ++k) {
+			if (g->edges[k].from == order[head] &&
+			    !--indegree[g->edges[k].to])
+				order[(*n)++] = g->edges[k].to;
+		}
+	}
+	for (i = 0; i < g->nvertices; ++i) {
+		if (!g->vertices[i].folded && indegree[i])
+			error (FATAL, 0, "pipeline graph contains a cycle");
+	}
+
+	free (indegree);
+	return order;
+}
+
+/* A merged source can have no other sinks, so give any source of a merge
+ * in g that has some a vertex of its own to pass its output through.
+ */
+static void graph_split (pipeline_graph *g)
+{
+	int nedges = g->nedges;
+	int k;
+
+	for (k = 0; k < nedges; ++k) {
+		int from = g->edges[k].from, to = g->edges[k].to;
+
+		if (graph_degree (g, to, 1) < 2 ||
+		    graph_degree (g, from, 0) < 2)
+			continue;
+		graph_add_vertex (g, pipeline_new (), GRAPH_PASSTHROUGH);
+		g->edges[k].to = g->nvertices - 1;
+		graph_add_edge (g, g->nvertices - 1, to);
+	}
+}
+
+/* Connect the pipelines in g as its edges say. */
+static void graph_connect (pipeline_graph *g)
+{
+	int i, k;
+
+	for (i = 0; i < g->nvertices; ++i) {
+		pipeline *sink = g->vertices[i].p;
+		int merge;
+
+		if (g->vertices[i].folded)
+			continue;
+		/* Built-in vertices only make sense with input. */
+		assert (g->vertices[i].builtin == GRAPH_PIPELINE ||
+			graph_degree (g, i, 1));
+		merge = (graph_degree (g, i, 1) > 1);
+		for (k = 0; k < g->nedges; ++k) {
+			pipeline *source;
+
+			if (g->edges[k].to != i)
+				continue;
+			source = g->vertices[g->edges[k].from].p;
+			if (merge)
+				pipeline_merge (sink, source, NULL);
+			else
+				pipeline_connect (source, sink, NULL);
+		}
+	}
+}
+
+int pipeline_graph_run (pipeline_graph *g)
+{
+	pipeline **pieces;
+	int *order;
+	int n, i, folded, failures = 0;
+
+	assert (!g->run);
+	g->run = 1;
+
+	do {
+		folded = 0;
+		for (i = 0; i < g->nvertices; ++i) {
+			if (!g->vertices[i].folded && graph_fold (g, i))
+				folded = 1;
+		}
+	} while (folded);
+	graph_split (g);
+	order = graph_sort (g, &n);
+	graph_connect (g);
+
+	/* List each vertex before those it reads from, so that pump_pieces
+	 * starts it first and each edge between a source and its only sink
+	 * is connected directly, and pump whatever remains.
+	 */
+	pieces = xnmalloc (n, sizeof *pieces);
+	for (i = 0; i < n; ++i)
+		pieces[i] = g->vertices[order[n - 1 - i]].p;
+	if (n)
+		pump_pieces (pieces, n);
+
+	/* Tear down from the sources onwards, so that each vertex is waited
+	 * for only once everything that feeds it has finished.
+	 */
+	for (i = 0; i < n; ++i) {
+		struct graph_vertex *v = &g->vertices[order[i]];
+
+		v->status = pipeline_wait (v->p);
+		if (v->status)
+			++failures;
+	}
+
+	free (pieces);
+	free (order);
+	return failures;
+}
+
+int pipeline_graph_get_status (pipeline_graph *g, pipeline *p)
+{
+	int i = graph_find (g, p);
+
+	assert (i != -1);
+	if (g->vertices[i].folded)
+		return g->run ? 0 : -1;
+	return g->vertices[i].status;
+}
+
+void pipeline_graph_free (pipeline_graph *g)
+{
+	int i;
+
+	if (!g)
+		return;
+	for (i = 0; i < g->nvertices; ++i)
+		pipeline_free (g->vertices[i].p);
+	free (g->edges);
+	free (g->vertices);
+	free (g);
+}
@@ -36,6 +36,95 @@ extern void init_debug (void);
 extern int debug_level;
 extern void debug (const char *message, ...) PIPELINE_ATTR_FORMAT_PRINTF(1, 2);
 
+/* Children exit with this status if execvp fails. */
+#define EXEC_FAILED_EXIT_STATUS 0xff
+
+extern void set_cloexec (int fd);
+extern pid_t wait_usage (pid_t pid, int *status, int options,
+			 struct rusage *usage);
+extern void close_fds_from (int lowfd);
+
+/* A command for the spawn server to start. */
+struct spawn_request {
+	const char *file;	/* passed to execvp */
+	char **argv;
+	char **envp;
+	int fds[3];		/* standard input, output, and error */
+	int nice;
+	int flags;		/* SPAWN_* */
+};
+
+#define SPAWN_DISCARD_ERR	0x1
+#define SPAWN_IGNORE_SIGINT	0x2
+#define SPAWN_IGNORE_SIGQUIT	0x4
+
+extern int spawn_server_running (void);
+extern pid_t spawn_server_spawn (const struct spawn_request *req);
+extern int spawn_server_wait (int block, pid_t *pid, int *status,
+			      struct rusage *usage);
+extern int spawn_server_fd (void);
+
+/* Pump data among the argc pipelines in pieces, as pipeline_pump does. */
+extern void pump_pieces (pipeline **pieces, int argc);
+
+/* A ring through which pipeline_pump submits many reads and writes with a
+ * single system call, if the kernel supports io_uring.  uring_new returns
+ * NULL if not.  Results are stored through the result pointers, as
+ * returned by read(2) or write(2) but with negated error numbers, once
+ * uring_run has returned.  uring_read reads into the buffer registered in
+ * slot index by uring_set_buffer, or into an unregistered one if index is
+ * -1.  The kernel waits for a descriptor to become ready, even if it is
+ * non-blocking, unless nowait is set, in which case the operation fails
+ * with -EAGAIN instead.
+ */
+struct uring;
+
+extern struct uring *uring_new (unsigned entries, unsigned nbufs);
+extern void uring_free (struct uring *ring);
+extern int uring_set_buffer (struct uring *ring, unsigned index, void *buf,
+			     size_t len);
+extern void uring_read (struct uring *ring, int fd, void *buf, size_t len,
+			int index, int nowait, ssize_t *result);
+extern void uring_write (struct uring *ring, int fd, const void *buf,
+			 size_t len, int nowait, ssize_t *result);
+extern int uring_run (struct uring *ring);
+
+/* Lifecycle events recorded by trace.c, for the pipeline whose trace_id is
+ * id.  The command is an index into the pipeline's commands, or -1 for
+ * events concerning the whole pipeline.
+ */
+enum trace_type {
+	TRACE_PIPELINE_START,	/* value is the number of commands */
+	TRACE_PIPELINE_END,	/* value is the pipeline's exit status */
+	TRACE_PIPE,		/* value is the pipe's capacity */
+	TRACE_COMMAND_START,	/* name is the command's name */
+	TRACE_FORK,
+	TRACE_SPAWN,
+	TRACE_SERVE,
+	TRACE_THREAD,
+	TRACE_EXEC,
+	TRACE_FIRST_BYTE,
+	TRACE_EOF,
+	TRACE_EXIT,		/* value is the wait status */
+	TRACE_REAP,		/* value is the wait status */
+	TRACE_PUMP		/* value is the total number of bytes moved */
+};
+
+extern int trace_enabled;
+extern void init_trace (void);
+extern int trace_pipeline_id (void);
+extern void trace_record (enum trace_type type, int id, int command,
+			  pid_t pid, long long value, const char *name);
+
+/* Record an event if tracing is enabled, at the cost of a single test if
+ * not.
+ */
+#define trace_event(type, id, command, pid, value, name) \
+	do { \
+		if (trace_enabled) \
+			trace_record (type, id, command, pid, value, name); \
+	} while (0)
+
 #ifndef HAVE_CLEARENV
 extern int clearenv (void);
 #endif
@@ -56,19 +145,36 @@ struct pipecmd {
 	char *name;
 	int nice;
 	int discard_err;	/* discard stderr? */
+	int pipe_size;		/* capacity of output pipe, or 0 */
 	int nenv;
 	int env_max;		/* size of allocated array */
 	struct pipecmd_env *env;
+	/* Environment resolved from env by pipecmd_get_env, or NULL if not
+	 * yet resolved; and a copy of environ at that time, or NULL if env
+	 * clears the environment and so does not depend on it.
+	 */
+	char **envp;
+	char **envp_base;
+	pipecmd_exit_callback_type *exit_func;
+	void *exit_data;
 	union {
 		struct pipecmd_process {
 			int argc;
 			int argv_max;	/* size of allocated array */
 			char **argv;
+			char *path;	/* set by pipecmd_pin_path, or NULL */
+			/* Resolved by the parent for a member of a
+			 * sequence, or NULL to leave the search to execvp.
+			 */
+			char *found;
 		} process;
 		struct pipecmd_function {
 			pipecmd_function_type *func;
+			/* set instead of func by pipecmd_new_fd_function */
+			pipecmd_fd_function_type *fd_func;
 			pipecmd_function_free_type *free_func;
 			void *data;
+			int thread;	/* run in a thread if possible? */
 		} function;
 		struct pipecmd_sequence {
 			int ncommands;
@@ -78,6 +184,14 @@ struct pipecmd {
 	} u;
 };
 
+/* What a command of a started pipeline cost to run. */
+struct pipecmd_usage {
+	struct timeval start;	/* when the command was started */
+	struct timeval elapsed;	/* until its status was collected */
+	struct rusage usage;
+	int collected;		/* non-zero once the above are complete */
+};
+
 enum pipeline_redirect {
 	REDIRECT_NONE,
 	REDIRECT_FD,
@@ -89,7 +203,13 @@ struct pipeline {
 	int commands_max;	/* size of allocated array */
 	pipecmd **commands;
 	pid_t *pids;
+	int *pidfds;		/* -1 if unavailable or already reaped */
 	int *statuses;		/* -1 until command exits */
+	int *served;		/* non-zero if started by the spawn server */
+	/* Commands running in threads, or NULL entries for those running
+	 * in child processes.
+	 */
+	struct pipeline_thread **threads;
 
 	/* REDIRECT_NONE for no redirection; REDIRECT_FD for redirection
 	 * from/to file descriptor; REDIRECT_FILE_NAME for redirection
@@ -129,12 +249,52 @@ struct pipeline {
 	 */
 	struct pipeline *source;
 
-	/* Private buffer for use by read/peek functions. */
+	/* Also set by pipeline_connect(): the number of pipelines reading
+	 * their input from this one.  Defaults to 0.
+	 */
+	int nsinks;
+
+	/* Set by pipeline_merge() to record that this pipeline reads its
+	 * input from several other pipelines, whose output pipeline_pump()
+	 * interleaves.  Default to NULL and 0.
+	 */
+	struct pipeline **sources;
+	int nsources;
+
+	/* Set by pipeline_set_merge_delimiter(): if non-NULL, pipeline_pump()
+	 * only switches between the sources of this pipeline at the end of a
+	 * record terminated by this delimiter.  Default to NULL and 0.
+	 */
+	char *merge_delim;
+	size_t merge_delimlen;
+
+	/* Set by pipeline_set_pump_budget(): the most output that
+	 * pipeline_pump() may hold in memory for this pipeline's sinks, or 0
+	 * for no limit, and a PIPELINE_BUDGET_* policy for what to do about
+	 * more.  Default to 0 and PIPELINE_BUDGET_BLOCK.
+	 */
+	size_t pump_budget;
+	int pump_policy;
+
+	/* Updated by pipeline_pump(): the amount of its source's output that
+	 * this sink has yet to receive.  Defaults to 0.
+	 */
+	size_t pump_lag;
+
+	/* Private buffer for use by read/peek functions.  Unread data is
+	 * moved to the front when it is worth doing so, and the buffer
+	 * shrinks back to buffer_high_water bytes when it no longer needs
+	 * to be larger.
+	 */
 	char *buffer;
 	size_t buflen, bufmax;
+	size_t buffer_high_water;
 
-	/* The last line returned by readline/peekline. Private. */
+	/* The last line returned by readline/peekline, and the size of the
+	 * space allocated for it. Private.
+	 */
 	char *line_cache;
+	size_t line_cache_max;
 
 	/* The amount of data at the end of buffer which has been
 	 * read-ahead, either by an explicit peek or by readline/peekline
@@ -146,6 +306,45 @@ struct pipeline {
 	 * like system(). Defaults to 1.
 	 */
 	int ignore_signals;
+
+	/* If set, close all file descriptors other than standard input,
+	 * output, and error in child processes. Defaults to 0.
+	 */
+	int close_fds;
+
+	/* Capacity to request for pipes that don't belong to a command with
+	 * its own setting, or 0 for the system default; and, once started,
+	 * the capacity actually obtained for each pipe, indexed as for
+	 * pipeline_get_pipe_size().
+	 */
+	int pipe_size;
+	int *pipe_sizes;
+
+	/* The resources used by each command, once started.  Kept, like
+	 * pipe_sizes, until the pipeline is started again or freed.
+	 */
+	struct pipecmd_usage *usages;
+
+	/* Identifies the pipeline in trace events once started, or 0 if it
+	 * was started while tracing was disabled; and 1 once the first byte
+	 * of its output has been traced, or 2 once its end has.
+	 */
+	int trace_id;
+	int traced_output;
+
+	/* Set up by pipeline_get_wait_fd(): an epoll descriptor that becomes
+	 * readable when a command may have exited, and a pipe written to
+	 * whenever a status is collected for us other than through a
+	 * process file descriptor.  Default to -1.
+	 */
+	int wait_fd;
+	int wake[2];
+
+	/* The return value and the signal to re-raise so far, kept between
+	 * calls to pipeline_try_wait_all().
+	 */
+	int wait_ret;
+	int raise_signal;
 };
 
 #endif /* PIPELINE_PRIVATE_H */
@@ -31,6 +31,7 @@
 #include <signal.h>
 #include <errno.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -40,6 +41,30 @@
 #include <string.h>
 #include <sys/wait.h>
 
+#ifdef HAVE_SPAWN_H
+#  include <spawn.h>
+#endif
+
+#if defined(HAVE_PIDFD_OPEN) && defined(HAVE_SYS_PIDFD_H)
+#  include <sys/pidfd.h>
+#  include <sys/syscall.h>
+#  define USE_PIDFD 1
+#endif
+
+#if defined(HAVE_EPOLL_CREATE1) && defined(HAVE_SYS_EPOLL_H)
+#  include <sys/epoll.h>
+#  define USE_EPOLL 1
+#endif
+
+#if defined(HAVE_SPLICE) && defined(HAVE_TEE) && defined(SPLICE_F_NONBLOCK) \
+    && !defined(USE_SOCKETPAIR_PIPE)
+#  define USE_SPLICE 1
+#endif
+
+#ifdef USE_POSIX_THREADS
+#  include <pthread.h>
+#endif
+
 #include "dirname.h"
 #include "full-write.h"
 #include "safe-read.h"
@@ -103,16 +128,23 @@ pipecmd *pipecmd_new (const char *name)
 	cmd->name = xstrdup (name);
 	cmd->nice = 0;
 	cmd->discard_err = 0;
+	cmd->pipe_size = 0;
+	cmd->exit_func = NULL;
+	cmd->exit_data = NULL;
 
 	cmd->nenv = 0;
 	cmd->env_max = 4;
 	cmd->env = xnmalloc (cmd->env_max, sizeof *cmd->env);
+	cmd->envp = NULL;
+	cmd->envp_base = NULL;
 
 	cmdp = &cmd->u.process;
 
 	cmdp->argc = 0;
 	cmdp->argv_max = 4;
 	cmdp->argv = xnmalloc (cmdp->argv_max, sizeof *cmdp->argv);
+	cmdp->path = NULL;
+	cmdp->found = NULL;
 
 	/* argv[0] is the basename of the command name. */
 	name_base = base_name (name);
@@ -299,16 +331,35 @@ pipecmd *pipecmd_new_function (const char *name,
 	cmd->name = xstrdup (name);
 	cmd->nice = 0;
 	cmd->discard_err = 0;
+	cmd->pipe_size = 0;
+	cmd->exit_func = NULL;
+	cmd->exit_data = NULL;
 
 	cmd->nenv = 0;
 	cmd->env_max = 4;
 	cmd->env = xnmalloc (cmd->env_max, sizeof *cmd->env);
+	cmd->envp = NULL;
+	cmd->envp_base = NULL;
 
 	cmdf = &cmd->u.function;
 
 	cmdf->func = func;
+	cmdf->fd_func = NULL;
 	cmdf->free_func = free_func;
 	cmdf->data = data;
+	cmdf->thread = 0;
+
+	return cmd;
+}
+
+pipecmd *pipecmd_new_fd_function (const char *name,
+				  pipecmd_fd_function_type *func,
+				  pipecmd_function_free_type *free_func,
+				  void *data)
+{
+	pipecmd *cmd = pipecmd_new_function (name, NULL, free_func, data);
+
+	cmd->u.function.fd_func = func;
 
 	return cmd;
 }
@@ -323,10 +374,15 @@ pipecmd *pipecmd_new_sequencev (const char *name, va_list cmdv)
 	cmd->name = xstrdup (name);
 	cmd->nice = 0;
 	cmd->discard_err = 0;
+	cmd->pipe_size = 0;
+	cmd->exit_func = NULL;
+	cmd->exit_data = NULL;
 
 	cmd->nenv = 0;
 	cmd->env_max = 4;
 	cmd->env = xnmalloc (cmd->env_max, sizeof *cmd->env);
+	cmd->envp = NULL;
+	cmd->envp_base = NULL;
 
 	cmds = &cmd->u.sequence;
 
@@ -355,24 +411,23 @@ pipecmd *pipecmd_new_sequence (const char *name, ...)
 	return cmd;
 }
 
-static void passthrough (void *data PIPELINE_ATTR_UNUSED)
+static int passthrough (int infd, int outfd, void *data PIPELINE_ATTR_UNUSED)
 {
 	for (;;) {
 		char buffer[4096];
-		int r = safe_read (STDIN_FILENO, buffer, 4096);
+		int r = safe_read (infd, buffer, 4096);
 		if (r <= 0)
 			break;
-		if (full_write (STDOUT_FILENO, buffer,
-				(size_t) r) < (size_t) r)
+		if (full_write (outfd, buffer, (size_t) r) < (size_t) r)
 			break;
 	}
 
-	return;
+	return 0;
 }
 
 pipecmd *pipecmd_new_passthrough (void)
 {
-	return pipecmd_new_function ("cat", &passthrough, NULL, NULL);
+	return pipecmd_new_fd_function ("cat", &passthrough, NULL, NULL);
 }
 
 pipecmd *pipecmd_dup (pipecmd *cmd)
@@ -384,11 +439,16 @@ pipecmd *pipecmd_dup (pipecmd *cmd)
 	newcmd->name = xstrdup (cmd->name);
 	newcmd->nice = cmd->nice;
 	newcmd->discard_err = cmd->discard_err;
+	newcmd->pipe_size = cmd->pipe_size;
+	newcmd->exit_func = cmd->exit_func;
+	newcmd->exit_data = cmd->exit_data;
 
 	newcmd->nenv = cmd->nenv;
 	newcmd->env_max = cmd->env_max;
 	assert (newcmd->nenv <= newcmd->env_max);
 	newcmd->env = xmalloc (newcmd->env_max * sizeof *newcmd->env);
+	newcmd->envp = NULL;
+	newcmd->envp_base = NULL;
 
 	for (i = 0; i < cmd->nenv; ++i) {
 		newcmd->env[i].name =
@@ -411,6 +471,9 @@ pipecmd *pipecmd_dup (pipecmd *cmd)
 			for (i = 0; i < cmdp->argc; ++i)
 				newcmdp->argv[i] = xstrdup (cmdp->argv[i]);
 			newcmdp->argv[cmdp->argc] = NULL;
+			newcmdp->path = cmdp->path ? xstrdup (cmdp->path)
+						   : NULL;
+			newcmdp->found = NULL;
 
 			break;
 		}
@@ -420,8 +483,10 @@ pipecmd *pipecmd_dup (pipecmd *cmd)
 			struct pipecmd_function *newcmdf = &newcmd->u.function;
 
 			newcmdf->func = cmdf->func;
+			newcmdf->fd_func = cmdf->fd_func;
 			newcmdf->free_func = cmdf->free_func;
 			newcmdf->data = cmdf->data;
+			newcmdf->thread = cmdf->thread;
 
 			break;
 		}
@@ -533,8 +598,41 @@ void pipecmd_discard_err (pipecmd *cmd, int discard_err)
 	cmd->discard_err = discard_err;
 }
 
+void pipecmd_set_pipe_size (pipecmd *cmd, int size)
+{
+	cmd->pipe_size = size;
+}
+
+void pipecmd_thread (pipecmd *cmd, int thread)
+{
+	if (cmd->tag != PIPECMD_FUNCTION)
+		return;
+	cmd->u.function.thread = thread;
+}
+
+void pipecmd_pin_path (pipecmd *cmd, const char *path)
+{
+	struct pipecmd_process *cmdp;
+
+	if (cmd->tag != PIPECMD_PROCESS)
+		return;
+	cmdp = &cmd->u.process;
+	free (cmdp->path);
+	cmdp->path = path ? xstrdup (path) : NULL;
+}
+
+/* Discard cmd's resolved environment, if any. */
+static void pipecmd_forget_env (pipecmd *cmd)
+{
+	free (cmd->envp);
+	cmd->envp = NULL;
+	free (cmd->envp_base);
+	cmd->envp_base = NULL;
+}
+
 void pipecmd_setenv (pipecmd *cmd, const char *name, const char *value)
 {
+	pipecmd_forget_env (cmd);
 	if (cmd->nenv >= cmd->env_max) {
 		cmd->env_max *= 2;
 		cmd->env = xrealloc (cmd->env,
@@ -548,6 +646,7 @@ void pipecmd_setenv (pipecmd *cmd, const char *name, const char *value)
 
 void pipecmd_unsetenv (pipecmd *cmd, const char *name)
 {
+	pipecmd_forget_env (cmd);
 	if (cmd->nenv >= cmd->env_max) {
 		cmd->env_max *= 2;
 		cmd->env = xrealloc (cmd->env,
@@ -561,6 +660,7 @@ void pipecmd_unsetenv (pipecmd *cmd, const char *name)
 
 void pipecmd_clearenv (pipecmd *cmd)
 {
+	pipecmd_forget_env (cmd);
 	if (cmd->nenv >= cmd->env_max) {
 		cmd->env_max *= 2;
 		cmd->env = xrealloc (cmd->env,
@@ -572,6 +672,13 @@ void pipecmd_clearenv (pipecmd *cmd)
 	++cmd->nenv;
 }
 
+void pipecmd_exit_callback (pipecmd *cmd, pipecmd_exit_callback_type *func,
+			    void *data)
+{
+	cmd->exit_func = func;
+	cmd->exit_data = data;
+}
+
 void pipecmd_sequence_command (pipecmd *cmd, pipecmd *child)
 {
 	struct pipecmd_sequence *cmds;
@@ -690,14 +797,335 @@ char *pipecmd_tostring (pipecmd *cmd)
 	return out;
 }
 
-/* Children exit with this status if execvp fails. */
-#define EXEC_FAILED_EXIT_STATUS 0xff
+/* Build an environment array for cmd by applying its environment
+ * operations, in order, to the environment base that it inherits.
+ * Inherited entries point into base; entries set by cmd are composed into
+ * the same allocation as the array itself, so the caller need only free
+ * the result.  Returns NULL if cmd has no environment operations.
+ */
+static char **pipecmd_build_env (pipecmd *cmd, char **base)
+{
+	struct env_entry {
+		const char *str;	/* inherited "NAME=value", or NULL */
+		int op;			/* index into cmd->env otherwise */
+	} *entries;
+	int nentries = 0, max_entries;
+	size_t size;
+	char **envp, *strings;
+	int i, j;
+
+	if (!cmd->nenv)
+		return NULL;
+
+	for (max_entries = 0; base && base[max_entries]; ++max_entries)
+		;
+	max_entries += cmd->nenv;
+	entries = xnmalloc (max_entries, sizeof *entries);
+	for (i = 0; base && base[i]; ++i) {
+		entries[nentries].str = base[i];
+		entries[nentries].op = -1;
+		++nentries;
+	}
+
+	for (i = 0; i < cmd->nenv; ++i) {
+		const char *name = cmd->env[i].name;
+		size_t namelen;
+
+		if (!name) {
+			/* clearenv */
+			nentries = 0;
+			continue;
+		}
+
+		/* Remove any existing definitions of name. */
+		namelen = strlen (name);
+		for (j = 0; j < nentries; ) {
+			const char *entry_name = entries[j].str;
+			int match;
+
+			if (entry_name)
+				match = !strncmp (entry_name, name, namelen) &&
+					entry_name[namelen] == '=';
+			else
+				match = !strcmp (cmd->env[entries[j].op].name,
+						 name);
+			if (match)
+				entries[j] = entries[--nentries];
+			else
+				++j;
+		}
+
+		if (cmd->env[i].value) {
+			entries[nentries].str = NULL;
+			entries[nentries].op = i;
+			++nentries;
+		}
+	}
+
+	size = (nentries + 1) * sizeof *envp;
+	for (i = 0; i < nentries; ++i) {
+		if (!entries[i].str) {
+			struct pipecmd_env *env = &cmd->env[entries[i].op];
+			size += strlen (env->name) + strlen (env->value) + 2;
+		}
+	}
+
+	envp = xmalloc (size);
+	strings = (char *) (envp + nentries + 1);
+	for (i = 0; i < nentries; ++i) {
+		if (entries[i].str)
+			envp[i] = (char *) entries[i].str;
+		else {
+			struct pipecmd_env *env = &cmd->env[entries[i].op];
+			size_t namelen = strlen (env->name);
+			size_t valuelen = strlen (env->value);
+
+			envp[i] = strings;
+			memcpy (strings, env->name, namelen);
+			strings[namelen] = '=';
+			memcpy (strings + namelen + 1, env->value, valuelen + 1);
+			strings += namelen + valuelen + 2;
+		}
+	}
+	envp[nentries] = NULL;
+
+	free (entries);
+	return envp;
+}
+
+/* Return the environment that cmd should run with when it inherits base,
+ * or NULL if it has no environment operations.  The result remains owned
+ * by cmd, and is only rebuilt when cmd's environment operations change, or
+ * when base changes if cmd inherits from it, so that a forked child
+ * calling this after its parent has done so needn't allocate memory.
+ */
+static char **pipecmd_get_env_from (pipecmd *cmd, char **base)
+{
+	int i, n;
+
+	if (!cmd->nenv)
+		return NULL;
+
+	if (cmd->envp) {
+		if (!cmd->envp_base)
+			return cmd->envp;
+		for (i = 0; base && base[i]; ++i)
+			if (cmd->envp_base[i] != base[i])
+				break;
+		if ((!base || !base[i]) && !cmd->envp_base[i])
+			return cmd->envp;
+		pipecmd_forget_env (cmd);
+	}
+
+	cmd->envp = pipecmd_build_env (cmd, base);
+
+	/* Inherited entries only survive if nothing clears them. */
+	for (i = 0; i < cmd->nenv; ++i)
+		if (!cmd->env[i].name)
+			return cmd->envp;
+	for (n = 0; base && base[n]; ++n)
+		;
+	cmd->envp_base = xnmalloc (n + 1, sizeof *cmd->envp_base);
+	for (i = 0; i < n; ++i)
+		cmd->envp_base[i] = base[i];
+	cmd->envp_base[n] = NULL;
+
+	return cmd->envp;
+}
 
-/* When called internally during pipeline execution, this is called in the
- * forked child process, with file descriptors already set up.
+/* Return the environment that cmd should run with, or NULL if it has no
+ * environment operations.
  */
-void pipecmd_exec (pipecmd *cmd)
+static char **pipecmd_get_env (pipecmd *cmd)
+{
+	return pipecmd_get_env_from (cmd, environ);
+}
+
+/* A process-wide cache of the results of searching PATH for commands,
+ * keyed on the command name and the value of PATH searched, so that
+ * repeatedly starting the same command costs one stat rather than a failed
+ * exec for each directory in PATH that doesn't contain it.  As with the
+ * shell's hash table, an entry is only discarded when the file it names
+ * changes or goes away, not when a command of the same name is installed
+ * earlier in PATH.
+ */
+struct path_cache_entry {
+	char *name;
+	char *path_var;
+	char *file;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+};
+
+#define PATH_CACHE_MAX 64
+
+static struct path_cache_entry path_cache[PATH_CACHE_MAX];
+static int path_cache_size = 0;
+#ifdef USE_POSIX_THREADS
+static pthread_mutex_t path_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void path_cache_remove (int i)
+{
+	free (path_cache[i].name);
+	free (path_cache[i].path_var);
+	free (path_cache[i].file);
+	path_cache[i] = path_cache[--path_cache_size];
+}
+
+/* Search path_var for an executable regular file called name, returning
+ * its full name, which remains owned by the cache; or NULL if name is not
+ * found or must be left to execvp because PATH contains relative
+ * directories.  The caller must hold path_cache_lock.
+ */
+static const char *path_cache_lookup (const char *name, const char *path_var)
+{
+	struct path_cache_entry *entry;
+	struct stat st;
+	const char *dir, *end;
+	size_t namelen;
+	int i;
+
+	for (i = 0; i < path_cache_size; ++i) {
+		entry = &path_cache[i];
+		if (strcmp (entry->name, name) ||
+		    strcmp (entry->path_var, path_var))
+			continue;
+		if (stat (entry->file, &st) == 0 &&
+		    st.st_dev == entry->dev && st.st_ino == entry->ino &&
+		    st.st_mtime == entry->mtime)
+			return entry->file;
+		debug ("%s changed; searching PATH again\n", entry->file);
+		path_cache_remove (i);
+		break;
+	}
+
+	namelen = strlen (name);
+	for (dir = path_var; ; dir = end + 1) {
+		char *file;
+
+		end = strchr (dir, ':');
+		if (!end)
+			end = dir + strlen (dir);
+		/* Relative directories depend on the current directory. */
+		if (*dir != '/')
+			return NULL;
+		file = xmalloc ((end - dir) + namelen + 2);
+		memcpy (file, dir, end - dir);
+		file[end - dir] = '/';
+		memcpy (file + (end - dir) + 1, name, namelen + 1);
+		if (stat (file, &st) == 0 && S_ISREG (st.st_mode) &&
+		    access (file, X_OK) == 0) {
+			if (path_cache_size == PATH_CACHE_MAX)
+				path_cache_remove (0);
+			entry = &path_cache[path_cache_size++];
+			entry->name = xstrdup (name);
+			entry->path_var = xstrdup (path_var);
+			entry->file = file;
+			entry->dev = st.st_dev;
+			entry->ino = st.st_ino;
+			entry->mtime = st.st_mtime;
+			return file;
+		}
+		free (file);
+		if (!*end)
+			return NULL;
+	}
+}
+
+/* Return the full name of the executable regular file called name in
+ * path_var, as a newly allocated string; or NULL if name is not found or
+ * must be left to execvp, for instance because it contains a slash.
+ */
+static char *find_in_path (const char *name, const char *path_var)
+{
+	const char *file;
+	char *ret;
+
+	if (!*name || strchr (name, '/') || !path_var)
+		return NULL;
+
+#ifdef USE_POSIX_THREADS
+	pthread_mutex_lock (&path_cache_lock);
+#endif
+	file = path_cache_lookup (name, path_var);
+	ret = file ? xstrdup (file) : NULL;
+#ifdef USE_POSIX_THREADS
+	pthread_mutex_unlock (&path_cache_lock);
+#endif
+	return ret;
+}
+
+/* Return the full name of the file that cmd should execute when it
+ * inherits the environment base, as a newly allocated string, or NULL if
+ * execvp should search for it.  PATH is taken from cmd's own environment
+ * if it changes it.
+ */
+static char *pipecmd_get_path_from (pipecmd *cmd, char **base)
+{
+	struct pipecmd_process *cmdp;
+	char **envp;
+
+	if (cmd->tag != PIPECMD_PROCESS)
+		return NULL;
+	cmdp = &cmd->u.process;
+	if (cmdp->path)
+		return xstrdup (cmdp->path);
+
+	envp = pipecmd_get_env_from (cmd, base);
+	if (!envp)
+		envp = base;
+	for (; envp && *envp; ++envp)
+		if (!strncmp (*envp, "PATH=", 5))
+			return find_in_path (cmd->name, *envp + 5);
+	return NULL;
+}
+
+static char *pipecmd_get_path (pipecmd *cmd)
+{
+	return pipecmd_get_path_from (cmd, environ);
+}
+
+/* Resolve the environment and the file to execute of each member of the
+ * sequence cmd, which inherits the environment base, so that a child
+ * forked to run the sequence can execute them without taking
+ * path_cache_lock or allocating memory; another thread may have held the
+ * lock when the child was forked.
+ */
+static void pipecmd_resolve_sequence (pipecmd *cmd, char **base)
+{
+	struct pipecmd_sequence *cmds = &cmd->u.sequence;
+	char **envp = pipecmd_get_env_from (cmd, base);
+	int i;
+
+	if (envp)
+		base = envp;
+	for (i = 0; i < cmds->ncommands; ++i) {
+		pipecmd *child = cmds->commands[i];
+
+		pipecmd_get_env_from (child, base);
+		if (child->tag == PIPECMD_PROCESS) {
+			struct pipecmd_process *childp = &child->u.process;
+
+			free (childp->found);
+			childp->found = pipecmd_get_path_from (child, base);
+		} else if (child->tag == PIPECMD_SEQUENCE)
+			pipecmd_resolve_sequence (child, base);
+	}
+}
+
+/* Execute cmd, using path as the file to execute if it is non-NULL.  When
+ * called internally during pipeline execution, this is called in the
+ * forked child process, with file descriptors already set up, and with
+ * path and cmd's environment already resolved by the parent.
+ */
+static void pipecmd_exec_path (pipecmd *cmd, const char *path)
+	PIPELINE_ATTR_NORETURN;
+
+static void pipecmd_exec_path (pipecmd *cmd, const char *path)
 {
+	char **envp = pipecmd_get_env (cmd);
 	int i;
 
 	if (cmd->nice)
@@ -713,41 +1141,49 @@ void pipecmd_exec (pipecmd *cmd)
 		}
 	}
 
-	for (i = 0; i < cmd->nenv; ++i) {
-		if (cmd->env[i].name) {
-			if (cmd->env[i].value)
-				setenv (cmd->env[i].name,
-					cmd->env[i].value, 1);
-			else
-				unsetenv (cmd->env[i].name);
-		} else
-			clearenv ();
-	}
-
 	switch (cmd->tag) {
 		case PIPECMD_PROCESS: {
 			struct pipecmd_process *cmdp = &cmd->u.process;
-			execvp (cmd->name, cmdp->argv);
+			/* Set environ rather than calling execvpe, which
+			 * would search the parent's PATH rather than the
+			 * command's.  Given a name containing a slash,
+			 * execvp makes a single attempt to execute it, but
+			 * still knows how to run scripts without a "#!" line.
+			 */
+			if (envp)
+				environ = envp;
+			execvp (path ? path : cmd->name, cmdp->argv);
 			break;
 		}
 
-		/* TODO: ideally, could there be a facility
-		 * to execute non-blocking functions without
-		 * needing to fork?
+		/* See pipeline_thread_start for functions that can be
+		 * run without needing to fork.
 		 */
 		case PIPECMD_FUNCTION: {
 			struct pipecmd_function *cmdf = &cmd->u.function;
-			(*cmdf->func) (cmdf->data);
+			int status = 0;
+
+			if (envp)
+				environ = envp;
+			if (cmdf->fd_func)
+				status = (*cmdf->fd_func) (STDIN_FILENO,
+							   STDOUT_FILENO,
+							   cmdf->data);
+			else
+				(*cmdf->func) (cmdf->data);
 			/* pacify valgrind et al */
 			if (cmdf->free_func)
 				(*cmdf->free_func) (cmdf->data);
-			exit (0);
+			exit (status);
 		}
 
 		case PIPECMD_SEQUENCE: {
 			struct pipecmd_sequence *cmds = &cmd->u.sequence;
 			struct sigaction sa;
 
+			if (envp)
+				environ = envp;
+
 			/* Flush all pending output so that subprocesses
 			 * don't inherit it.
 			 */
@@ -773,7 +1209,11 @@ void pipecmd_exec (pipecmd *cmd)
 				if (pid < 0)
 					error (FATAL, errno, "fork failed");
 				if (pid == 0)
-					pipecmd_exec (child);
+					pipecmd_exec_path
+						(child,
+						 child->tag == PIPECMD_PROCESS
+						 ? child->u.process.found
+						 : NULL);
 				debug ("Started \"%s\", pid %d\n",
 				       child->name, pid);
 
@@ -832,6 +1272,15 @@ void pipecmd_exec (pipecmd *cmd)
 	exit (EXEC_FAILED_EXIT_STATUS);
 }
 
+/* This is normally called in a child forked by the caller, so leave
+ * searching PATH to execvp rather than using the cache.
+ */
+void pipecmd_exec (pipecmd *cmd)
+{
+	pipecmd_exec_path (cmd, cmd->tag == PIPECMD_PROCESS
+				? cmd->u.process.path : NULL);
+}
+
 void pipecmd_free (pipecmd *cmd)
 {
 	int i;
@@ -846,6 +1295,7 @@ void pipecmd_free (pipecmd *cmd)
 		free (cmd->env[i].value);
 	}
 	free (cmd->env);
+	pipecmd_forget_env (cmd);
 
 	switch (cmd->tag) {
 		case PIPECMD_PROCESS: {
@@ -854,6 +1304,8 @@ void pipecmd_free (pipecmd *cmd)
 			for (i = 0; i < cmdp->argc; ++i)
 				free (cmdp->argv[i]);
 			free (cmdp->argv);
+			free (cmdp->path);
+			free (cmdp->found);
 
 			break;
 		}
@@ -879,6 +1331,11 @@ void pipecmd_free (pipecmd *cmd)
 
 /* Functions to build pipelines. */
 
+/* Size to which a pipeline's read buffer shrinks back once it no longer
+ * holds that much unread data.
+ */
+#define DEFAULT_BUFFER_HIGH_WATER	65536
+
 pipeline *pipeline_new (void)
 {
 	pipeline *p = XMALLOC (pipeline);
@@ -886,18 +1343,41 @@ pipeline *pipeline_new (void)
 	p->commands_max = 4;
 	p->commands = xnmalloc (p->commands_max, sizeof *p->commands);
 	p->pids = NULL;
+	p->pidfds = NULL;
+	p->served = NULL;
 	p->statuses = NULL;
+	p->threads = NULL;
 	p->redirect_in = p->redirect_out = REDIRECT_NONE;
 	p->want_in = p->want_out = 0;
 	p->want_infile = p->want_outfile = NULL;
 	p->infd = p->outfd = -1;
 	p->infile = p->outfile = NULL;
 	p->source = NULL;
+	p->nsinks = 0;
+	p->sources = NULL;
+	p->nsources = 0;
+	p->merge_delim = NULL;
+	p->merge_delimlen = 0;
+	p->pump_budget = 0;
+	p->pump_policy = PIPELINE_BUDGET_BLOCK;
+	p->pump_lag = 0;
 	p->buffer = NULL;
 	p->buflen = p->bufmax = 0;
+	p->buffer_high_water = DEFAULT_BUFFER_HIGH_WATER;
 	p->line_cache = NULL;
+	p->line_cache_max = 0;
 	p->peek_offset = 0;
 	p->ignore_signals = 0;
+	p->close_fds = 0;
+	p->pipe_size = 0;
+	p->pipe_sizes = NULL;
+	p->usages = NULL;
+	p->trace_id = 0;
+	p->traced_output = 0;
+	p->wait_fd = -1;
+	p->wake[0] = p->wake[1] = -1;
+	p->wait_ret = 0;
+	p->raise_signal = 0;
 	return p;
 }
 
@@ -959,7 +1439,10 @@ pipeline *pipeline_join (pipeline *p1, pipeline *p2)
 	p->commands_max = p1->ncommands + p2->ncommands;
 	p->commands = xnmalloc (p->commands_max, sizeof *p->commands);
 	p->pids = NULL;
+	p->pidfds = NULL;
+	p->served = NULL;
 	p->statuses = NULL;
+	p->threads = NULL;
 	p->redirect_in = p1->redirect_in;
 	p->want_in = p1->want_in;
 	p->want_infile = p1->want_infile;
@@ -971,11 +1454,32 @@ pipeline *pipeline_join (pipeline *p1, pipeline *p2)
 	p->infile = p1->infile;
 	p->outfile = p2->outfile;
 	p->source = NULL;
+	p->nsinks = 0;
+	p->sources = NULL;
+	p->nsources = 0;
+	p->merge_delim = NULL;
+	p->merge_delimlen = 0;
+	p->pump_budget = p2->pump_budget;
+	p->pump_policy = p2->pump_policy;
+	p->pump_lag = 0;
 	p->buffer = NULL;
 	p->buflen = p->bufmax = 0;
+	p->buffer_high_water = p2->buffer_high_water;
 	p->line_cache = NULL;
+	p->line_cache_max = 0;
 	p->peek_offset = 0;
 	p->ignore_signals = (p1->ignore_signals || p2->ignore_signals);
+	p->close_fds = (p1->close_fds || p2->close_fds);
+	p->pipe_size = (p1->pipe_size > p2->pipe_size ? p1->pipe_size
+						       : p2->pipe_size);
+	p->pipe_sizes = NULL;
+	p->usages = NULL;
+	p->trace_id = 0;
+	p->traced_output = 0;
+	p->wait_fd = -1;
+	p->wake[0] = p->wake[1] = -1;
+	p->wait_ret = 0;
+	p->raise_signal = 0;
 
 	for (i = 0; i < p1->ncommands; ++i)
 		p->commands[i] = pipecmd_dup (p1->commands[i]);
@@ -1001,22 +1505,54 @@ void pipeline_connect (pipeline *source, pipeline *sink, ...)
 	va_start (argv, sink);
 	for (arg = sink; arg; arg = va_arg (argv, pipeline *)) {
 		assert (!arg->pids); /* not started */
+		assert (!arg->nsources); /* not merging other sources */
+		/* A sink can only read from one source at a time. */
+		if (arg->source)
+			--arg->source->nsinks;
 		arg->source = source;
+		++source->nsinks;
 		pipeline_want_in (arg, -1);
+	}
+	va_end (argv);
+}
+
+void pipeline_merge (pipeline *sink, pipeline *source, ...)
+{
+	va_list argv;
+	pipeline *arg;
+
+	assert (!sink->pids); /* not started */
+	assert (!sink->source); /* not connected to a single source */
 
-		/* Zero-command sinks should represent data being passed
-		 * straight through from the input to the output.
-		 * Unfortunately pipeline_start and pipeline_pump don't
-		 * handle this very well between them; a zero-command
-		 * pipeline has the write end of its input pipe wrongly
-		 * stashed in outfd and then pipeline_pump can't handle it
-		 * because it has nowhere to send output. Until this is
-		 * fixed, this kludge is necessary.
+	va_start (argv, source);
+	for (arg = source; arg; arg = va_arg (argv, pipeline *)) {
+		/* As for pipeline_connect, but a source may only have one
+		 * sink when its output is merged with others'.
 		 */
-		if (arg->ncommands == 0)
-			pipeline_command (arg, pipecmd_new_passthrough ());
+		if (!arg->pids)
+			pipeline_want_out (arg, -1);
+		assert (arg->redirect_out == REDIRECT_FD);
+		assert (arg->want_out < 0);
+		assert (!arg->nsinks);
+		++arg->nsinks;
+		sink->sources = xnrealloc (sink->sources, sink->nsources + 1,
+					   sizeof *sink->sources);
+		sink->sources[sink->nsources++] = arg;
 	}
 	va_end (argv);
+	pipeline_want_in (sink, -1);
+}
+
+void pipeline_set_merge_delimiter (pipeline *sink, const char *delim,
+				   size_t delimlen)
+{
+	free (sink->merge_delim);
+	sink->merge_delim = NULL;
+	sink->merge_delimlen = 0;
+	if (delim && delimlen) {
+		sink->merge_delim = xmemdup (delim, delimlen);
+		sink->merge_delimlen = delimlen;
+	}
 }
 
 void pipeline_command (pipeline *p, pipecmd *cmd)
@@ -1134,6 +1670,25 @@ void pipeline_ignore_signals (pipeline *p, int ignore_signals)
 	p->ignore_signals = ignore_signals;
 }
 
+void pipeline_close_fds (pipeline *p, int close_fds)
+{
+	p->close_fds = close_fds;
+}
+
+void pipeline_set_pipe_size (pipeline *p, int size)
+{
+	p->pipe_size = size;
+}
+
+int pipeline_get_pipe_size (pipeline *p, int n)
+{
+	assert (p->pipe_sizes);	/* pipeline started */
+
+	if (n < 0 || n > p->ncommands)
+		return -1;
+	return p->pipe_sizes[n];
+}
+
 FILE *pipeline_get_infile (pipeline *p)
 {
 	assert (p->pids);	/* pipeline started */
@@ -1204,12 +1759,24 @@ void pipeline_free (pipeline *p)
 	free (p->commands);
 	if (p->pids)
 		free (p->pids);
+	if (p->pidfds)
+		free (p->pidfds);
+	if (p->served)
+		free (p->served);
 	if (p->statuses)
 		free (p->statuses);
+	if (p->threads)
+		free (p->threads);
 	if (p->buffer)
 		free (p->buffer);
 	if (p->line_cache)
 		free (p->line_cache);
+	if (p->pipe_sizes)
+		free (p->pipe_sizes);
+	if (p->usages)
+		free (p->usages);
+	free (p->sources);
+	free (p->merge_delim);
 	free (p);
 }
 
@@ -1217,561 +1784,3038 @@ void pipeline_free (pipeline *p)
 
 /* Functions to run pipelines and handle signals. */
 
-static pipeline **active_pipelines = NULL;
-static int n_active_pipelines = 0, max_active_pipelines = 0;
-
-static int sigchld = 0;
-static int queue_sigchld = 0;
-
-static int reap_children (int block)
-{
-	pid_t pid;
-	int status;
-	int collected = 0;
+/* State shared by all the pipelines in a process.  When built with thread
+ * support, lock protects everything here, so different threads may start,
+ * wait for, and pump their own pipelines concurrently.
+ */
+struct pipeline_context {
+#ifdef USE_POSIX_THREADS
+	pthread_mutex_t lock;
+	/* Broadcast when a thread stops collecting exit statuses on behalf
+	 * of others.
+	 */
+	pthread_cond_t reaped;
+	/* Held for writing while starting a pipeline that forks children
+	 * that don't exec, and for reading while starting any other
+	 * pipeline.  Such children must close the descriptors of other
+	 * pipelines, so they must not inherit any that have yet to be
+	 * recorded in active pipelines.
+	 */
+	pthread_rwlock_t start_lock;
+#endif
 
-	do {
-		int i;
+	/* Pipelines that have been started and not yet waited for. */
+	pipeline **active_pipelines;
+	int n_active_pipelines, max_active_pipelines;
 
-		if (sigchld) {
-			/* Deal with a SIGCHLD delivery. */
-			pid = waitpid (-1, &status, WNOHANG);
-			--sigchld;
-		} else
-			pid = waitpid (-1, &status, block ? 0 : WNOHANG);
+	/* Non-zero while some thread is waiting for children other than
+	 * those it is tracking itself, which it may collect on behalf of
+	 * other threads.  Only one thread does that at a time.
+	 */
+	int reaping;
 
-		if (pid < 0 && errno == EINTR) {
-			/* Try again. */
-			pid = 0;
-			continue;
-		}
+	int sigchld_installed;
+	pipeline_post_fork_fn *post_fork;
 
-		if (pid <= 0)
-			/* We've run out of children to reap. */
-			break;
+	/* Number of running pipelines that ignore SIGINT and SIGQUIT, and
+	 * the dispositions to restore once there are none.  These don't
+	 * change while any such pipeline is running.
+	 */
+	int ignored_signals;
+	struct sigaction osa_sigint, osa_sigquit;
 
-		++collected;
+	/* Likewise, the number of calls to pipeline_pump in progress, and
+	 * the disposition of SIGPIPE to restore once there are none.
+	 */
+	int pumping;
+	struct sigaction osa_sigpipe;
+};
+
+static struct pipeline_context context = {
+#ifdef USE_POSIX_THREADS
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_RWLOCK_INITIALIZER,
+#endif
+	NULL
+};
 
-		/* Deliver the command status if possible. */
-		for (i = 0; i < n_active_pipelines; ++i) {
-			pipeline *p = active_pipelines[i];
-			int j;
+static void lock_context (void)
+{
+#ifdef USE_POSIX_THREADS
+	pthread_mutex_lock (&context.lock);
+#endif
+}
 
-			if (!p || !p->pids || !p->statuses)
-				continue;
+static void unlock_context (void)
+{
+#ifdef USE_POSIX_THREADS
+	pthread_mutex_unlock (&context.lock);
+#endif
+}
 
-			for (j = 0; j < p->ncommands; ++j) {
-				if (p->pids[j] == pid) {
-					p->statuses[j] = status;
-					i = n_active_pipelines;
-					break;
-				}
-			}
-		}
-	} while ((sigchld || block == 0) && pid >= 0);
+/* Return the exit status of command n of p, or -1 if it has not yet been
+ * collected.  Another thread may deliver it at any time.
+ */
+static int pipeline_command_status (pipeline *p, int n)
+{
+	int status;
 
-	if (collected)
-		return collected;
-	else
-		return -1;
+	lock_context ();
+	status = p->statuses[n];
+	unlock_context ();
+	return status;
 }
 
-static void pipeline_sigchld (int signum)
+/* Read a clock suitable for measuring how long commands run. */
+static void get_time (struct timeval *tv)
 {
-	/* really an assert, but that's not async-signal-safe */
-	if (signum == SIGCHLD) {
-		++sigchld;
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
 
-		if (!queue_sigchld) {
-			int save_errno = errno;
-			reap_children (0);
-			errno = save_errno;
-		}
+	if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0) {
+		tv->tv_sec = ts.tv_sec;
+		tv->tv_usec = ts.tv_nsec / 1000;
+		return;
 	}
+#endif
+	gettimeofday (tv, NULL);
 }
 
-static void pipeline_install_sigchld (void)
+/* Record that command n of p has exited with status, along with the
+ * resources it used if known.  The caller must hold the context lock, or
+ * own p if its statuses are not delivered by other threads.
+ */
+static void record_usage (pipeline *p, int n, int status,
+			  const struct rusage *usage)
 {
-	struct sigaction act;
-	static int installed = 0;
-
-	if (installed)
-		return;
+	struct pipecmd_usage *u = &p->usages[n];
+	struct timeval now;
 
-	memset (&act, 0, sizeof act);
-	act.sa_handler = &pipeline_sigchld;
-	sigemptyset (&act.sa_mask);
-	sigaddset (&act.sa_mask, SIGINT);
-	sigaddset (&act.sa_mask, SIGTERM);
-	sigaddset (&act.sa_mask, SIGHUP);
-	sigaddset (&act.sa_mask, SIGCHLD);
-	act.sa_flags = 0;
-#ifdef SA_NOCLDSTOP
-	act.sa_flags |= SA_NOCLDSTOP;
-#endif
-#ifdef SA_RESTART
-	act.sa_flags |= SA_RESTART;
-#endif
-	if (sigaction (SIGCHLD, &act, NULL) == -1)
-		error (FATAL, errno, "can't install SIGCHLD handler");
+	trace_event (TRACE_EXIT, p->trace_id, n, p->pids[n], status, NULL);
 
-	installed = 1;
+	get_time (&now);
+	timersub (&now, &u->start, &u->elapsed);
+	if (usage)
+		u->usage = *usage;
+	else
+		memset (&u->usage, 0, sizeof u->usage);
+	u->collected = 1;
 }
 
-static pipeline_post_fork_fn *post_fork = NULL;
-
-void pipeline_install_post_fork (pipeline_post_fork_fn *fn)
+int pipeline_get_rusage (pipeline *p, int n, struct rusage *usage,
+			 struct timeval *elapsed)
 {
-	post_fork = fn;
+	int ret = -1;
+
+	assert (p->usages);	/* pipeline started */
+
+	if (n < 0 || n >= p->ncommands)
+		return -1;
+	lock_context ();
+	if (p->usages[n].collected) {
+		if (usage)
+			*usage = p->usages[n].usage;
+		if (elapsed)
+			*elapsed = p->usages[n].elapsed;
+		ret = 0;
+	}
+	unlock_context ();
+	return ret;
 }
 
-static int ignored_signals = 0;
-static struct sigaction osa_sigint, osa_sigquit;
+#ifdef USE_PIDFD
 
-void pipeline_start (pipeline *p)
+/* Non-zero if children are tracked using process file descriptors rather
+ * than a SIGCHLD handler.  Decided under the context lock when the first
+ * pipeline is started, and constant thereafter.
+ */
+static int use_pidfds = -1;
+
+/* Check that the kernel supports both pidfd_open and waitid (P_PIDFD),
+ * which arrived in successive releases.
+ */
+static int pidfds_supported (void)
+{
+	siginfo_t info;
+	int pidfd, ret;
+
+	pidfd = pidfd_open (getpid (), 0);
+	if (pidfd < 0)
+		return 0;
+	/* We are not our own child, so this should fail with ECHILD;
+	 * older kernels fail with EINVAL instead.
+	 */
+	ret = waitid (P_PIDFD, pidfd, &info, WEXITED | WNOHANG);
+	ret = (ret < 0 && errno == ECHILD);
+	close (pidfd);
+	return ret;
+}
+
+/* Convert the result of waitid into a wait status as returned by waitpid. */
+static int siginfo_status (const siginfo_t *info)
+{
+	switch (info->si_code) {
+		case CLD_EXITED:
+			return (info->si_status & 0xff) << 8;
+		case CLD_KILLED:
+			return info->si_status & 0x7f;
+		case CLD_DUMPED:
+			return (info->si_status & 0x7f) | 0x80;
+		default:
+			return info->si_status;
+	}
+}
+
+/* Collect the exit status of command n of p if it has exited, waiting for
+ * it to do so if block is non-zero.  This deals only with the given
+ * command, so it neither scans other pipelines nor reaps children that
+ * belong to somebody else.  Returns 1 if a status was collected, otherwise
+ * 0.
+ */
+static int reap_command (pipeline *p, int n, int block)
+{
+	struct rusage usage;
+	int status;
+
+	if (p->pidfds[n] != -1) {
+		siginfo_t info;
+
+		memset (&info, 0, sizeof info);
+		memset (&usage, 0, sizeof usage);
+		/* The C library's waitid has no way to return the child's
+		 * resource usage, although the system call does.
+		 */
+		while (syscall (SYS_waitid, P_PIDFD, p->pidfds[n], &info,
+				WEXITED | (block ? 0 : WNOHANG), &usage) < 0) {
+			if (errno == EINTR)
+				continue;
+			error (FATAL, errno, "waitid failed");
+		}
+		if (!info.si_pid)
+			return 0;
+		status = siginfo_status (&info);
+		close (p->pidfds[n]);
+		p->pidfds[n] = -1;
+		p->statuses[n] = status;
+		record_usage (p, n, status, &usage);
+		return 1;
+	}
+
+	/* pidfd_open failed for this child; wait for its process ID. */
+	for (;;) {
+		pid_t pid = wait_usage (p->pids[n], &status,
+					block ? 0 : WNOHANG, &usage);
+		if (pid < 0 && errno == EINTR)
+			continue;
+		if (pid < 0)
+			error (FATAL, errno, "waitpid failed");
+		if (pid == 0)
+			return 0;
+		p->statuses[n] = status;
+		record_usage (p, n, status, &usage);
+		return 1;
+	}
+}
+
+#endif /* USE_PIDFD */
+
+/* Written to by the SIGCHLD handler, if pipeline_get_wait_fd has needed
+ * it.
+ */
+static int sigchld_pipe[2] = { -1, -1 };
+
+/* Create a pipe for waking up an event loop, which never blocks. */
+static int make_wake_pipe (int fds[2])
+{
+	if (pipe (fds) < 0)
+		return -1;
+	set_cloexec (fds[0]);
+	set_cloexec (fds[1]);
+	fcntl (fds[0], F_SETFL, fcntl (fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl (fds[1], F_SETFL, fcntl (fds[1], F_GETFL) | O_NONBLOCK);
+	return 0;
+}
+
+static void wake_pipe (int fd)
+{
+	/* If the pipe is full, it is already readable. */
+	if (write (fd, "", 1) < 0)
+		return;
+}
+
+static void drain_pipe (int fd)
+{
+	char buf[64];
+
+	while (read (fd, buf, sizeof buf) > 0)
+		;
+}
+
+/* Make p's wait descriptor readable, if it has one.  The caller must hold
+ * the context lock.
+ */
+static void pipeline_wake (pipeline *p)
+{
+	if (p->wake[1] != -1)
+		wake_pipe (p->wake[1]);
+}
+
+/* Deliver status and usage to the command of an active pipeline whose
+ * process ID is pid, if any.  If served is non-zero, consider only
+ * commands started by the spawn server.  The caller must hold the context
+ * lock.
+ */
+static void deliver_status (pid_t pid, int status,
+			    const struct rusage *usage, int served)
 {
 	int i, j;
-	int last_input = -1;
-	int infd[2];
+
+	for (i = 0; i < context.n_active_pipelines; ++i) {
+		pipeline *p = context.active_pipelines[i];
+
+		for (j = 0; j < p->ncommands; ++j) {
+			if (p->pids[j] == pid &&
+			    (!served || p->served[j])) {
+				p->statuses[j] = status;
+				record_usage (p, j, status, usage);
+				pipeline_wake (p);
+				return;
+			}
+		}
+	}
+}
+
+/* Collect the exit statuses of any children that have exited, waiting for
+ * one if block is non-zero, and deliver them to their pipelines.  Only the
+ * thread that has set context.reaping may call this.
+ */
+static int reap_children (int block)
+{
+	pid_t pid;
+	int status;
+	struct rusage usage;
+	int collected = 0;
+
+	do {
+		pid = wait_usage (-1, &status, block ? 0 : WNOHANG, &usage);
+
+		if (pid < 0 && errno == EINTR) {
+			/* Try again. */
+			pid = 0;
+			continue;
+		}
+
+		if (pid <= 0)
+			/* We've run out of children to reap. */
+			break;
+
+		++collected;
+
+		/* Deliver the command status if possible. */
+		lock_context ();
+		deliver_status (pid, status, &usage, 0);
+		unlock_context ();
+	} while (block == 0 && pid >= 0);
+
+	if (collected)
+		return collected;
+	else
+		return -1;
+}
+
+/* Collect exit statuses that the spawn server has reported for commands
+ * it started, waiting for one if block is non-zero.  If the server has
+ * gone away, the statuses of its commands are lost, so treat them as
+ * having failed to execute.  Only the thread that has set context.reaping
+ * may call this.
+ */
+static void reap_served (int block)
+{
+	pid_t pid;
+	int status, ret;
+	struct rusage usage;
+	int i, j;
+
+	while ((ret = spawn_server_wait (block, &pid, &status,
+					 &usage)) > 0) {
+		lock_context ();
+		deliver_status (pid, status, &usage, 1);
+		unlock_context ();
+		block = 0;
+	}
+
+	if (ret < 0) {
+		lock_context ();
+		for (i = 0; i < context.n_active_pipelines; ++i) {
+			pipeline *p = context.active_pipelines[i];
+
+			for (j = 0; j < p->ncommands; ++j) {
+				if (p->served[j] && p->pids[j] != -1 &&
+				    p->statuses[j] == -1) {
+					p->statuses[j] =
+						EXEC_FAILED_EXIT_STATUS << 8;
+					record_usage (p, j,
+						      p->statuses[j], NULL);
+					pipeline_wake (p);
+				}
+			}
+		}
+		unlock_context ();
+	}
+}
+
+/* Try to become the thread that collects statuses on behalf of others.
+ * Returns non-zero on success, in which case the caller must call
+ * stop_reaping when done.  The caller must hold the context lock.
+ */
+static int start_reaping (void)
+{
+	if (context.reaping)
+		return 0;
+	context.reaping = 1;
+	return 1;
+}
+
+static void stop_reaping (void)
+{
+	lock_context ();
+	context.reaping = 0;
+#ifdef USE_POSIX_THREADS
+	pthread_cond_broadcast (&context.reaped);
+#endif
+	unlock_context ();
+}
+
+/* Wait until a status is delivered to some command of p that is still
+ * marked as running, collecting statuses ourselves unless another thread
+ * is already doing so.  If served is non-zero, all the commands of p that
+ * are still running were started by the spawn server.
+ */
+static void pipeline_wait_delivery (pipeline *p, int served)
+{
+	int i;
+
+	lock_context ();
+	for (i = 0; i < p->ncommands; ++i)
+		if (p->pids[i] != -1 && p->statuses[i] != -1)
+			break;
+	if (i < p->ncommands) {
+		/* One arrived since the caller last looked. */
+		unlock_context ();
+		return;
+	}
+	if (!start_reaping ()) {
+#ifdef USE_POSIX_THREADS
+		pthread_cond_wait (&context.reaped, &context.lock);
+#endif
+		unlock_context ();
+		return;
+	}
+	unlock_context ();
+
+	if (served)
+		reap_served (1);
+	else {
+		errno = 0;
+		if (reap_children (1) == -1 && errno == ECHILD)
+			/* Eh? The pipeline was allegedly still running, so
+			 * we shouldn't have got ECHILD.
+			 */
+			error (FATAL, errno, "waitpid failed");
+	}
+
+	stop_reaping ();
+}
+
+/* Collect whatever statuses are available without waiting, from our
+ * children or, if served is non-zero, from the spawn server; unless
+ * another thread is already collecting them.
+ */
+static void poll_children (int served)
+{
+	int reaping;
+
+	lock_context ();
+	reaping = start_reaping ();
+	unlock_context ();
+	if (!reaping)
+		return;
+	if (served)
+		reap_served (0);
+	else
+		reap_children (0);
+	stop_reaping ();
+}
+
+/* Statuses are collected by reap_children rather than here, since that
+ * needs the context lock.  The handler only makes sure that SIGCHLD
+ * interrupts pipeline_pump, and wakes up pipeline_get_wait_fd's callers.
+ */
+static void pipeline_sigchld (int signum PIPELINE_ATTR_UNUSED)
+{
+	if (sigchld_pipe[1] != -1) {
+		int save_errno = errno;
+		wake_pipe (sigchld_pipe[1]);
+		errno = save_errno;
+	}
+}
+
+/* The caller must hold the context lock. */
+static void pipeline_install_sigchld (void)
+{
+	struct sigaction act;
+
+	if (context.sigchld_installed)
+		return;
+
+	memset (&act, 0, sizeof act);
+	act.sa_handler = &pipeline_sigchld;
+	sigemptyset (&act.sa_mask);
+	sigaddset (&act.sa_mask, SIGINT);
+	sigaddset (&act.sa_mask, SIGTERM);
+	sigaddset (&act.sa_mask, SIGHUP);
+	sigaddset (&act.sa_mask, SIGCHLD);
+	act.sa_flags = 0;
+#ifdef SA_NOCLDSTOP
+	act.sa_flags |= SA_NOCLDSTOP;
+#endif
+#ifdef SA_RESTART
+	act.sa_flags |= SA_RESTART;
+#endif
+	if (sigaction (SIGCHLD, &act, NULL) == -1)
+		error (FATAL, errno, "can't install SIGCHLD handler");
+
+	context.sigchld_installed = 1;
+}
+
+void pipeline_install_post_fork (pipeline_post_fork_fn *fn)
+{
+	lock_context ();
+	context.post_fork = fn;
+	unlock_context ();
+}
+
+/* Mark fd to be closed on exec. */
+void set_cloexec (int fd)
+{
+	int flags = fcntl (fd, F_GETFD);
+
+	if (flags != -1)
+		fcntl (fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+/* Like waitpid, but also set *usage to the resources used by the child if
+ * the system can tell us, or to zero otherwise.
+ */
+pid_t wait_usage (pid_t pid, int *status, int options, struct rusage *usage)
+{
+	memset (usage, 0, sizeof *usage);
+#ifdef HAVE_WAIT4
+	return wait4 (pid, status, options, usage);
+#else
+	return waitpid (pid, status, options);
+#endif
+}
+
+/* Create a pipe whose descriptors are closed on exec.  Children that exec
+ * then need not close the descriptors of every active pipeline, and never
+ * inherit them in the first place if started using posix_spawn.  Children
+ * that use one end of the pipe as standard input or output receive it via
+ * dup2, which clears the flag.
+ */
+static int pipe_cloexec (int fds[2])
+{
+#if defined(HAVE_PIPE2) && !defined(USE_SOCKETPAIR_PIPE)
+	return pipe2 (fds, O_CLOEXEC);
+#else
+	if (pipe (fds) < 0)
+		return -1;
+	set_cloexec (fds[0]);
+	set_cloexec (fds[1]);
+	return 0;
+#endif
+}
+
+#if defined(F_SETPIPE_SZ) && defined(F_GETPIPE_SZ)
+/* The largest pipe capacity that an unprivileged process may ask for, or 0
+ * if unknown.
+ */
+static int pipe_max_size = 0;
+
+static void read_pipe_max_size (void)
+{
+	FILE *f = fopen ("/proc/sys/fs/pipe-max-size", "r");
+	int size;
+
+	if (!f)
+		return;
+	if (fscanf (f, "%d", &size) == 1 && size > 0)
+		pipe_max_size = size;
+	fclose (f);
+}
+#endif
+
+/* Try to give the pipe with write end fd a capacity of size bytes, if
+ * size is positive, and return its actual capacity, or 0 if unknown.  The
+ * kernel rounds the size up, and refuses sizes above
+ * /proc/sys/fs/pipe-max-size to unprivileged processes; ask for no more
+ * than that, so that we get the largest pipe available rather than none
+ * at all.
+ */
+static int set_pipe_size (int fd, int size)
+{
+#if defined(F_SETPIPE_SZ) && defined(F_GETPIPE_SZ)
+	int ret;
+
+	if (size > 0) {
+#ifdef USE_POSIX_THREADS
+		static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+		pthread_once (&once, read_pipe_max_size);
+#else
+		static int inited = 0;
+
+		if (!inited) {
+			inited = 1;
+			read_pipe_max_size ();
+		}
+#endif
+		if (pipe_max_size > 0 && size > pipe_max_size)
+			size = pipe_max_size;
+		if (fcntl (fd, F_SETPIPE_SZ, size) < 0)
+			debug ("can't set pipe size to %d: %s\n", size,
+			       strerror (errno));
+	}
+
+	ret = fcntl (fd, F_GETPIPE_SZ);
+	return ret < 0 ? 0 : ret;
+#else
+	(void) fd;
+	(void) size;
+	return 0;
+#endif
+}
+
+/* Close all descriptors from lowfd upwards, in a forked child. */
+void close_fds_from (int lowfd)
+{
+#ifdef HAVE_CLOSE_RANGE
+	if (close_range (lowfd, ~0U, 0) == 0)
+		return;
+#endif
+#ifdef HAVE_CLOSEFROM
+	closefrom (lowfd);
+#else
+	{
+		long max = sysconf (_SC_OPEN_MAX);
+		int fd;
+
+		if (max < 0)
+			max = 1024;
+		for (fd = lowfd; fd < max; ++fd)
+			close (fd);
+	}
+#endif
+}
+
+#ifdef USE_POSIX_THREADS
+
+#ifndef W_EXITCODE
+#  define W_EXITCODE(ret, sig) ((ret) << 8 | (sig))
+#endif
+
+/* A command running in a thread rather than a child process.  The thread
+ * owns infd and outfd unless they are -1, in which case it uses standard
+ * input or output, and closes them as soon as its function returns so that
+ * its neighbours in the pipeline see end-of-file.
+ */
+struct pipeline_thread {
+	pthread_t thread;
+	pipeline *p;
+	int n;			/* index of cmd in p */
+	pipecmd *cmd;
+	int infd, outfd;	/* -1 once closed */
+	int status;
+};
+
+/* Can cmd be run in a thread rather than a child process? */
+static int pipecmd_can_thread (pipecmd *cmd)
+{
+	struct pipecmd_function *cmdf;
+
+	if (cmd->tag != PIPECMD_FUNCTION)
+		return 0;
+	cmdf = &cmd->u.function;
+	if (!cmdf->fd_func || !cmdf->thread)
+		return 0;
+	/* These would affect the whole process. */
+	if (cmd->nice || cmd->discard_err || cmd->nenv)
+		return 0;
+
+	return 1;
+}
+
+static void *pipeline_thread_main (void *arg)
+{
+	struct pipeline_thread *t = arg;
+	struct pipecmd_function *cmdf = &t->cmd->u.function;
+	struct rusage *usagep = NULL;
+#ifdef RUSAGE_THREAD
+	struct rusage usage;
+#endif
+	int ret;
+
+	ret = (*cmdf->fd_func) (t->infd != -1 ? t->infd : STDIN_FILENO,
+				t->outfd != -1 ? t->outfd : STDOUT_FILENO,
+				cmdf->data);
+
+#ifdef RUSAGE_THREAD
+	/* A new thread starts with no usage of its own. */
+	if (getrusage (RUSAGE_THREAD, &usage) == 0)
+		usagep = &usage;
+#endif
+
+	/* A forked child must close any of these descriptors that it
+	 * inherits, or it would keep the corresponding pipes open; the
+	 * context lock is held while forking, so it inherits exactly those
+	 * recorded here.
+	 */
+	lock_context ();
+	if (t->infd != -1) {
+		close (t->infd);
+		t->infd = -1;
+	}
+	if (t->outfd != -1) {
+		close (t->outfd);
+		t->outfd = -1;
+	}
+	t->status = W_EXITCODE (ret & 0xff, 0);
+	record_usage (t->p, t->n, t->status, usagep);
+	pipeline_wake (t->p);
+	unlock_context ();
+
+	return NULL;
+}
+
+/* Start command number i of p in a thread, handing over last_input and
+ * output_write to it.  Returns zero if the caller should fork instead.
+ */
+static int pipeline_thread_start (pipeline *p, int i, int last_input,
+				  int output_write)
+{
+	struct pipeline_thread *t = XMALLOC (struct pipeline_thread);
 	sigset_t set, oset;
+	int err;
 
-	/* Make sure our SIGCHLD handler is installed. */
-	pipeline_install_sigchld ();
+	t->p = p;
+	t->n = i;
+	t->cmd = p->commands[i];
+	t->infd = last_input;
+	t->outfd = output_write;
+	t->status = -1;
 
-	assert (!p->pids);	/* pipeline not started already */
-	assert (!p->statuses);
+	/* Keep these out of children that exec; see close_thread_fds for
+	 * those that don't.
+	 */
+	if (t->infd != -1)
+		set_cloexec (t->infd);
+	if (t->outfd != -1)
+		set_cloexec (t->outfd);
+
+	/* Block all signals in the new thread.  Signals for the process as
+	 * a whole, notably SIGCHLD, should continue to interrupt the
+	 * caller; and writing to a pipe whose reader has gone away should
+	 * fail with EPIPE rather than killing the process with SIGPIPE.
+	 */
+	sigfillset (&set);
+	pthread_sigmask (SIG_SETMASK, &set, &oset);
+	err = pthread_create (&t->thread, NULL, pipeline_thread_main, t);
+	pthread_sigmask (SIG_SETMASK, &oset, NULL);
+
+	if (err) {
+		debug ("can't create thread for \"%s\": %s; forking instead\n",
+		       t->cmd->name, strerror (err));
+		free (t);
+		return 0;
+	}
+
+	lock_context ();
+	p->threads[i] = t;
+	unlock_context ();
+	return 1;
+}
+
+/* In a newly forked child, close the descriptors owned by threads.  The
+ * parent holds the context lock while forking.
+ */
+static void close_thread_fds (void)
+{
+	int j, k;
+
+	for (j = 0; j < context.n_active_pipelines; ++j) {
+		pipeline *active = context.active_pipelines[j];
+
+		if (!active || !active->threads)
+			continue;
+		for (k = 0; k < active->ncommands; ++k) {
+			struct pipeline_thread *t = active->threads[k];
+
+			if (!t)
+				continue;
+			/* ignore failures */
+			if (t->infd != -1)
+				close (t->infd);
+			if (t->outfd != -1)
+				close (t->outfd);
+		}
+	}
+}
+
+#endif /* USE_POSIX_THREADS */
+
+#ifdef HAVE_POSIX_SPAWNP
+
+/* Can cmd be started using posix_spawn rather than fork?  Forking a parent
+ * with a large address space is expensive even with copy-on-write, since
+ * its page tables must still be copied; posix_spawn avoids that, but it
+ * can only express a subset of what a forked child can do.
+ */
+static int pipecmd_can_spawn (pipecmd *cmd, const char *path)
+{
+	int i;
+
+	if (cmd->tag != PIPECMD_PROCESS)
+		return 0;
+	/* There is no spawn attribute to adjust the nice value. */
+	if (cmd->nice)
+		return 0;
+	/* posix_spawnp searches the parent's PATH, while execvp in a forked
+	 * child searches the command's own PATH.  This doesn't matter if we
+	 * found the file to execute ourselves.
+	 */
+	if (path)
+		return 1;
+	for (i = 0; i < cmd->nenv; ++i)
+		if (!cmd->env[i].name || !strcmp (cmd->env[i].name, "PATH"))
+			return 0;
+
+	return 1;
+}
+
+/* Start cmd using posix_spawn, expressing what a forked child would do in
+ * pipeline_start as spawn file actions and attributes.  Returns the new
+ * process ID, or -1 if the caller should fall back to forking.
+ */
+static pid_t pipeline_spawn (pipeline *p, pipecmd *cmd, const char *path,
+			     int last_input, int output_write)
+{
+	struct pipecmd_process *cmdp = &cmd->u.process;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	char **envp;
+	pid_t pid;
+	int ret = 0;
+
+#ifndef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+	if (p->close_fds)
+		return -1;
+#endif
+
+	if (posix_spawn_file_actions_init (&actions))
+		return -1;
+	if (posix_spawnattr_init (&attr)) {
+		posix_spawn_file_actions_destroy (&actions);
+		return -1;
+	}
+
+	/* input, reading side */
+	if (last_input != -1 && last_input != 0) {
+		ret |= posix_spawn_file_actions_adddup2 (&actions,
+							 last_input, 0);
+		ret |= posix_spawn_file_actions_addclose (&actions,
+							  last_input);
+	}
+
+	/* output, writing side */
+	if (output_write != -1 && output_write != 1) {
+		ret |= posix_spawn_file_actions_adddup2 (&actions,
+							 output_write, 1);
+		ret |= posix_spawn_file_actions_addclose (&actions,
+							  output_write);
+	}
+
+	/* All other descriptors belonging to libpipeline, including the
+	 * reading side of the output and those of other active pipelines,
+	 * are closed on exec.
+	 */
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+	if (p->close_fds)
+		ret |= posix_spawn_file_actions_addclosefrom_np (&actions, 3);
+#endif
+
+	if (cmd->discard_err)
+		ret |= posix_spawn_file_actions_addopen
+			(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+	/* Restore signals.  A disposition of SIG_IGN survives exec, while
+	 * any other disposition becomes SIG_DFL.
+	 */
+	if (p->ignore_signals) {
+		sigset_t sigdefault;
+
+		sigemptyset (&sigdefault);
+		if (context.osa_sigint.sa_handler != SIG_IGN)
+			sigaddset (&sigdefault, SIGINT);
+		if (context.osa_sigquit.sa_handler != SIG_IGN)
+			sigaddset (&sigdefault, SIGQUIT);
+		ret |= posix_spawnattr_setsigdefault (&attr, &sigdefault);
+		ret |= posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGDEF);
+	}
+
+	envp = pipecmd_get_env (cmd);
+
+	if (!ret && path)
+		ret = posix_spawn (&pid, path, &actions, &attr,
+				   cmdp->argv, envp ? envp : environ);
+	else if (!ret)
+		ret = posix_spawnp (&pid, cmd->name, &actions, &attr,
+				    cmdp->argv, envp ? envp : environ);
+	if (ret) {
+		/* Let a forked child report the problem, if any. */
+		debug ("posix_spawn of \"%s\" failed: %s; forking instead\n",
+		       cmd->name, strerror (ret));
+		pid = -1;
+	}
+
+	posix_spawnattr_destroy (&attr);
+	posix_spawn_file_actions_destroy (&actions);
+	return pid;
+}
+
+#endif /* HAVE_POSIX_SPAWNP */
+
+/* Ask the spawn server to start cmd, giving it what a forked child would
+ * have in pipeline_start.  Returns the new process ID, or -1 if the
+ * caller should start it itself.
+ */
+static pid_t pipeline_serve (pipeline *p, pipecmd *cmd, const char *path,
+			     int last_input, int output_write)
+{
+	struct spawn_request req;
+	struct sigaction sa;
+	char **envp = pipecmd_get_env (cmd);
+
+	req.file = path ? path : cmd->name;
+	req.argv = cmd->u.process.argv;
+	req.envp = envp ? envp : environ;
+	req.fds[0] = last_input != -1 ? last_input : 0;
+	req.fds[1] = output_write != -1 ? output_write : 1;
+	req.fds[2] = 2;
+	req.nice = cmd->nice;
+	req.flags = cmd->discard_err ? SPAWN_DISCARD_ERR : 0;
+
+	/* The command should ignore whatever signals we would have left
+	 * ignored across exec.
+	 */
+	if (p->ignore_signals)
+		sa = context.osa_sigint;
+	else
+		sigaction (SIGINT, NULL, &sa);
+	if (sa.sa_handler == SIG_IGN)
+		req.flags |= SPAWN_IGNORE_SIGINT;
+	if (p->ignore_signals)
+		sa = context.osa_sigquit;
+	else
+		sigaction (SIGQUIT, NULL, &sa);
+	if (sa.sa_handler == SIG_IGN)
+		req.flags |= SPAWN_IGNORE_SIGQUIT;
+
+	return spawn_server_spawn (&req);
+}
+
+/* When a source pipeline has exactly one sink, there is no need for
+ * pipeline_pump to copy data between them: if pipeline_pump starts the
+ * second of the two, that one takes over the other's end of the pipe
+ * between them, so that the source's last command writes straight into the
+ * sink's first.  Pipelines started by the caller are left alone, since the
+ * caller may yet want to intercept data between them.
+ */
+
+/* If p is the only sink of a source that is already running, none of
+ * whose output is waiting in its peek cache, take the source's output for
+ * p's first command to read from.  Returns the descriptor, or -1.
+ */
+static int take_source_output (pipeline *p)
+{
+	pipeline *source = p->source;
+	int fd;
+
+	if (!source || source->nsinks != 1 || !source->pids ||
+	    !p->ncommands || source->outfd == -1 || source->outfile ||
+	    pipeline_peek_size (source))
+		return -1;
+
+	fd = source->outfd;
+	source->outfd = -1;
+	p->pipe_sizes[0] = source->pipe_sizes[source->ncommands];
+	debug ("Sink reading directly from source output\n");
+	return fd;
+}
+
+/* If p's only sink is already running, take the sink's input for p's last
+ * command to write to.  Returns the descriptor, or -1.  The caller must
+ * hold the context lock.
+ */
+static int take_sink_input (pipeline *p)
+{
+	int i;
+
+	if (p->nsinks != 1 || !p->ncommands ||
+	    p->redirect_out != REDIRECT_FD || p->want_out >= 0)
+		return -1;
+
+	for (i = 0; i < context.n_active_pipelines; ++i) {
+		pipeline *sink = context.active_pipelines[i];
+		int fd;
+
+		if (!sink || sink->source != p)
+			continue;
+		if (sink->infd == -1 || sink->infile)
+			return -1;
+		fd = sink->infd;
+		sink->infd = -1;
+		p->pipe_sizes[p->ncommands] = sink->pipe_sizes[0];
+		debug ("Source writing directly to sink input\n");
+		return fd;
+	}
+	return -1;
+}
+
+/* Start p.  If direct is non-zero, p may be connected directly to a source
+ * or sink that is already running.
+ */
+static void start_pipeline (pipeline *p, int direct)
+{
+	int i, j;
+	int last_input = -1, sink_input;
+	int infd[2];
+	pipeline_post_fork_fn *post_fork;
+#ifdef USE_POSIX_THREADS
+	int exclusive = 0;
+#endif
+
+	assert (!p->pids);	/* pipeline not started already */
+	assert (!p->statuses);
+
+	init_debug ();
+	init_trace ();
+	if (debug_level) {
+		debug ("Starting pipeline: ");
+		pipeline_dump (p, stderr);
+	}
+
+	/* Flush all pending output so that subprocesses don't inherit it. */
+	fflush (NULL);
+
+	p->pids = xcalloc (p->ncommands, sizeof *p->pids);
+	p->pidfds = xnmalloc (p->ncommands, sizeof *p->pidfds);
+	for (i = 0; i < p->ncommands; ++i)
+		p->pidfds[i] = -1;
+	p->statuses = xcalloc (p->ncommands, sizeof *p->statuses);
+	p->served = xcalloc (p->ncommands, sizeof *p->served);
+	p->threads = xcalloc (p->ncommands, sizeof *p->threads);
+	free (p->pipe_sizes);
+	p->pipe_sizes = xcalloc (p->ncommands + 1, sizeof *p->pipe_sizes);
+	free (p->usages);
+	p->usages = xcalloc (p->ncommands, sizeof *p->usages);
+	p->trace_id = 0;
+	p->traced_output = 0;
+	if (trace_enabled)
+		p->trace_id = trace_pipeline_id ();
+	trace_event (TRACE_PIPELINE_START, p->trace_id, -1, 0, p->ncommands,
+		     NULL);
+
+#ifdef USE_POSIX_THREADS
+	/* Commands other than processes may be forked without exec. */
+	for (i = 0; i < p->ncommands; ++i)
+		if (p->commands[i]->tag != PIPECMD_PROCESS)
+			exclusive = 1;
+	if (exclusive)
+		pthread_rwlock_wrlock (&context.start_lock);
+	else
+		pthread_rwlock_rdlock (&context.start_lock);
+#endif
+
+	lock_context ();
+
+#ifdef USE_PIDFD
+	if (use_pidfds == -1) {
+		use_pidfds = pidfds_supported ();
+		debug ("Tracking children using %s\n",
+		       use_pidfds ? "process file descriptors"
+				  : "SIGCHLD handler");
+	}
+	if (use_pidfds) {
+		struct sigaction sa;
+
+		/* We collect exit statuses explicitly, so we need no
+		 * handler; but the kernel must not discard them either.
+		 */
+		if (sigaction (SIGCHLD, NULL, &sa) == 0 &&
+		    (sa.sa_handler == SIG_IGN ||
+		     (sa.sa_flags & SA_NOCLDWAIT))) {
+			memset (&sa, 0, sizeof sa);
+			sa.sa_handler = SIG_DFL;
+			sigemptyset (&sa.sa_mask);
+			if (sigaction (SIGCHLD, &sa, NULL) == -1)
+				error (FATAL, errno,
+				       "can't reset SIGCHLD disposition");
+		}
+	} else
+#endif /* USE_PIDFD */
+		/* Make sure our SIGCHLD handler is installed. */
+		pipeline_install_sigchld ();
+
+	post_fork = context.post_fork;
+
+	if (p->ignore_signals && !context.ignored_signals++) {
+		struct sigaction sa;
+
+		/* Ignore SIGINT and SIGQUIT while subprocesses are running,
+		 * just like system().
+		 */
+		memset (&sa, 0, sizeof sa);
+		sa.sa_handler = SIG_IGN;
+		sigemptyset (&sa.sa_mask);
+		sa.sa_flags = 0;
+		if (sigaction (SIGINT, &sa, &context.osa_sigint) < 0)
+			error (FATAL, errno, "Couldn't ignore SIGINT");
+		if (sigaction (SIGQUIT, &sa, &context.osa_sigquit) < 0)
+			error (FATAL, errno, "Couldn't ignore SIGQUIT");
+	}
+
+	/* Add to the table of active pipelines, so that exit statuses
+	 * collected by other threads can be delivered to us.  Grow the
+	 * table if necessary.
+	 */
+	if (context.n_active_pipelines >= context.max_active_pipelines) {
+		int filled = context.max_active_pipelines;
+		if (context.max_active_pipelines)
+			context.max_active_pipelines *= 2;
+		else
+			context.max_active_pipelines = 4;
+		/* reduces to xmalloc (...) if active_pipelines == NULL */
+		context.active_pipelines = xrealloc
+			(context.active_pipelines,
+			 context.max_active_pipelines *
+				sizeof *context.active_pipelines);
+		memset (context.active_pipelines + filled, 0,
+			(context.max_active_pipelines - filled) *
+				sizeof *context.active_pipelines);
+	}
+
+	context.active_pipelines[context.n_active_pipelines++] = p;
+
+	sink_input = direct ? take_sink_input (p) : -1;
+
+	unlock_context ();
+
+	if (p->ncommands == 0 && (p->source || p->nsources) &&
+	    p->redirect_in == REDIRECT_FD && p->want_in < 0 &&
+	    (p->redirect_out != REDIRECT_FD || p->want_out >= 0)) {
+		/* A zero-command sink passes data straight through from
+		 * its input to its output, so let pipeline_pump write
+		 * directly to the final destination rather than to a pipe.
+		 */
+		if (p->redirect_out == REDIRECT_FD)
+			p->infd = p->want_out;
+		else if (p->redirect_out == REDIRECT_FILE_NAME) {
+			assert (p->want_outfile);
+			p->infd = open (p->want_outfile,
+					O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (p->infd < 0)
+				error (FATAL, errno, "can't open %s",
+				       p->want_outfile);
+			set_cloexec (p->infd);
+		} else {
+			p->infd = dup (STDOUT_FILENO);
+			if (p->infd < 0)
+				error (FATAL, errno, "dup failed");
+			set_cloexec (p->infd);
+		}
+	} else if (p->redirect_in == REDIRECT_FD && p->want_in < 0) {
+		last_input = direct ? take_source_output (p) : -1;
+		if (last_input == -1) {
+			if (pipe_cloexec (infd) < 0)
+				error (FATAL, errno, "pipe failed");
+			last_input = infd[0];
+			p->infd = infd[1];
+			p->pipe_sizes[0] = set_pipe_size (p->infd,
+							  p->pipe_size);
+			trace_event (TRACE_PIPE, p->trace_id, -1, 0,
+				     p->pipe_sizes[0], NULL);
+		}
+	} else if (p->redirect_in == REDIRECT_FD)
+		last_input = p->want_in;
+	else if (p->redirect_in == REDIRECT_FILE_NAME) {
+		assert (p->want_infile);
+		last_input = open (p->want_infile, O_RDONLY);
+		if (last_input < 0)
+			error (FATAL, errno, "can't open %s", p->want_infile);
+	}
+
+	for (i = 0; i < p->ncommands; i++) {
+		int pdes[2];
+		pid_t pid;
+		char *path;
+		int spawn = 0, locked = 1;
+		enum trace_type how;
+		int output_read = -1, output_write = -1;
+		/* Descriptors are closed on exec, so a child that execs
+		 * need not close them itself.
+		 */
+		int exec_child = (p->commands[i]->tag == PIPECMD_PROCESS);
+
+		get_time (&p->usages[i].start);
+		trace_event (TRACE_COMMAND_START, p->trace_id, i, 0, 0,
+			     p->commands[i]->name);
+
+		if (i == p->ncommands - 1 && sink_input != -1)
+			output_write = sink_input;
+		else if (i != p->ncommands - 1 ||
+			 (p->redirect_out == REDIRECT_FD && p->want_out < 0)) {
+			int size = p->commands[i]->pipe_size;
+
+			if (pipe_cloexec (pdes) < 0)
+				error (FATAL, errno, "pipe failed");
+			p->pipe_sizes[i + 1] = set_pipe_size
+				(pdes[1], size ? size : p->pipe_size);
+			trace_event (TRACE_PIPE, p->trace_id, i, 0,
+				     p->pipe_sizes[i + 1], NULL);
+			if (i == p->ncommands - 1)
+				p->outfd = pdes[0];
+			output_read = pdes[0];
+			output_write = pdes[1];
+		} else {
+			if (p->redirect_out == REDIRECT_FD)
+				output_write = p->want_out;
+			else if (p->redirect_out == REDIRECT_FILE_NAME) {
+				assert (p->want_outfile);
+				output_write = open (p->want_outfile,
+						     O_WRONLY | O_CREAT |
+						     O_TRUNC, 0666);
+				if (output_write < 0)
+					error (FATAL, errno, "can't open %s",
+					       p->want_outfile);
+			}
+		}
+
+#ifdef USE_POSIX_THREADS
+		if (pipecmd_can_thread (p->commands[i]) &&
+		    pipeline_thread_start (p, i, last_input, output_write)) {
+			/* The thread now owns last_input and output_write. */
+			if (output_read != -1)
+				last_input = output_read;
+			p->pids[i] = 0;
+			p->statuses[i] = -1;
+			trace_event (TRACE_THREAD, p->trace_id, i, 0, 0, NULL);
+			debug ("Started \"%s\" in a thread\n",
+			       p->commands[i]->name);
+			continue;
+		}
+#endif /* USE_POSIX_THREADS */
+
+		/* Resolve the command's environment and the file it
+		 * executes now, so that a forked child can pass them
+		 * straight to exec.
+		 */
+		pipecmd_get_env (p->commands[i]);
+		path = pipecmd_get_path (p->commands[i]);
+		if (p->commands[i]->tag == PIPECMD_SEQUENCE)
+			pipecmd_resolve_sequence (p->commands[i], environ);
+
+		/* If a pipe was given the very descriptor that the child
+		 * needs it on, the child won't dup2 it, which would have
+		 * cleared its close-on-exec flag.
+		 */
+		if (last_input == 0)
+			fcntl (0, F_SETFD, 0);
+		if (output_write == 1)
+			fcntl (1, F_SETFD, 0);
+
+		/* Post-fork handlers must run in a forked child. */
+#ifdef HAVE_POSIX_SPAWNP
+		spawn = !post_fork && pipecmd_can_spawn (p->commands[i], path);
+#endif
+
+		/* Until we have recorded its process ID, another thread
+		 * must neither collect the new command's exit status nor
+		 * fork a child that would need to close descriptors we have
+		 * yet to record.  Neither can happen to a spawned command
+		 * that we track using a process file descriptor, so
+		 * different threads can spawn those at the same time.
+		 */
+#ifdef USE_PIDFD
+		if (spawn && use_pidfds)
+			locked = 0;
+#endif
+		if (locked)
+			lock_context ();
+
+		pid = -1;
+		how = TRACE_SPAWN;
+#ifdef HAVE_POSIX_SPAWNP
+		if (spawn)
+			pid = pipeline_spawn (p, p->commands[i], path,
+					      last_input, output_write);
+#endif
+		if (pid == -1 && !locked) {
+			lock_context ();
+			locked = 1;
+		}
+		/* posix_spawn doesn't copy our address space either, and is
+		 * quicker than a round trip to the spawn server.  Post-fork
+		 * handlers must run in a child of the caller.
+		 */
+		if (pid == -1 && !post_fork && spawn_server_running () &&
+		    p->commands[i]->tag == PIPECMD_PROCESS) {
+			pid = pipeline_serve (p, p->commands[i], path,
+					      last_input, output_write);
+			if (pid != -1) {
+				p->served[i] = 1;
+				how = TRACE_SERVE;
+			}
+		}
+		if (pid == -1) {
+			pid = fork ();
+			how = TRACE_FORK;
+		}
+		if (pid < 0)
+			error (FATAL, errno, "fork failed");
+		if (pid == 0) {
+			/* child */
+#ifdef USE_POSIX_THREADS
+			/* Do this first, since a thread may own one of our
+			 * standard descriptors.
+			 */
+			if (!exec_child)
+				close_thread_fds ();
+			/* We are the only thread here, so nobody else is
+			 * collecting statuses; and we may run pipelines of
+			 * our own.
+			 */
+			context.reaping = 0;
+			unlock_context ();
+			pthread_rwlock_unlock (&context.start_lock);
+#endif
+
+			if (post_fork)
+				post_fork ();
+
+			/* input, reading side */
+			if (last_input != -1 && last_input != 0) {
+				if (dup2 (last_input, 0) < 0)
+					error (FATAL, errno, "dup2 failed");
+				if (close (last_input) < 0)
+					error (FATAL, errno, "close failed");
+			}
+
+			/* output, writing side */
+			if (output_write != -1 && output_write != 1) {
+				if (dup2 (output_write, 1) < 0)
+					error (FATAL, errno, "dup2 failed");
+				if (close (output_write) < 0)
+					error (FATAL, errno, "close failed");
+			}
+
+			/* output, reading side */
+			if (output_read != -1)
+				if (close (output_read))
+					error (FATAL, errno, "close failed");
+
+			/* input from first command, writing side; must close
+			 * it in every child because it has to be created
+			 * before forking anything
+			 */
+			if (p->infd != -1)
+				if (close (p->infd))
+					error (FATAL, errno, "close failed");
+
+			if (p->close_fds)
+				close_fds_from (3);
+			else if (!exec_child) {
+				/* inputs and outputs from other active
+				 * pipelines; an exec closes these for us
+				 */
+				for (j = 0; j < context.n_active_pipelines;
+				     ++j) {
+					pipeline *active =
+						context.active_pipelines[j];
+					if (!active || active == p)
+						continue;
+					/* ignore failures */
+					if (active->infd != -1)
+						close (active->infd);
+					if (active->outfd != -1)
+						close (active->outfd);
+				}
+			}
+
+			/* Restore signals. */
+			if (p->ignore_signals) {
+				sigaction (SIGINT, &context.osa_sigint, NULL);
+				sigaction (SIGQUIT, &context.osa_sigquit,
+					   NULL);
+			}
+
+			if (exec_child)
+				trace_event (TRACE_EXEC, p->trace_id, i,
+					     getpid (), 0, NULL);
+			pipecmd_exec_path (p->commands[i], path);
+			/* never returns */
+		}
+
+		/* in the parent */
+		trace_event (how, p->trace_id, i, pid, 0, NULL);
+		if (!locked)
+			lock_context ();
+		p->pids[i] = pid;
+		p->statuses[i] = -1;
+		unlock_context ();
+
+		free (path);
+		if (last_input != -1) {
+			if (close (last_input) < 0)
+				error (FATAL, errno, "close failed");
+		}
+		if (output_write != -1) {
+			if (close (output_write) < 0)
+				error (FATAL, errno, "close failed");
+		}
+		if (output_read != -1)
+			last_input = output_read;
+#ifdef USE_PIDFD
+		/* If this fails (say, due to running out of file
+		 * descriptors), reap_command waits for the process ID
+		 * instead.
+		 */
+		if (use_pidfds && !p->served[i])
+			p->pidfds[i] = pidfd_open (pid, 0);
+#endif
+
+		debug ("Started \"%s\", pid %d%s\n", p->commands[i]->name, pid,
+		       p->served[i] ? " by spawn server" : "");
+	}
+
+	if (p->ncommands == 0) {
+		p->outfd = last_input;
+		if (p->outfd != -1)
+			set_cloexec (p->outfd);
+	}
+
+#ifdef USE_POSIX_THREADS
+	pthread_rwlock_unlock (&context.start_lock);
+#endif
+}
+
+void pipeline_start (pipeline *p)
+{
+	start_pipeline (p, 0);
+}
+
+/* Close our ends of the pipeline's input and output, as waiting for it
+ * implies.
+ */
+static void pipeline_close_ends (pipeline *p)
+{
+	if (p->infile) {
+		if (fclose (p->infile))
+			error (0, errno,
+			       "closing pipeline input stream failed");
+		p->infile = NULL;
+		p->infd = -1;
+	} else if (p->infd != -1) {
+		if (close (p->infd))
+			error (0, errno, "closing pipeline input failed");
+		p->infd = -1;
+	}
+
+	if (p->outfile) {
+		if (fclose (p->outfile)) {
+			error (0, errno,
+			       "closing pipeline output stream failed");
+			p->wait_ret = 127;
+		}
+		p->outfile = NULL;
+		p->outfd = -1;
+	} else if (p->outfd != -1) {
+		if (close (p->outfd)) {
+			error (0, errno, "closing pipeline output failed");
+			p->wait_ret = 127;
+		}
+		p->outfd = -1;
+	}
+}
+
+#ifdef USE_POSIX_THREADS
+
+/* Collect the statuses of commands running in threads that have finished,
+ * waiting for all of them to do so if block is non-zero.  They finish by
+ * themselves once their input is exhausted or their output is no longer
+ * wanted.
+ */
+static void pipeline_join_threads (pipeline *p, int block)
+{
+	int i;
+
+	for (i = 0; i < p->ncommands; ++i) {
+		struct pipeline_thread *t = p->threads[i];
+		int status, err;
+
+		if (!t)
+			continue;
+		lock_context ();
+		status = t->status;
+		unlock_context ();
+		if (!block && status == -1)
+			continue;
+		err = pthread_join (t->thread, NULL);
+		if (err)
+			error (FATAL, err, "pthread_join failed");
+		lock_context ();
+		p->statuses[i] = t->status;
+		p->threads[i] = NULL;
+		unlock_context ();
+		free (t);
+	}
+}
+
+#endif /* USE_POSIX_THREADS */
+
+/* Deal with the statuses of commands that have been collected since we
+ * last looked, and return the number of commands still running.  Set
+ * *children to the number of those that are our own child processes.
+ */
+static int pipeline_process_statuses (pipeline *p, int *children)
+{
+	int running = 0;
+	int i;
+
+	*children = 0;
+
+	for (i = 0; i < p->ncommands; ++i) {
+		pipecmd *cmd = p->commands[i];
+		pid_t pid = p->pids[i];
+		int status, raw_status;
+
+		if (pid == -1)
+			continue;
+
+		lock_context ();
+		status = p->statuses[i];
+		debug ("  \"%s\" (%d) -> %d\n",
+		       cmd->name, p->pids[i], status);
+		if (status != -1) {
+			struct pipecmd_usage *u = &p->usages[i];
+
+			debug ("    %ld.%06lds elapsed, %ld.%06lds user, "
+			       "%ld.%06lds system, %ld KiB maximum RSS\n",
+			       (long) u->elapsed.tv_sec,
+			       (long) u->elapsed.tv_usec,
+			       (long) u->usage.ru_utime.tv_sec,
+			       (long) u->usage.ru_utime.tv_usec,
+			       (long) u->usage.ru_stime.tv_sec,
+			       (long) u->usage.ru_stime.tv_usec,
+			       u->usage.ru_maxrss);
+			p->pids[i] = -1;
+		}
+		unlock_context ();
+
+		if (status == -1) {
+			++running;
+			if (p->pids[i] > 0 && !p->served[i])
+				++*children;
+			continue;
+		}
+
+		raw_status = status;
+		trace_event (TRACE_REAP, p->trace_id, i, pid, raw_status, NULL);
+		if (WIFSIGNALED (status)) {
+			int sig = WTERMSIG (status);
+#ifdef SIGPIPE
+			if (sig == SIGPIPE)
+				status = 0;
+			else {
+#endif /* SIGPIPE */
+				/* signals currently blocked, re-raise later */
+				if (sig == SIGINT || sig == SIGQUIT)
+					p->raise_signal = sig;
+				else if (WCOREDUMP (status))
+					error (0, 0, "%s: %s (core dumped)",
+					       cmd->name, strsignal (sig));
+				else
+					error (0, 0, "%s: %s",
+					       cmd->name, strsignal (sig));
+#ifdef SIGPIPE
+			}
+#endif /* SIGPIPE */
+		} else if (!WIFEXITED (status))
+			error (0, 0, "unexpected status %d", status);
+
+		if (cmd->exit_func)
+			(*cmd->exit_func) (cmd, raw_status, cmd->exit_data);
+
+		if (cmd->tag == PIPECMD_FUNCTION) {
+			struct pipecmd_function *cmdf = &cmd->u.function;
+			if (cmdf->free_func)
+				(*cmdf->free_func) (cmdf->data);
+		}
+
+		if (i == p->ncommands - 1) {
+			if (WIFSIGNALED (status))
+				p->wait_ret = 128 + WTERMSIG (status);
+			else if (WEXITSTATUS (status))
+				p->wait_ret = WEXITSTATUS (status);
+		} else if (!p->wait_ret &&
+			   (WIFSIGNALED (status) || WEXITSTATUS (status)))
+			p->wait_ret = 127;
+	}
+
+	return running;
+}
+
+/* Finish waiting for a pipeline once all its commands have exited. */
+static int pipeline_finish_wait (pipeline *p, int **statuses,
+				 int *n_statuses)
+{
+	int ret = p->wait_ret, raise_signal = p->raise_signal;
+	int i;
+
+	lock_context ();
+
+	/* Nothing else looks at the table without the context lock, so we
+	 * can keep it compact.  Free it once it's empty; this prevents the
+	 * table growing without bound, not to mention pacifying valgrind.
+	 */
+	for (i = 0; i < context.n_active_pipelines; ++i) {
+		if (context.active_pipelines[i] == p) {
+			context.active_pipelines[i] = context.active_pipelines
+				[--context.n_active_pipelines];
+			context.active_pipelines[context.n_active_pipelines] =
+				NULL;
+			break;
+		}
+	}
+	if (!context.n_active_pipelines) {
+		context.max_active_pipelines = 0;
+		free (context.active_pipelines);
+		context.active_pipelines = NULL;
+	}
+
+	if (p->ignore_signals && !--context.ignored_signals) {
+		/* Restore signals. */
+		sigaction (SIGINT, &context.osa_sigint, NULL);
+		sigaction (SIGQUIT, &context.osa_sigquit, NULL);
+	}
+
+	if (p->wake[0] != -1) {
+		close (p->wake[0]);
+		close (p->wake[1]);
+		p->wake[0] = p->wake[1] = -1;
+	}
+
+	unlock_context ();
+
+	if (p->wait_fd != -1) {
+		close (p->wait_fd);
+		p->wait_fd = -1;
+	}
+
+	trace_event (TRACE_PIPELINE_END, p->trace_id, -1, 0, ret, NULL);
+
+	if (statuses && n_statuses) {
+		*statuses = xnmalloc (p->ncommands, sizeof **statuses);
+		*n_statuses = p->ncommands;
+		for (i = 0; i < p->ncommands; ++i)
+			(*statuses)[i] = p->statuses[i];
+	}
+
+	free (p->pids);
+	p->pids = NULL;
+	free (p->pidfds);
+	p->pidfds = NULL;
+	free (p->served);
+	p->served = NULL;
+	free (p->statuses);
+	p->statuses = NULL;
+	free (p->threads);
+	p->threads = NULL;
+	p->wait_ret = 0;
+	p->raise_signal = 0;
+
+	if (raise_signal)
+		raise (raise_signal);
+
+	return ret;
+}
+
+int pipeline_wait_all (pipeline *p, int **statuses, int *n_statuses)
+{
+	int children;
+	int i;
+
+	init_debug ();
+	if (debug_level) {
+		debug ("Waiting for pipeline: ");
+		pipeline_dump (p, stderr);
+	}
+
+	assert (p->pids);	/* pipeline started */
+	assert (p->statuses);
+
+	pipeline_close_ends (p);
+#ifdef USE_POSIX_THREADS
+	pipeline_join_threads (p, 1);
+#endif
+
+	/* Check for any statuses already collected by other threads or the
+	 * previous iteration before waiting again.
+	 */
+	while (pipeline_process_statuses (p, &children) > 0) {
+#ifdef USE_PIDFD
+		if (use_pidfds && children) {
+			/* Wait for the first command still running; we need
+			 * all their statuses, so the order doesn't matter.
+			 */
+			for (i = 0; i < p->ncommands; ++i) {
+				if (p->pids[i] > 0 && !p->served[i]) {
+					reap_command (p, i, 1);
+					break;
+				}
+			}
+			continue;
+		}
+#endif /* USE_PIDFD */
+
+		/* Commands started by the spawn server are not our
+		 * children, and the server reports their statuses to us.
+		 * Wait for those once none of our own children are left.
+		 */
+		pipeline_wait_delivery (p, !children);
+	}
+
+	return pipeline_finish_wait (p, statuses, n_statuses);
+}
+
+int pipeline_get_wait_fd (pipeline *p)
+{
+#ifdef USE_EPOLL
+	struct epoll_event ev;
+	int fd, i;
+	int served = 0;
+
+	assert (p->pids);	/* pipeline started */
+
+	if (p->wait_fd != -1)
+		return p->wait_fd;
+
+	for (i = 0; i < p->ncommands; ++i) {
+		if (p->pids[i] > 0 && !p->served[i] && p->pidfds[i] == -1
+#ifdef USE_PIDFD
+		    && use_pidfds
+#endif
+		    ) {
+			/* pidfd_open failed, so we would never hear of
+			 * this command's exit.
+			 */
+			errno = EMFILE;
+			return -1;
+		}
+	}
+
+	fd = epoll_create1 (EPOLL_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	lock_context ();
+	if (make_wake_pipe (p->wake) < 0) {
+		unlock_context ();
+		close (fd);
+		return -1;
+	}
+#ifdef USE_PIDFD
+	if (!use_pidfds)
+#endif
+	{
+		if (sigchld_pipe[0] == -1 && make_wake_pipe (sigchld_pipe) < 0)
+			error (FATAL, errno, "pipe failed");
+	}
+	unlock_context ();
+
+	memset (&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	if (epoll_ctl (fd, EPOLL_CTL_ADD, p->wake[0], &ev) < 0)
+		error (FATAL, errno, "epoll_ctl");
+#ifdef USE_PIDFD
+	if (!use_pidfds)
+#endif
+	{
+		if (epoll_ctl (fd, EPOLL_CTL_ADD, sigchld_pipe[0], &ev) < 0)
+			error (FATAL, errno, "epoll_ctl");
+	}
+	for (i = 0; i < p->ncommands; ++i) {
+		if (p->pidfds[i] != -1 &&
+		    epoll_ctl (fd, EPOLL_CTL_ADD, p->pidfds[i], &ev) < 0)
+			error (FATAL, errno, "epoll_ctl");
+		if (p->served[i] && p->pids[i] != -1)
+			served = 1;
+	}
+	/* The spawn server reports the exits of the commands it started. */
+	if (served && spawn_server_fd () != -1 &&
+	    epoll_ctl (fd, EPOLL_CTL_ADD, spawn_server_fd (), &ev) < 0)
+		error (FATAL, errno, "epoll_ctl");
+
+	p->wait_fd = fd;
+	return fd;
+#else /* !USE_EPOLL */
+	(void) p;
+	errno = ENOSYS;
+	return -1;
+#endif /* USE_EPOLL */
+}
+
+int pipeline_try_wait_all (pipeline *p, int **statuses, int *n_statuses)
+{
+	int children, served = 0;
+	int i;
+
+	assert (p->pids);	/* pipeline started */
+	assert (p->statuses);
+
+	pipeline_close_ends (p);
+
+	/* Clear readiness first, so that anything that happens from now on
+	 * makes the wait descriptor readable again.
+	 */
+	if (p->wake[0] != -1)
+		drain_pipe (p->wake[0]);
+	if (sigchld_pipe[0] != -1)
+		drain_pipe (sigchld_pipe[0]);
+
+#ifdef USE_POSIX_THREADS
+	pipeline_join_threads (p, 0);
+#endif
+	if (!pipeline_process_statuses (p, &children))
+		return pipeline_finish_wait (p, statuses, n_statuses);
+
+	/* Collect whatever else is available without waiting. */
+	for (i = 0; i < p->ncommands; ++i) {
+		if (p->pids[i] <= 0)
+			continue;
+		if (p->served[i])
+			++served;
+#ifdef USE_PIDFD
+		else if (use_pidfds)
+			reap_command (p, i, 0);
+#endif /* USE_PIDFD */
+	}
+#ifdef USE_PIDFD
+	if (!use_pidfds)
+#endif /* USE_PIDFD */
+	{
+		if (children)
+			poll_children (0);
+	}
+	if (served)
+		poll_children (1);
+
+	if (pipeline_process_statuses (p, &children))
+		return -1;
+	return pipeline_finish_wait (p, statuses, n_statuses);
+}
+
+int pipeline_wait (pipeline *p)
+{
+	return pipeline_wait_all (p, NULL, NULL);
+}
+
+int pipeline_run (pipeline *p)
+{
+	int status;
+
+	pipeline_start (p);
+	status = pipeline_wait (p);
+	pipeline_free (p);
+
+	return status;
+}
+
+/* Is p a sink, reading either from a single source or from several merged
+ * ones?
+ */
+static int pump_is_sink (pipeline *p)
+{
+	return p->source || p->nsources;
+}
+
+/* Should p be started before the other pipelines?  Only if it is the only
+ * sink of a source that has yet to be started.
+ */
+static int pump_start_early (pipeline *p)
+{
+	return !p->pids && p->source && p->source->nsinks == 1 &&
+	       !p->source->pids;
+}
+
+/* Does the sink p read from source, alone or merged with others? */
+static int pump_feeds (pipeline *p, pipeline *source)
+{
+	int k;
+
+	if (p->source == source)
+		return 1;
+	for (k = 0; k < p->nsources; ++k) {
+		if (p->sources[k] == source)
+			return 1;
+	}
+	return 0;
+}
+
+#ifdef USE_PIDFD
+
+/* Return the process file descriptor whose readiness tells pipeline_pump
+ * that p has died as a sink (the first command, if sink is non-zero) or as
+ * a source (the last command), or -1 if there is nothing to watch.
+ */
+static int pump_watched_pidfd (pipeline *p, int known_source,
+			       int dying_source, int sink)
+{
+	if (sink) {
+		if (!pump_is_sink (p) || p->infd == -1)
+			return -1;
+		return p->pidfds[0];
+	} else {
+		if (!known_source || dying_source || p->outfd == -1)
+			return -1;
+		return p->pidfds[p->ncommands - 1];
+	}
+}
+
+#endif /* USE_PIDFD */
+
+/* Descriptors that pipeline_pump watches for each pipeline. */
+#define PUMP_OUTPUT	0x1	/* output from a source pipeline */
+#define PUMP_INPUT	0x2	/* input to a sink pipeline */
+#define PUMP_SOURCE_PID	0x4	/* last command of a source pipeline */
+#define PUMP_SINK_PID	0x8	/* first command of a sink pipeline */
+#define PUMP_SHIFT	4
+
+/* State shared between pipeline_pump and the functions it uses to wait
+ * for something to do.  readable[i] is set while the output of pieces[i]
+ * may have data or end-of-file available, and writable[i] while the input
+ * of pieces[i] may accept more data; they are cleared when a read or write
+ * would block.
+ */
+struct pump_state {
+	int argc;
+	pipeline **pieces;
+	int *known_source, *dying_source, *waiting;
+	int *readable, *writable;
+	int epfd;		/* -1 if using select */
+	int *registered;	/* PUMP_* bits already added to epfd */
+	int *unpolled;		/* PUMP_* bits that epoll refused */
+	int *nonblocking;	/* PUMP_* bits that we made non-blocking */
+	int *spliceable;	/* PUMP_* bits for descriptors that are pipes */
+	int *regular;		/* PUMP_* bits for regular files, ditto */
+	size_t *pos;		/* how far each sink is into its source's
+				 * peek cache
+				 */
+	/* For each sink of several merged sources, the index in its sources
+	 * of the one whose turn it is, and how much remains of the unit of
+	 * output that the sink is part way through taking from it.
+	 */
+	int *merge_turn;
+	size_t *merge_left;
+	unsigned long long copied;	/* bytes written to sinks */
+	unsigned long long zero_copied;	/* bytes moved by tee or splice */
+	/* If non-NULL, reads and writes are queued here and submitted
+	 * together, rather than made one at a time.  queued has PUMP_OUTPUT
+	 * set while a read from pieces[i] is queued, and PUMP_INPUT while a
+	 * write of write_len[i] bytes to it is.  nowait has PUMP_* bits set
+	 * for descriptors that the kernel must not wait for, as it would
+	 * hold up everything else submitted with them, and unbatched for
+	 * those that it can't promise not to wait for, which are read or
+	 * written one at a time instead.
+	 */
+	struct uring *ring;
+	int *queued, *nowait, *unbatched;
+	ssize_t *read_result, *write_result;
+	size_t *write_len;
+	/* Output from sources with the PIPELINE_BUDGET_SPILL policy that
+	 * did not fit in their peek caches: spill[i] holds it from
+	 * spill_start[i] to spill_end[i], and it is read back into the peek
+	 * cache as sinks make room for it.
+	 */
+	FILE **spill;
+	off_t *spill_start, *spill_end;
+	char *spill_buf;
+};
+
+/* The amount that pipeline_pump tries to read from each source at once. */
+#define PUMP_READ_SIZE 4096
+
+/* Return the amount of output from source held in its spill file. */
+static size_t pump_spilled (struct pump_state *ps, pipeline *source)
+{
+	int i;
+
+	for (i = 0; i < ps->argc; ++i) {
+		if (ps->pieces[i] == source && ps->spill[i])
+			return ps->spill_end[i] - ps->spill_start[i];
+	}
+	return 0;
+}
+
+/* Return the amount of output read from its source that the sink
+ * ps->pieces[i] has yet to receive.  Sinks that pump_zero_copy left ahead
+ * of the peek cache are not behind at all.
+ */
+static size_t pump_lag (struct pump_state *ps, int i)
+{
+	pipeline *sink = ps->pieces[i];
+	pipeline *source = sink->source;
+	size_t have;
+	int k;
+
+	if (!source) {
+		/* A merge sink is the only sink of each of its sources. */
+		have = 0;
+		for (k = 0; k < sink->nsources; ++k)
+			have += pipeline_peek_size (sink->sources[k]) +
+				pump_spilled (ps, sink->sources[k]);
+		return have;
+	}
+
+	have = pipeline_peek_size (source) + pump_spilled (ps, source);
+	return ps->pos[i] < have ? have - ps->pos[i] : 0;
+}
+
+/* Should we stop reading from the source ps->pieces[i] for now, under the
+ * PIPELINE_BUDGET_BLOCK policy?
+ */
+static int pump_throttled (struct pump_state *ps, int i)
+{
+	pipeline *p = ps->pieces[i];
+
+	return p->pump_budget && p->pump_policy == PIPELINE_BUDGET_BLOCK &&
+	       pipeline_peek_size (p) >= p->pump_budget;
+}
+
+/* Add fd to set, keeping track of the highest descriptor seen. */
+static void pump_fd_set (int fd, fd_set *set, int *maxfd)
+{
+	if (fd >= FD_SETSIZE)
+		error (FATAL, 0, "file descriptor %d is too large for select",
+		       fd);
+	FD_SET (fd, set);
+	if (fd > *maxfd)
+		*maxfd = fd;
+}
+
+/* Wait using select.  select is level-triggered, so readiness is
+ * recomputed from scratch each time.  Return non-zero if a child process
+ * may have exited.
+ */
+static int pump_wait_select (struct pump_state *ps)
+{
+	fd_set rfds, wfds;
+	int maxfd = -1;
+	int ret, child_event, i;
+
+	FD_ZERO (&rfds);
+	FD_ZERO (&wfds);
+	for (i = 0; i < ps->argc; ++i) {
+		pipeline *p = ps->pieces[i];
+
+		ps->readable[i] = ps->writable[i] = 0;
+
+		/* Input to sink pipeline. */
+		if (pump_is_sink (p) && p->infd != -1 && !ps->waiting[i])
+			pump_fd_set (p->infd, &wfds, &maxfd);
+		/* Output from source pipeline. */
+		if (ps->known_source[i] && p->outfd != -1 &&
+		    !pump_throttled (ps, i))
+			pump_fd_set (p->outfd, &rfds, &maxfd);
+#ifdef USE_PIDFD
+		/* Without a SIGCHLD handler, select will not be interrupted
+		 * when a child exits, so watch for the death of the
+		 * relevant commands directly.
+		 */
+		if (use_pidfds && p->ncommands) {
+			int sink;
+
+			for (sink = 0; sink <= 1; ++sink) {
+				int fd = pump_watched_pidfd
+					(p, ps->known_source[i],
+					 ps->dying_source[i], sink);
+				if (fd != -1)
+					pump_fd_set (fd, &rfds, &maxfd);
+			}
+		}
+#endif /* USE_PIDFD */
+	}
+
+	ret = select (maxfd + 1, &rfds, &wfds, NULL, NULL);
+	if (ret < 0 && errno != EINTR)
+		error (FATAL, errno, "select");
+	child_event = (ret < 0);
+	if (ret <= 0)
+		return child_event;
+
+	for (i = 0; i < ps->argc; ++i) {
+		pipeline *p = ps->pieces[i];
+
+		if (pump_is_sink (p) && p->infd != -1 && !ps->waiting[i] &&
+		    FD_ISSET (p->infd, &wfds))
+			ps->writable[i] = 1;
+		if (ps->known_source[i] && p->outfd != -1 &&
+		    !pump_throttled (ps, i) && FD_ISSET (p->outfd, &rfds))
+			ps->readable[i] = 1;
+#ifdef USE_PIDFD
+		if (use_pidfds && p->ncommands) {
+			int sink;
+
+			for (sink = 0; sink <= 1; ++sink) {
+				int n = sink ? 0 : p->ncommands - 1;
+				int fd = pump_watched_pidfd
+					(p, ps->known_source[i],
+					 ps->dying_source[i], sink);
+				if (fd != -1 && FD_ISSET (fd, &rfds) &&
+				    reap_command (p, n, 0))
+					child_event = 1;
+			}
+		}
+#endif /* USE_PIDFD */
+	}
+
+	return child_event;
+}
+
+/* A read from the output of (PUMP_OUTPUT) or a write to the input of
+ * (PUMP_INPUT) ps->pieces[i] would block; don't try again until told that
+ * it is ready.
+ */
+static void pump_blocked (struct pump_state *ps, int i, int what)
+{
+	/* Descriptors that cannot be polled are always ready. */
+	if (ps->unpolled[i] & what)
+		return;
+	if (what == PUMP_OUTPUT)
+		ps->readable[i] = 0;
+	else
+		ps->writable[i] = 0;
+}
+
+/* Close the output of (PUMP_OUTPUT) or the input of (PUMP_INPUT)
+ * ps->pieces[i], first putting it back into blocking mode if we took it
+ * out: its open file description may be shared with a descriptor that the
+ * caller still uses, such as the destination of a zero-command sink.  A
+ * sink's lag stays at whatever it had yet to receive.
+ */
+static int pump_close (struct pump_state *ps, int i, int what)
+{
+	pipeline *p = ps->pieces[i];
+	int *fd = (what == PUMP_OUTPUT) ? &p->outfd : &p->infd;
+	int ret;
+
+	if (what == PUMP_INPUT)
+		p->pump_lag = pump_lag (ps, i);
+	if (ps->nonblocking[i] & what) {
+		int flags = fcntl (*fd, F_GETFL);
+		if (flags != -1)
+			fcntl (*fd, F_SETFL, flags & ~O_NONBLOCK);
+		ps->nonblocking[i] &= ~what;
+	}
+	ret = close (*fd);
+	*fd = -1;
+	return ret;
+}
+
+/* Trace the first data read from p's output, or its end, given the result
+ * r of reading from it.
+ */
+static void trace_output (pipeline *p, ssize_t r)
+{
+	if (r > 0 && !p->traced_output) {
+		p->traced_output = 1;
+		trace_record (TRACE_FIRST_BYTE, p->trace_id, -1, 0, r, NULL);
+	} else if (r == 0 && p->traced_output != 2) {
+		p->traced_output = 2;
+		trace_record (TRACE_EOF, p->trace_id, -1, 0, 0, NULL);
+	}
+}
+
+/* Make room to read toread bytes after the unread data in p's buffer,
+ * which then ends at p->buffer + p->buflen.  If the buffer has grown
+ * beyond its high-water mark and no longer needs to be that large, move
+ * the unread data to the front and shrink it.  Otherwise, if there isn't
+ * enough room, move the unread data to the front only if that reclaims at
+ * least as much space as it copies, and grow the buffer geometrically if
+ * that isn't enough.  This keeps the cost of copying proportional to the
+ * amount of data read.
+ */
+static void make_room (pipeline *p, size_t toread)
+{
+	size_t keep = p->buffer ? p->peek_offset : 0;
+	size_t start = keep ? p->buflen - keep : 0;
+	size_t need = keep + toread, newmax;
+	int shrink;
+
+	shrink = (p->bufmax > p->buffer_high_water &&
+		  need <= p->buffer_high_water);
+	if (start && (shrink || (start + need > p->bufmax && start >= keep))) {
+		memmove (p->buffer, p->buffer + start, keep);
+		start = 0;
+	}
+	newmax = p->bufmax;
+	if (start + need > newmax) {
+		if (newmax * 2 > start + need)
+			newmax *= 2;
+		else
+			newmax = start + need;
+	} else if (shrink)
+		newmax = p->buffer_high_water;
+	if (newmax != p->bufmax || !p->buffer) {
+		p->bufmax = newmax;
+		p->buffer = xrealloc (p->buffer, p->bufmax + 1);
+	}
+	p->buflen = start + keep;
+}
+
+/* Account for r bytes read into the room made by make_room. */
+static void fill_block (pipeline *p, ssize_t r, int peek)
+{
+	if (trace_enabled)
+		trace_output (p, r);
+	p->buflen += r;
+	if (peek)
+		p->peek_offset += r;
+}
+
+#ifdef USE_SPLICE
+
+/* Upper bound on the data moved to each sink by a single tee or splice. */
+#define PUMP_ZERO_COPY_MAX (1024 * 1024)
+
+/* Return the sink into which pump_zero_copy would splice data from the
+ * source pipeline ps->pieces[i], having teed it into the others, or -1 if
+ * the descriptors involved don't allow it to move data from this source
+ * at all.
+ */
+static int pump_splice_sink (struct pump_state *ps, int i)
+{
+	pipeline *source = ps->pieces[i];
+	int last = -1, file = -1;
+	int j;
+
+	if (!(ps->spliceable[i] & PUMP_OUTPUT))
+		return -1;
+	for (j = 0; j < ps->argc; ++j) {
+		if (ps->pieces[j]->source != source ||
+		    ps->pieces[j]->infd == -1)
+			continue;
+		if (ps->spliceable[j] & PUMP_INPUT)
+			last = j;
+		else if ((ps->regular[j] & PUMP_INPUT) && file == -1)
+			file = j;
+		else
+			return -1;
+	}
+	if (file != -1)
+		last = file;
+	return last;
+}
+
+/* Move data from the source pipeline ps->pieces[i] to all its sinks
+ * without copying it through user space: tee it into all sinks but one,
+ * and splice it into that one, which consumes it from the source.  This
+ * is only possible when the source's peek cache is empty, every sink has
+ * caught up with it, and all the descriptors involved are pipes, except
+ * that one sink may write to a regular file (as a zero-command sink
+ * redirected to a file does): splice can fill it, but tee cannot.
+ *
+ * Sinks that accept more than the last sink leave pos[] pointing past the
+ * data they have already received, and the caller falls back to the
+ * buffered path until they are level again.  Return non-zero if any data
+ * was moved; otherwise, the caller should read from the source as usual,
+ * which will sort out end-of-file and empty pipes.
+ */
+static int pump_zero_copy (struct pump_state *ps, int i, size_t *pos,
+			   int *write_error)
+{
+	pipeline *source = ps->pieces[i];
+	int last, moved = 0;
+	size_t lo = PUMP_ZERO_COPY_MAX;
+	ssize_t s;
+	int j;
 
-	init_debug ();
-	if (debug_level) {
-		debug ("Starting pipeline: ");
-		pipeline_dump (p, stderr);
+	if (pipeline_peek_size (source) || pump_spilled (ps, source))
+		return 0;
+	last = pump_splice_sink (ps, i);
+	if (last == -1)
+		return 0;
+	for (j = 0; j < ps->argc; ++j) {
+		if (ps->pieces[j]->source == source &&
+		    ps->pieces[j]->infd != -1 && pos[j])
+			return 0;
 	}
 
-	/* Flush all pending output so that subprocesses don't inherit it. */
-	fflush (NULL);
+	for (j = 0; j < ps->argc; ++j) {
+		ssize_t t;
 
-	if (p->ignore_signals && !ignored_signals++) {
-		struct sigaction sa;
+		if (j == last || ps->pieces[j]->source != source ||
+		    ps->pieces[j]->infd == -1)
+			continue;
+		t = tee (source->outfd, ps->pieces[j]->infd,
+			 PUMP_ZERO_COPY_MAX, SPLICE_F_NONBLOCK);
+		if (t < 0) {
+			if (errno != EAGAIN) {
+				if (errno != EPIPE)
+					write_error[j] = errno;
+				pump_close (ps, j, PUMP_INPUT);
+				continue;
+			}
+			/* Either the source is empty or this sink is
+			 * full; we can only tell which once we know
+			 * whether any other sink got anything.
+			 */
+			t = 0;
+		}
+		pos[j] = t;
+		if ((size_t) t < lo)
+			lo = t;
+		if (t)
+			moved = 1;
+		ps->zero_copied += t;
+	}
 
-		/* Ignore SIGINT and SIGQUIT while subprocesses are running,
-		 * just like system().
-		 */
-		memset (&sa, 0, sizeof sa);
-		sa.sa_handler = SIG_IGN;
-		sigemptyset (&sa.sa_mask);
-		sa.sa_flags = 0;
-		if (sigaction (SIGINT, &sa, &osa_sigint) < 0)
-			error (FATAL, errno, "Couldn't ignore SIGINT");
-		if (sigaction (SIGQUIT, &sa, &osa_sigquit) < 0)
-			error (FATAL, errno, "Couldn't ignore SIGQUIT");
+	s = 0;
+	if (lo) {
+		s = splice (source->outfd, NULL, ps->pieces[last]->infd, NULL,
+			    lo, SPLICE_F_NONBLOCK);
+		if (s < 0) {
+			if (errno == EAGAIN) {
+				/* If another sink received data, then the
+				 * source isn't empty.
+				 */
+				if (moved)
+					pump_blocked (ps, last, PUMP_INPUT);
+			} else {
+				if (errno != EPIPE)
+					write_error[last] = errno;
+				pump_close (ps, last, PUMP_INPUT);
+			}
+			s = 0;
+		}
+		ps->zero_copied += s;
 	}
 
-	/* Add to the table of active pipelines, so that signal handlers
-	 * know what to do with exit statuses. Block SIGCHLD so that we can
-	 * do this safely.
+	/* The splice consumed s bytes from the source; the other sinks are
+	 * ahead of it by whatever else they took.
 	 */
-	sigemptyset (&set);
-	sigaddset (&set, SIGCHLD);
-	sigemptyset (&oset);
-	while (sigprocmask (SIG_BLOCK, &set, &oset) == -1 && errno == EINTR)
-		;
+	for (j = 0; j < ps->argc; ++j) {
+		if (j == last || ps->pieces[j]->source != source ||
+		    ps->pieces[j]->infd == -1)
+			continue;
+		if (moved && !pos[j])
+			pump_blocked (ps, j, PUMP_INPUT);
+		pos[j] -= s;
+	}
 
-	/* Grow the table if necessary. */
-	if (n_active_pipelines >= max_active_pipelines) {
-		int filled = max_active_pipelines;
-		if (max_active_pipelines)
-			max_active_pipelines *= 2;
-		else
-			max_active_pipelines = 4;
-		/* reduces to xmalloc (...) if active_pipelines == NULL */
-		active_pipelines = xrealloc
-			(active_pipelines,
-			 max_active_pipelines * sizeof *active_pipelines);
-		memset (active_pipelines + filled, 0,
-			(max_active_pipelines - filled) *
-				sizeof *active_pipelines);
+	if (trace_enabled && (moved || s > 0))
+		trace_output (source, moved ? 1 : s);
+	return moved || s > 0;
+}
+
+/* When reads and writes are batched, data read on one pass is only
+ * written on the next, so the peek cache of a source that is kept busy
+ * would never empty and let pump_zero_copy take over again.  Return
+ * non-zero if the source ps->pieces[i] should not be read from on this
+ * pass, so that a sink ready to take what is already in its peek cache
+ * can drain it first.
+ */
+static int pump_drain_first (struct pump_state *ps, int i, size_t *pos)
+{
+	pipeline *source = ps->pieces[i];
+	size_t peek_size = pipeline_peek_size (source);
+	int j;
+
+	if (!peek_size || pump_splice_sink (ps, i) == -1)
+		return 0;
+	for (j = 0; j < ps->argc; ++j) {
+		if (ps->pieces[j]->source == source &&
+		    ps->pieces[j]->infd != -1 && ps->writable[j] &&
+		    pos[j] < peek_size)
+			return 1;
 	}
+	return 0;
+}
 
-	for (i = 0; i < max_active_pipelines; ++i)
-		if (!active_pipelines[i]) {
-			active_pipelines[i] = p;
-			break;
-		}
-	assert (i < max_active_pipelines);
-	++n_active_pipelines;
+/* Is fd a pipe? */
+static int is_pipe (int fd)
+{
+	struct stat st;
 
-	p->pids = xcalloc (p->ncommands, sizeof *p->pids);
-	p->statuses = xcalloc (p->ncommands, sizeof *p->statuses);
+	return fstat (fd, &st) == 0 && S_ISFIFO (st.st_mode);
+}
 
-	/* Unblock SIGCHLD. */
-	while (sigprocmask (SIG_SETMASK, &oset, NULL) == -1 && errno == EINTR)
-		;
+/* Is fd a regular file that splice can write to?  It refuses files opened
+ * for appending.
+ */
+static int is_splice_file (int fd)
+{
+	struct stat st;
+	int flags;
 
-	if (p->redirect_in == REDIRECT_FD && p->want_in < 0) {
-		if (pipe (infd) < 0)
-			error (FATAL, errno, "pipe failed");
-		last_input = infd[0];
-		p->infd = infd[1];
-	} else if (p->redirect_in == REDIRECT_FD)
-		last_input = p->want_in;
-	else if (p->redirect_in == REDIRECT_FILE_NAME) {
-		assert (p->want_infile);
-		last_input = open (p->want_infile, O_RDONLY);
-		if (last_input < 0)
-			error (FATAL, errno, "can't open %s", p->want_infile);
+	if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode))
+		return 0;
+	flags = fcntl (fd, F_GETFL);
+	return flags != -1 && !(flags & O_APPEND);
+}
+
+#endif /* USE_SPLICE */
+
+#ifdef USE_EPOLL
+
+/* Start watching fd for the events in what, which is one of the PUMP_*
+ * bits, on behalf of the pipeline ps->pieces[i].
+ */
+static void pump_epoll_add (struct pump_state *ps, int i, int fd, int what)
+{
+	struct epoll_event ev;
+
+	ps->registered[i] |= what;
+
+	memset (&ev, 0, sizeof ev);
+	if (what == PUMP_INPUT)
+		ev.events = EPOLLOUT | EPOLLET;
+	else
+		ev.events = EPOLLIN | EPOLLET;
+	ev.data.u32 = (i << PUMP_SHIFT) | what;
+
+	if (epoll_ctl (ps->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		if (errno == EEXIST && what != PUMP_OUTPUT &&
+		    what != PUMP_INPUT)
+			/* A single-command pipeline that is both a source
+			 * and a sink; its process file descriptor is
+			 * already being watched.
+			 */
+			return;
+		if (errno != EPERM)
+			error (FATAL, errno, "epoll_ctl");
+		/* Regular files and the like cannot be polled, but are
+		 * always ready.
+		 */
+		ps->unpolled[i] |= what;
 	}
 
-	for (i = 0; i < p->ncommands; i++) {
-		int pdes[2];
-		pid_t pid;
-		int output_read = -1, output_write = -1;
+	/* The descriptor may have become ready before we started watching
+	 * it, so try it once regardless; after that, wait for an edge.
+	 */
+	if (what == PUMP_OUTPUT)
+		ps->readable[i] = 1;
+	else if (what == PUMP_INPUT)
+		ps->writable[i] = 1;
+}
 
-		if (i != p->ncommands - 1 ||
-		    (p->redirect_out == REDIRECT_FD && p->want_out < 0)) {
-			if (pipe (pdes) < 0)
-				error (FATAL, errno, "pipe failed");
-			if (i == p->ncommands - 1)
-				p->outfd = pdes[0];
-			output_read = pdes[0];
-			output_write = pdes[1];
-		} else {
-			if (p->redirect_out == REDIRECT_FD)
-				output_write = p->want_out;
-			else if (p->redirect_out == REDIRECT_FILE_NAME) {
-				assert (p->want_outfile);
-				output_write = open (p->want_outfile,
-						     O_WRONLY | O_CREAT |
-						     O_TRUNC, 0666);
-				if (output_write < 0)
-					error (FATAL, errno, "can't open %s",
-					       p->want_outfile);
-			}
+/* Wait using edge-triggered epoll.  Each descriptor is registered once,
+ * the first time it needs to be watched, and drops out of the epoll set
+ * when it is closed; stale events for closed descriptors are harmless,
+ * since pipeline_pump checks for -1 before using readiness flags.  If
+ * block is zero, only collect events that are already pending.  Return
+ * non-zero if a child process may have exited.
+ */
+static int pump_wait_epoll (struct pump_state *ps, int block)
+{
+	struct epoll_event events[64];
+	int ret, child_event, i, k;
+
+	for (i = 0; i < ps->argc; ++i) {
+		pipeline *p = ps->pieces[i];
+
+		if (ps->known_source[i] && p->outfd != -1 &&
+		    !(ps->registered[i] & PUMP_OUTPUT)) {
+			pump_epoll_add (ps, i, p->outfd, PUMP_OUTPUT);
+			block = 0;
 		}
+		if (pump_is_sink (p) && p->infd != -1 &&
+		    !(ps->registered[i] & PUMP_INPUT)) {
+			pump_epoll_add (ps, i, p->infd, PUMP_INPUT);
+			block = 0;
+		}
+#ifdef USE_PIDFD
+		if (use_pidfds && p->ncommands) {
+			int fd;
+
+			fd = pump_watched_pidfd (p, ps->known_source[i],
+						 ps->dying_source[i], 0);
+			if (fd != -1 &&
+			    !(ps->registered[i] & PUMP_SOURCE_PID))
+				pump_epoll_add (ps, i, fd, PUMP_SOURCE_PID);
+			fd = pump_watched_pidfd (p, ps->known_source[i],
+						 ps->dying_source[i], 1);
+			if (fd != -1 &&
+			    !(ps->registered[i] & PUMP_SINK_PID))
+				pump_epoll_add (ps, i, fd, PUMP_SINK_PID);
+		}
+#endif /* USE_PIDFD */
+	}
+
+	ret = epoll_wait (ps->epfd, events, sizeof events / sizeof *events,
+			  block ? -1 : 0);
+	if (ret < 0 && errno != EINTR)
+		error (FATAL, errno, "epoll_wait");
+	child_event = (ret < 0);
 
-		/* Block SIGCHLD so that the signal handler doesn't collect
-		 * the exit status before we've filled in the pids array.
+	for (k = 0; k < ret; ++k) {
+		pipeline *p;
+		int what = events[k].data.u32 & ((1 << PUMP_SHIFT) - 1);
+
+		i = events[k].data.u32 >> PUMP_SHIFT;
+		p = ps->pieces[i];
+		/* Errors and hangups count as readiness: the next read or
+		 * write will report them.
 		 */
-		sigemptyset (&set);
-		sigaddset (&set, SIGCHLD);
-		sigemptyset (&oset);
-		while (sigprocmask (SIG_BLOCK, &set, &oset) == -1 &&
-		       errno == EINTR)
-			;
-
-		pid = fork ();
-		if (pid < 0)
-			error (FATAL, errno, "fork failed");
-		if (pid == 0) {
-			/* child */
-			if (post_fork)
-				post_fork ();
+		if (what == PUMP_OUTPUT)
+			ps->readable[i] = 1;
+		else if (what == PUMP_INPUT)
+			ps->writable[i] = 1;
+#ifdef USE_PIDFD
+		else {
+			int last = p->ncommands - 1;
+
+			/* Either end may have exited; the process file
+			 * descriptor is shared if they are the same
+			 * command.
+			 */
+			if (p->pidfds[last] != -1 &&
+			    reap_command (p, last, 0))
+				child_event = 1;
+			if (last != 0 && p->pidfds[0] != -1 &&
+			    reap_command (p, 0, 0))
+				child_event = 1;
+		}
+#endif /* USE_PIDFD */
+	}
 
-			/* input, reading side */
-			if (last_input != -1) {
-				if (dup2 (last_input, 0) < 0)
-					error (FATAL, errno, "dup2 failed");
-				if (close (last_input) < 0)
-					error (FATAL, errno, "close failed");
-			}
+	return child_event;
+}
 
-			/* output, writing side */
-			if (output_write != -1) {
-				if (dup2 (output_write, 1) < 0)
-					error (FATAL, errno, "dup2 failed");
-				if (close (output_write) < 0)
-					error (FATAL, errno, "close failed");
-			}
+#endif /* USE_EPOLL */
 
-			/* output, reading side */
-			if (output_read != -1)
-				if (close (output_read))
-					error (FATAL, errno, "close failed");
+static const char *find_delim (const char *s, size_t n,
+			       const char *delim, size_t delimlen);
 
-			/* input from first command, writing side; must close
-			 * it in every child because it has to be created
-			 * before forking anything
-			 */
-			if (p->infd != -1)
-				if (close (p->infd))
-					error (FATAL, errno, "close failed");
+/* The most that a merge sink takes from one of its sources before giving
+ * the next a turn.
+ */
+#define PUMP_MERGE_QUANTUM PUMP_READ_SIZE
+
+/* Return the length of the next unit of output that the merge sink
+ * ps->pieces[i] may take from source, or 0 if there is none yet.  A unit
+ * is whatever is available, up to PUMP_MERGE_QUANTUM bytes; but if the
+ * sink has a delimiter, it is cut back to the end of the last whole record
+ * that fits, or stretched to the end of the first if none does.  An
+ * unterminated record only counts once its source has finished, or if it
+ * fills the source's budget, which would otherwise never let it finish.
+ */
+static size_t pump_merge_unit (struct pump_state *ps, int i,
+			       pipeline *source)
+{
+	pipeline *sink = ps->pieces[i];
+	size_t peek_size = pipeline_peek_size (source);
+	size_t unit = 0;
+	const char *block, *end, *delim;
 
-			/* inputs and outputs from other active pipelines */
-			for (j = 0; j < n_active_pipelines; ++j) {
-				pipeline *active = active_pipelines[j];
-				if (!active || active == p)
-					continue;
-				/* ignore failures */
-				if (active->infd != -1)
-					close (active->infd);
-				if (active->outfd != -1)
-					close (active->outfd);
-			}
+	if (!peek_size)
+		return 0;
+	if (!sink->merge_delim)
+		return peek_size < PUMP_MERGE_QUANTUM ? peek_size
+						      : PUMP_MERGE_QUANTUM;
+
+	block = pipeline_peek (source, &peek_size);
+	end = block + peek_size;
+	for (delim = block;
+	     (delim = find_delim (delim, end - delim, sink->merge_delim,
+				  sink->merge_delimlen)) != NULL; ) {
+		delim += sink->merge_delimlen;
+		if (unit && (size_t) (delim - block) > PUMP_MERGE_QUANTUM)
+			break;
+		unit = delim - block;
+	}
+	if (unit)
+		return unit;
 
-			/* Restore signals. */
-			if (p->ignore_signals) {
-				sigaction (SIGINT, &osa_sigint, NULL);
-				sigaction (SIGQUIT, &osa_sigquit, NULL);
-			}
+	if ((source->outfd == -1 && !pump_spilled (ps, source)) ||
+	    (source->pump_budget && peek_size >= source->pump_budget))
+		return peek_size;
+	return 0;
+}
 
-			pipecmd_exec (p->commands[i]);
-			/* never returns */
-		}
+/* Has the merge sink ps->pieces[i] received everything from all of its
+ * sources, and have they all finished?
+ */
+static int pump_merge_done (struct pump_state *ps, int i)
+{
+	pipeline *sink = ps->pieces[i];
+	int k;
 
-		/* in the parent */
-		if (last_input != -1) {
-			if (close (last_input) < 0)
-				error (FATAL, errno, "close failed");
-		}
-		if (output_write != -1) {
-			if (close (output_write) < 0)
-				error (FATAL, errno, "close failed");
-		}
-		if (output_read != -1)
-			last_input = output_read;
-		p->pids[i] = pid;
-		p->statuses[i] = -1;
+	for (k = 0; k < sink->nsources; ++k) {
+		pipeline *source = sink->sources[k];
 
-		/* Unblock SIGCHLD. */
-		while (sigprocmask (SIG_SETMASK, &oset, NULL) == -1 &&
-		       errno == EINTR)
-			;
+		if (source->outfd != -1 || pipeline_peek_size (source) ||
+		    pump_spilled (ps, source))
+			return 0;
+	}
+	return 1;
+}
 
-		debug ("Started \"%s\", pid %d\n", p->commands[i]->name, pid);
+/* Return the data that the merge sink ps->pieces[i] is to receive next,
+ * setting *len to its length, or NULL if none of its sources has a unit of
+ * output ready.  Sources take turns, skipping those with nothing ready; but
+ * once the sink has started on a unit from one of them, it carries on with
+ * that until it has received all of it, however many writes that takes, so
+ * that nothing from another source lands in the middle.
+ */
+static const char *pump_merge_pending (struct pump_state *ps, int i,
+				       size_t *len)
+{
+	pipeline *sink = ps->pieces[i];
+	pipeline *source;
+	size_t peek_size;
+	int k;
+
+	for (k = 0; !ps->merge_left[i] && k < sink->nsources; ++k) {
+		int turn = (ps->merge_turn[i] + k) % sink->nsources;
+
+		ps->merge_left[i] = pump_merge_unit (ps, i,
+						     sink->sources[turn]);
+		if (ps->merge_left[i])
+			ps->merge_turn[i] = turn;
+	}
+	if (!ps->merge_left[i]) {
+		/* As for pump_pending. */
+		ps->waiting[i] = 1;
+		return NULL;
 	}
 
-	if (p->ncommands == 0)
-		p->outfd = last_input;
+	source = sink->sources[ps->merge_turn[i]];
+	peek_size = pipeline_peek_size (source);
+	*len = ps->merge_left[i];
+	return pipeline_peek (source, &peek_size);
 }
 
-int pipeline_wait_all (pipeline *p, int **statuses, int *n_statuses)
+/* w of the len bytes offered to the merge sink ps->pieces[i] were written
+ * to it.  It is the only sink of its sources, so discard them from the
+ * peek cache straight away.
+ */
+static void pump_merge_wrote (struct pump_state *ps, int i, size_t w,
+			      size_t len)
 {
-	int ret = 0;
-	int proc_count = p->ncommands;
-	int i;
-	int raise_signal = 0;
+	pipeline *sink = ps->pieces[i];
+
+	ps->copied += w;
+	if (w < len)
+		pump_blocked (ps, i, PUMP_INPUT);
+	pipeline_peek_skip (sink->sources[ps->merge_turn[i]], w);
+	ps->merge_left[i] -= w;
+	if (!ps->merge_left[i])
+		ps->merge_turn[i] = (ps->merge_turn[i] + 1) % sink->nsources;
+
+	if (pump_merge_done (ps, i))
+		pump_close (ps, i, PUMP_INPUT);
+}
 
-	init_debug ();
-	if (debug_level) {
-		debug ("Waiting for pipeline: ");
-		pipeline_dump (p, stderr);
+/* Return the data that the sink ps->pieces[i] has yet to receive from its
+ * source, setting *len to its length, or NULL if it has already received
+ * everything read so far.
+ */
+static const char *pump_pending (struct pump_state *ps, size_t *pos, int i,
+				 size_t *len)
+{
+	pipeline *source = ps->pieces[i]->source;
+	size_t peek_size;
+	const char *block;
+
+	if (!source)
+		return pump_merge_pending (ps, i, len);
+
+	peek_size = pipeline_peek_size (source);
+	if (peek_size <= pos[i]) {
+		/* Disable reading until data is read from a source fd or a
+		 * child process exits, so that we neither spin nor block if
+		 * the source is slow.
+		 */
+		ps->waiting[i] = 1;
+		return NULL;
 	}
 
-	assert (p->pids);	/* pipeline started */
-	assert (p->statuses);
+	/* peek a block from the source */
+	block = pipeline_peek (source, &peek_size);
+	/* should all already be in the peek cache */
+	assert (block);
+	assert (peek_size);
+	*len = peek_size - pos[i];
+	return block + pos[i];
+}
 
-	if (p->infile) {
-		if (fclose (p->infile))
-			error (0, errno,
-			       "closing pipeline input stream failed");
-		p->infile = NULL;
-		p->infd = -1;
-	} else if (p->infd != -1) {
-		if (close (p->infd))
-			error (0, errno, "closing pipeline input failed");
-		p->infd = -1;
+/* Discard whatever output from source has been written to all of its
+ * sinks from its peek cache.
+ */
+static void pump_trim (struct pump_state *ps, pipeline *source)
+{
+	size_t minpos = pipeline_peek_size (source);
+	int j, got_sink = 0;
+
+	for (j = 0; j < ps->argc; ++j) {
+		if (source != ps->pieces[j]->source ||
+		    ps->pieces[j]->infd == -1)
+			continue;
+		got_sink = 1;
+		if (ps->pos[j] < minpos)
+			minpos = ps->pos[j];
 	}
+	if (!got_sink || !minpos)
+		return;
 
-	if (p->outfile) {
-		if (fclose (p->outfile)) {
-			error (0, errno,
-			       "closing pipeline output stream failed");
-			ret = 127;
-		}
-		p->outfile = NULL;
-		p->outfd = -1;
-	} else if (p->outfd != -1) {
-		if (close (p->outfd)) {
-			error (0, errno, "closing pipeline output failed");
-			ret = 127;
-		}
-		p->outfd = -1;
+	pipeline_peek_skip (source, minpos);
+	for (j = 0; j < ps->argc; ++j) {
+		if (source == ps->pieces[j]->source)
+			ps->pos[j] -= minpos;
 	}
+}
 
-	/* Tell the SIGCHLD handler not to get in our way. */
-	queue_sigchld = 1;
+/* w of the len bytes offered to the sink ps->pieces[i] were written to
+ * it.
+ */
+static void pump_wrote (struct pump_state *ps, size_t *pos, int i,
+			size_t w, size_t len)
+{
+	pipeline *source = ps->pieces[i]->source;
+	size_t peek_size;
+	int j;
 
-	while (proc_count > 0) {
-		int r;
+	if (!source) {
+		pump_merge_wrote (ps, i, w, len);
+		return;
+	}
 
-		debug ("Active processes (%d):\n", proc_count);
+	peek_size = pipeline_peek_size (source);
+	ps->copied += w;
+	/* A short write means that the pipe is full. */
+	if (w < len)
+		pump_blocked (ps, i, PUMP_INPUT);
+	pos[i] += w;
 
-		/* Check for any statuses already collected by SIGCHLD
-		 * handlers or the previous iteration before calling
-		 * reap_children() again.
-		 */
-		for (i = 0; i < p->ncommands; ++i) {
-			int status;
+	/* If the source is dead and all data has been written to a sink on
+	 * it, close the writing end of the pipe to the sink.
+	 */
+	if (source->outfd == -1 && !pump_spilled (ps, source)) {
+		for (j = 0; j < ps->argc; ++j) {
+			if (source == ps->pieces[j]->source &&
+			    ps->pieces[j]->infd != -1 && pos[j] >= peek_size)
+				pump_close (ps, j, PUMP_INPUT);
+		}
+	}
 
-			if (p->pids[i] == -1)
-				continue;
+	pump_trim (ps, source);
+}
+
+/* Read a block from the source ps->pieces[i], which has filled its peek
+ * cache under the PIPELINE_BUDGET_SPILL policy, and append it to its
+ * spill file.
+ */
+static void pump_spill (struct pump_state *ps, int i)
+{
+	pipeline *p = ps->pieces[i];
+	ssize_t r;
+	size_t done;
+
+	if (!ps->spill[i]) {
+		ps->spill[i] = tmpfile ();
+		if (!ps->spill[i])
+			error (FATAL, errno, "can't create temporary file");
+		set_cloexec (fileno (ps->spill[i]));
+		debug ("spilling output of source pipeline %d\n", i);
+	}
+	if (!ps->spill_buf)
+		ps->spill_buf = xmalloc (PUMP_READ_SIZE);
 
-			debug ("  \"%s\" (%d) -> %d\n",
-			       p->commands[i]->name, p->pids[i],
-			       p->statuses[i]);
+	r = safe_read (p->outfd, ps->spill_buf, PUMP_READ_SIZE);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		pump_blocked (ps, i, PUMP_OUTPUT);
+		return;
+	}
+	if (trace_enabled)
+		trace_output (p, r);
+	if (r <= 0) {
+		debug ("source pipeline %d returned error or EOF\n", i);
+		pump_close (ps, i, PUMP_OUTPUT);
+		return;
+	}
 
-			if (p->statuses[i] == -1)
+	for (done = 0; done < (size_t) r; ) {
+		ssize_t w = pwrite (fileno (ps->spill[i]),
+				    ps->spill_buf + done, r - done,
+				    ps->spill_end[i] + done);
+		if (w < 0) {
+			if (errno == EINTR)
 				continue;
+			error (FATAL, errno, "can't write to temporary file");
+		}
+		done += w;
+	}
+	ps->spill_end[i] += r;
+}
 
-			status = p->statuses[i];
-			p->pids[i] = -1;
-			--proc_count;
-			if (WIFSIGNALED (status)) {
-				int sig = WTERMSIG (status);
-#ifdef SIGPIPE
-				if (sig == SIGPIPE)
-					status = 0;
-				else {
-#endif /* SIGPIPE */
-					/* signals currently blocked,
-					 * re-raise later
-					 */
-					if (sig == SIGINT || sig == SIGQUIT)
-						raise_signal = sig;
-					else if (WCOREDUMP (status))
-						error (0, 0,
-						       "%s: %s (core dumped)",
-						       p->commands[i]->name,
-						       strsignal (sig));
-					else
-						error (0, 0, "%s: %s",
-						       p->commands[i]->name,
-						       strsignal (sig));
-#ifdef SIGPIPE
-				}
-#endif /* SIGPIPE */
-			} else if (!WIFEXITED (status))
-				error (0, 0, "unexpected status %d",
-				       status);
-
-			if (p->commands[i]->tag == PIPECMD_FUNCTION) {
-				struct pipecmd_function *cmdf =
-					&p->commands[i]->u.function;
-				if (cmdf->free_func)
-					(*cmdf->free_func) (cmdf->data);
-			}
+/* Move as much of the spill file of the source ps->pieces[i] back into its
+ * peek cache as its budget allows.
+ */
+static void pump_unspill (struct pump_state *ps, int i)
+{
+	pipeline *p = ps->pieces[i];
+	size_t peek_size = pipeline_peek_size (p);
+	size_t want = ps->spill_end[i] - ps->spill_start[i];
+	ssize_t r;
 
-			if (i == p->ncommands - 1) {
-				if (WIFSIGNALED (status))
-					ret = 128 + WTERMSIG (status);
-				else if (WEXITSTATUS (status))
-					ret = WEXITSTATUS (status);
-			} else if (!ret &&
-				   (WIFSIGNALED (status) ||
-				    WEXITSTATUS (status)))
-				ret = 127;
-		}
+	if (!want || peek_size >= p->pump_budget)
+		return;
+	if (want > p->pump_budget - peek_size)
+		want = p->pump_budget - peek_size;
+
+	make_room (p, want);
+	do
+		r = pread (fileno (ps->spill[i]), p->buffer + p->buflen, want,
+			   ps->spill_start[i]);
+	while (r < 0 && errno == EINTR);
+	if (r <= 0)
+		error (FATAL, r < 0 ? errno : 0,
+		       "can't read from temporary file");
+	p->buflen += r;
+	p->peek_offset += r;
+	ps->spill_start[i] += r;
+	if (ps->spill_start[i] == ps->spill_end[i]) {
+		ps->spill_start[i] = ps->spill_end[i] = 0;
+		if (ftruncate (fileno (ps->spill[i]), 0) < 0)
+			debug ("can't truncate temporary file: %s\n",
+			       strerror (errno));
+	}
+	memset (ps->waiting, 0, ps->argc * sizeof *ps->waiting);
+}
 
-		assert (proc_count >= 0);
-		if (proc_count == 0)
-			break;
+/* Close the input of the sinks furthest behind on the source
+ * ps->pieces[i] until the rest fit within its budget, under the
+ * PIPELINE_BUDGET_DROP policy.
+ */
+static void pump_drop (struct pump_state *ps, int i)
+{
+	pipeline *source = ps->pieces[i];
 
-		errno = 0;
-		r = reap_children (1);
+	while (pipeline_peek_size (source) > source->pump_budget) {
+		int j, slowest = -1;
 
-		if (r == -1 && errno == ECHILD)
-			/* Eh? The pipeline was allegedly still running, so
-			 * we shouldn't have got ECHILD.
-			 */
-			error (FATAL, errno, "waitpid failed");
+		for (j = 0; j < ps->argc; ++j) {
+			if (ps->pieces[j]->source == source &&
+			    ps->pieces[j]->infd != -1 &&
+			    (slowest == -1 ||
+			     ps->pos[j] < ps->pos[slowest]))
+				slowest = j;
+		}
+		if (slowest == -1)
+			break;
+		debug ("dropping sink pipeline %d, %lu bytes behind\n",
+		       slowest, (unsigned long) pump_lag (ps, slowest));
+		pump_close (ps, slowest, PUMP_INPUT);
+		pump_trim (ps, source);
 	}
+}
 
-	queue_sigchld = 0;
+/* Apply each source's budget, and bring the lag of each sink up to date.
+ * Closing a sink may leave a source's peek cache holding data that the
+ * remaining sinks have already received, so trim that too.
+ */
+static void pump_budgets (struct pump_state *ps)
+{
+	int i;
 
-	for (i = 0; i < n_active_pipelines; ++i)
-		if (active_pipelines[i] == p)
-			active_pipelines[i] = NULL;
+	for (i = 0; i < ps->argc; ++i) {
+		pipeline *p = ps->pieces[i];
 
-	/* It isn't normally safe to compactify active_pipelines as we go,
-	 * because it's used by a signal handler.  However, if it's entirely
-	 * empty, we can safely clean it up now.  This prevents the table
-	 * growing without bound, not to mention pacifying valgrind.
-	 */
-	for (i = 0; i < n_active_pipelines; ++i)
-		if (active_pipelines[i])
-			break;
-	if (i == n_active_pipelines) {
-		n_active_pipelines = 0;
-		max_active_pipelines = 0;
-		free (active_pipelines);
-		active_pipelines = NULL;
+		if (!ps->known_source[i])
+			continue;
+		pump_trim (ps, p);
+		if (!p->pump_budget)
+			continue;
+		if (p->pump_policy == PIPELINE_BUDGET_SPILL && ps->spill[i])
+			pump_unspill (ps, i);
+		else if (p->pump_policy == PIPELINE_BUDGET_DROP)
+			pump_drop (ps, i);
 	}
 
-	if (statuses && n_statuses) {
-		*statuses = xnmalloc (p->ncommands, sizeof **statuses);
-		*n_statuses = p->ncommands;
-		for (i = 0; i < p->ncommands; ++i)
-			(*statuses)[i] = p->statuses[i];
+	for (i = 0; i < ps->argc; ++i) {
+		if (pump_is_sink (ps->pieces[i]) && ps->pieces[i]->infd != -1)
+			ps->pieces[i]->pump_lag = pump_lag (ps, i);
 	}
+}
 
-	free (p->pids);
-	p->pids = NULL;
-	free (p->statuses);
-	p->statuses = NULL;
+/* Should the next read from the source ps->pieces[i] go to its spill file
+ * rather than its peek cache?
+ */
+static int pump_spilling (struct pump_state *ps, int i)
+{
+	pipeline *p = ps->pieces[i];
 
-	if (p->ignore_signals && !--ignored_signals) {
-		/* Restore signals. */
-		sigaction (SIGINT, &osa_sigint, NULL);
-		sigaction (SIGQUIT, &osa_sigquit, NULL);
-	}
+	return p->pump_budget && p->pump_policy == PIPELINE_BUDGET_SPILL &&
+	       (pump_spilled (ps, p) ||
+		pipeline_peek_size (p) >= p->pump_budget);
+}
 
-	if (raise_signal)
-		raise (raise_signal);
+/* Must the ring be told not to wait for fd?  Waiting for a regular file or
+ * a block device is no worse than reading or writing it ourselves, and
+ * refusing to would only make us poll it until its data arrives; anything
+ * else may not be ready for as long as the process at the other end likes.
+ */
+static int pump_nowait (int fd)
+{
+	struct stat st;
 
-	return ret;
+	return fstat (fd, &st) < 0 ||
+	       !(S_ISREG (st.st_mode) || S_ISBLK (st.st_mode));
 }
 
-int pipeline_wait (pipeline *p)
+/* Queue a read of a block from the source ps->pieces[i] into its peek
+ * cache, which is registered with the ring so that the kernel need not map
+ * it again for each read.
+ */
+static void pump_queue_read (struct pump_state *ps, int i)
 {
-	return pipeline_wait_all (p, NULL, NULL);
+	pipeline *p = ps->pieces[i];
+	int index = i;
+
+	make_room (p, PUMP_READ_SIZE);
+	if (uring_set_buffer (ps->ring, i, p->buffer, p->bufmax + 1) < 0)
+		index = -1;
+	uring_read (ps->ring, p->outfd, p->buffer + p->buflen,
+		    PUMP_READ_SIZE, index, ps->nowait[i] & PUMP_OUTPUT,
+		    &ps->read_result[i]);
+	ps->queued[i] |= PUMP_OUTPUT;
 }
 
-int pipeline_run (pipeline *p)
+/* Submit the reads queued by pump_queue_read together with a write to
+ * each available sink of whatever it has yet to receive, and then deal
+ * with the results as pipeline_pump would have done had it made each
+ * system call itself.  Data read here is written on the next iteration.
+ * The kernel refuses to try a descriptor that it can't promise not to wait
+ * for, such as a pipe that has been spliced; nothing happens to it, and
+ * the caller deals with it from then on.
+ */
+static void pump_batch (struct pump_state *ps, size_t *pos, int *write_error)
 {
-	int status;
+	int i;
 
-	pipeline_start (p);
-	status = pipeline_wait (p);
-	pipeline_free (p);
+	for (i = 0; i < ps->argc; ++i) {
+		pipeline *p = ps->pieces[i];
+		const char *block;
 
-	return status;
+		if (!pump_is_sink (p) || p->infd == -1 || !ps->writable[i] ||
+		    (ps->unbatched[i] & PUMP_INPUT))
+			continue;
+		block = pump_pending (ps, pos, i, &ps->write_len[i]);
+		if (!block)
+			continue;
+		uring_write (ps->ring, p->infd, block, ps->write_len[i],
+			     ps->nowait[i] & PUMP_INPUT, &ps->write_result[i]);
+		ps->queued[i] |= PUMP_INPUT;
+	}
+
+	if (uring_run (ps->ring) < 0)
+		error (FATAL, errno, "io_uring_enter");
+
+	for (i = 0; i < ps->argc; ++i) {
+		ssize_t r = ps->read_result[i];
+
+		if (!(ps->queued[i] & PUMP_OUTPUT))
+			continue;
+		if (r == -EOPNOTSUPP)
+			ps->unbatched[i] |= PUMP_OUTPUT;
+		else if (r == -EAGAIN)
+			pump_blocked (ps, i, PUMP_OUTPUT);
+		else if (r <= 0) {
+			if (r == 0)
+				fill_block (ps->pieces[i], 0, 1);
+			debug ("source pipeline %d returned error or EOF\n",
+			       i);
+			pump_close (ps, i, PUMP_OUTPUT);
+		} else {
+			fill_block (ps->pieces[i], r, 1);
+			memset (ps->waiting, 0,
+				ps->argc * sizeof *ps->waiting);
+		}
+	}
+
+	for (i = 0; i < ps->argc; ++i) {
+		ssize_t w = ps->write_result[i];
+
+		if (!(ps->queued[i] & PUMP_INPUT))
+			continue;
+		if (w == -EOPNOTSUPP) {
+			ps->unbatched[i] |= PUMP_INPUT;
+			continue;
+		} else if (w == -EAGAIN)
+			w = 0;
+		else if (w < 0) {
+			if (w != -EPIPE)
+				write_error[i] = -w;
+			pump_close (ps, i, PUMP_INPUT);
+			continue;
+		}
+		pump_wrote (ps, pos, i, w, ps->write_len[i]);
+	}
+
+	memset (ps->queued, 0, ps->argc * sizeof *ps->queued);
 }
 
-void pipeline_pump (pipeline *p, ...)
+void pump_pieces (pipeline **pieces, int argc)
 {
-	va_list argv;
-	int argc, i, j;
-	pipeline *arg, **pieces;
+	int i, j;
 	size_t *pos;
-	int *known_source, *blocking_in, *blocking_out,
-	    *dying_source, *waiting, *write_error;
-	struct sigaction sa, osa_sigpipe;
+	int *known_source, *dying_source, *waiting, *write_error;
+	struct pump_state ps;
+	struct sigaction sa;
 
-	/* Count pipelines and allocate space for arrays. */
-	va_start (argv, p);
-	argc = 0;
-	for (arg = p; arg; arg = va_arg (argv, pipeline *))
-		++argc;
-	va_end (argv);
-	pieces = xnmalloc (argc, sizeof *pieces);
+	/* Allocate space for arrays. */
 	pos = xnmalloc (argc, sizeof *pos);
 	known_source = xcalloc (argc, sizeof *known_source);
-	blocking_in = xcalloc (argc, sizeof *blocking_in);
-	blocking_out = xcalloc (argc, sizeof *blocking_out);
 	dying_source = xcalloc (argc, sizeof *dying_source);
 	waiting = xcalloc (argc, sizeof *waiting);
 	write_error = xcalloc (argc, sizeof *write_error);
 
-	/* Set up arrays of pipelines and their read positions. Start all
-	 * pipelines if necessary.
-	 */
-	va_start (argv, p);
-	for (arg = p, i = 0; i < argc; arg = va_arg (argv, pipeline *), ++i) {
-		pieces[i] = arg;
+	/* Set up read positions. Start all pipelines if necessary. */
+	for (i = 0; i < argc; ++i) {
 		pos[i] = 0;
-		if (!pieces[i]->pids)
-			pipeline_start (pieces[i]);
+		pieces[i]->pump_lag = 0;
 	}
-	assert (arg == NULL);
-	va_end (argv);
+	/* Start pipelines in the order given, except that a source's only
+	 * sink is started before the source, so that the source can be
+	 * given its input directly.
+	 */
+	for (i = 0; i < argc; ++i)
+		if (pump_start_early (pieces[i]))
+			start_pipeline (pieces[i], 1);
+	for (i = 0; i < argc; ++i)
+		if (!pieces[i]->pids)
+			start_pipeline (pieces[i], 1);
 
 	/* All source pipelines must be supplied as arguments. */
 	for (i = 0; i < argc; ++i) {
@@ -1786,13 +4830,29 @@ void pipeline_pump (pipeline *p, ...)
 		}
 		assert (found);
 	}
+	for (i = 0; i < argc; ++i) {
+		int k;
+		for (k = 0; k < pieces[i]->nsources; ++k) {
+			int found = 0;
+			/* Merged output has nowhere else to go. */
+			assert (pieces[i]->sources[k]->nsinks == 1);
+			for (j = 0; j < argc; ++j) {
+				if (pieces[i]->sources[k] == pieces[j]) {
+					known_source[j] = found = 1;
+					break;
+				}
+			}
+			assert (found);
+		}
+	}
 
+	ps.nonblocking = xcalloc (argc, sizeof *ps.nonblocking);
 	for (i = 0; i < argc; ++i) {
 		int flags;
 		if (pieces[i]->infd != -1) {
 			flags = fcntl (pieces[i]->infd, F_GETFL);
 			if (!(flags & O_NONBLOCK)) {
-				blocking_in[i] = 1;
+				ps.nonblocking[i] |= PUMP_INPUT;
 				fcntl (pieces[i]->infd, F_SETFL,
 				       flags | O_NONBLOCK);
 			}
@@ -1800,53 +4860,146 @@ void pipeline_pump (pipeline *p, ...)
 		if (pieces[i]->outfd != -1) {
 			flags = fcntl (pieces[i]->outfd, F_GETFL);
 			if (!(flags & O_NONBLOCK)) {
-				blocking_out[i] = 1;
+				ps.nonblocking[i] |= PUMP_OUTPUT;
 				fcntl (pieces[i]->outfd, F_SETFL,
 				       flags | O_NONBLOCK);
 			}
 		}
 	}
 
+	ps.argc = argc;
+	ps.pieces = pieces;
+	ps.known_source = known_source;
+	ps.dying_source = dying_source;
+	ps.waiting = waiting;
+	ps.pos = pos;
+	ps.merge_turn = xcalloc (argc, sizeof *ps.merge_turn);
+	ps.merge_left = xcalloc (argc, sizeof *ps.merge_left);
+	ps.readable = xcalloc (argc, sizeof *ps.readable);
+	ps.writable = xcalloc (argc, sizeof *ps.writable);
+	ps.registered = xcalloc (argc, sizeof *ps.registered);
+	ps.unpolled = xcalloc (argc, sizeof *ps.unpolled);
+	ps.spliceable = xcalloc (argc, sizeof *ps.spliceable);
+	ps.regular = xcalloc (argc, sizeof *ps.regular);
+	ps.copied = ps.zero_copied = 0;
+	ps.spill = xcalloc (argc, sizeof *ps.spill);
+	ps.spill_start = xcalloc (argc, sizeof *ps.spill_start);
+	ps.spill_end = xcalloc (argc, sizeof *ps.spill_end);
+	ps.spill_buf = NULL;
+#ifdef USE_SPLICE
+	for (i = 0; i < argc; ++i) {
+		if (known_source[i] && pieces[i]->outfd != -1 &&
+		    is_pipe (pieces[i]->outfd))
+			ps.spliceable[i] |= PUMP_OUTPUT;
+		if (pieces[i]->source && pieces[i]->infd != -1) {
+			if (is_pipe (pieces[i]->infd))
+				ps.spliceable[i] |= PUMP_INPUT;
+			else if (is_splice_file (pieces[i]->infd))
+				ps.regular[i] |= PUMP_INPUT;
+		}
+	}
+#endif /* USE_SPLICE */
+	ps.epfd = -1;
+#ifdef USE_EPOLL
+	ps.epfd = epoll_create1 (EPOLL_CLOEXEC);
+	if (ps.epfd < 0)
+		debug ("epoll_create1 failed (%s); using select\n",
+		       strerror (errno));
+#endif /* USE_EPOLL */
+	ps.ring = uring_new (2 * argc, argc);
+	if (ps.ring) {
+		ps.queued = xcalloc (argc, sizeof *ps.queued);
+		ps.nowait = xcalloc (argc, sizeof *ps.nowait);
+		ps.unbatched = xcalloc (argc, sizeof *ps.unbatched);
+		for (i = 0; i < argc; ++i) {
+			if (known_source[i] && pieces[i]->outfd != -1 &&
+			    pump_nowait (pieces[i]->outfd))
+				ps.nowait[i] |= PUMP_OUTPUT;
+			if (pump_is_sink (pieces[i]) && pieces[i]->infd != -1 &&
+			    pump_nowait (pieces[i]->infd))
+				ps.nowait[i] |= PUMP_INPUT;
+		}
+		ps.read_result = xnmalloc (argc, sizeof *ps.read_result);
+		ps.write_result = xnmalloc (argc, sizeof *ps.write_result);
+		ps.write_len = xnmalloc (argc, sizeof *ps.write_len);
+	} else
+		debug ("io_uring unavailable (%s); reading and writing "
+		       "separately\n", strerror (errno));
+
+	lock_context ();
+	if (!context.pumping++) {
 #ifdef SIGPIPE
-	memset (&sa, 0, sizeof sa);
-	sa.sa_handler = SIG_IGN;
-	sigemptyset (&sa.sa_mask);
-	sa.sa_flags = 0;
-	sigaction (SIGPIPE, &sa, &osa_sigpipe);
+		memset (&sa, 0, sizeof sa);
+		sa.sa_handler = SIG_IGN;
+		sigemptyset (&sa.sa_mask);
+		sa.sa_flags = 0;
+		sigaction (SIGPIPE, &sa, &context.osa_sigpipe);
 #endif
 
+#ifdef USE_PIDFD
+		if (!use_pidfds)
+#endif
+		{
 #ifdef SA_RESTART
-	/* We rely on getting EINTR from select. */
-	sigaction (SIGCHLD, NULL, &sa);
-	sa.sa_flags &= ~SA_RESTART;
-	sigaction (SIGCHLD, &sa, NULL);
+			/* We rely on getting EINTR from select or
+			 * epoll_wait.
+			 */
+			sigaction (SIGCHLD, NULL, &sa);
+			sa.sa_flags &= ~SA_RESTART;
+			sigaction (SIGCHLD, &sa, NULL);
 #endif
+		}
+	}
+	unlock_context ();
 
 	for (;;) {
-		fd_set rfds, wfds;
-		int maxfd = -1;
-		int ret;
+		int watching = 0, ready = 0;
+		int child_event;
+
+		pump_budgets (&ps);
 
-		/* If a source dies and all data from it has been written to
-		 * all sinks, close the writing end of the pipe to each of
-		 * its sinks.
+		/* If a source dies, close the writing end of the pipe to
+		 * each of its sinks once all data from it has been written
+		 * to that sink, without waiting for slower sinks.
 		 */
 		for (i = 0; i < argc; ++i) {
 			if (!known_source[i] || pieces[i]->outfd != -1 ||
-			    pipeline_peek_size (pieces[i]))
+			    pump_spilled (&ps, pieces[i]))
 				continue;
 			for (j = 0; j < argc; ++j) {
 				if (pieces[j]->source == pieces[i] &&
-				    pieces[j]->infd != -1) {
-					if (close (pieces[j]->infd))
+				    pieces[j]->infd != -1 &&
+				    pos[j] >= pipeline_peek_size (pieces[i])) {
+					if (pump_close (&ps, j, PUMP_INPUT))
 						error (0, errno,
 						       "closing pipeline "
 						       "input failed");
-					pieces[j]->infd = -1;
 				}
 			}
 		}
 
+		/* A merge sink is finished once all its sources are, and it
+		 * has received everything from them.  Until then, a source
+		 * that has died may leave an unterminated record for it.
+		 */
+		for (i = 0; i < argc; ++i) {
+			int k;
+			if (!pieces[i]->nsources || pieces[i]->infd == -1)
+				continue;
+			if (pump_merge_done (&ps, i)) {
+				if (pump_close (&ps, i, PUMP_INPUT))
+					error (0, errno,
+					       "closing pipeline input failed");
+				continue;
+			}
+			for (k = 0; k < pieces[i]->nsources; ++k) {
+				pipeline *source = pieces[i]->sources[k];
+				if (source->outfd == -1 &&
+				    pipeline_peek_size (source))
+					waiting[i] = 0;
+			}
+		}
+
 		/* If all sinks on a source have died, close the reading end
 		 * of the pipe from that source.
 		 */
@@ -1855,7 +5008,7 @@ void pipeline_pump (pipeline *p, ...)
 			if (!known_source[i] || pieces[i]->outfd == -1)
 				continue;
 			for (j = 0; j < argc; ++j) {
-				if (pieces[j]->source == pieces[i] &&
+				if (pump_feeds (pieces[j], pieces[i]) &&
 				    pieces[j]->infd != -1) {
 					got_sink = 1;
 					break;
@@ -1863,34 +5016,50 @@ void pipeline_pump (pipeline *p, ...)
 			}
 			if (got_sink)
 				continue;
-			if (close (pieces[i]->outfd))
+			if (pump_close (&ps, i, PUMP_OUTPUT))
 				error (0, errno,
 				       "closing pipeline output failed");
-			pieces[i]->outfd = -1;
 		}
 
-		FD_ZERO (&rfds);
-		FD_ZERO (&wfds);
+		/* Is there anything left to watch, and is anything already
+		 * known to be ready?
+		 */
 		for (i = 0; i < argc; ++i) {
 			/* Input to sink pipeline. */
-			if (pieces[i]->source && pieces[i]->infd != -1 &&
+			if (pump_is_sink (pieces[i]) && pieces[i]->infd != -1 &&
 			    !waiting[i]) {
-				FD_SET (pieces[i]->infd, &wfds);
-				if (pieces[i]->infd > maxfd)
-					maxfd = pieces[i]->infd;
+				watching = 1;
+				if (ps.writable[i])
+					ready = 1;
 			}
 			/* Output from source pipeline. */
 			if (known_source[i] && pieces[i]->outfd != -1) {
-				FD_SET (pieces[i]->outfd, &rfds);
-				if (pieces[i]->outfd > maxfd)
-					maxfd = pieces[i]->outfd;
+				watching = 1;
+				if (ps.readable[i] && !pump_throttled (&ps, i))
+					ready = 1;
 			}
 		}
-		if (maxfd == -1)
+		if (!watching)
 			break; /* nothing meaningful left to do */
 
-		ret = select (maxfd + 1, &rfds, &wfds, NULL, NULL);
-		if (ret < 0 && errno == EINTR) {
+#ifdef USE_EPOLL
+		if (ps.epfd != -1)
+			child_event = pump_wait_epoll (&ps, !ready);
+		else
+#endif /* USE_EPOLL */
+			child_event = pump_wait_select (&ps);
+		trace_event (TRACE_PUMP, 0, -1, 0, ps.copied + ps.zero_copied,
+			     NULL);
+
+		if (child_event) {
+			/* Without process file descriptors, a SIGCHLD
+			 * interrupted us, and we must collect the status.
+			 */
+#ifdef USE_PIDFD
+			if (!use_pidfds)
+#endif /* USE_PIDFD */
+				poll_children (0);
+
 			/* Did a source or sink pipeline die? */
 			for (i = 0; i < argc; ++i) {
 				if (pieces[i]->ncommands == 0)
@@ -1899,47 +5068,73 @@ void pipeline_pump (pipeline *p, ...)
 				    pieces[i]->outfd != -1) {
 					int last = pieces[i]->ncommands - 1;
 					assert (pieces[i]->statuses);
-					if (pieces[i]->statuses[last] != -1) {
+					if (pipeline_command_status
+						(pieces[i], last) != -1) {
 						debug ("source pipeline %d "
 						       "died\n", i);
 						dying_source[i] = 1;
 					}
 				}
-				if (pieces[i]->source &&
+				if (pump_is_sink (pieces[i]) &&
 				    pieces[i]->infd != -1) {
 					assert (pieces[i]->statuses);
-					if (pieces[i]->statuses[0] != -1) {
+					if (pipeline_command_status
+						(pieces[i], 0) != -1) {
 						debug ("sink pipeline %d "
 						       "died\n", i);
-						close (pieces[i]->infd);
-						pieces[i]->infd = -1;
+						pump_close (&ps, i,
+							    PUMP_INPUT);
 					}
 				}
 			}
 			continue;
-		} else if (ret < 0)
-			error (FATAL, errno, "select");
+		}
 
 		/* Read a block of data from each available source pipeline. */
 		for (i = 0; i < argc; ++i) {
+			const char *block;
 			size_t peek_size, len;
 
 			if (!known_source[i] || pieces[i]->outfd == -1)
 				continue;
-			if (!FD_ISSET (pieces[i]->outfd, &rfds))
+			if (!ps.readable[i] || pump_throttled (&ps, i))
+				continue;
+			if (pump_spilling (&ps, i)) {
+				pump_spill (&ps, i);
+				continue;
+			}
+
+#ifdef USE_SPLICE
+			if (pump_zero_copy (&ps, i, pos, write_error))
+				continue;
+			if (ps.ring && pump_drain_first (&ps, i, pos))
+				continue;
+#endif /* USE_SPLICE */
+
+			if (ps.ring && !(ps.unbatched[i] & PUMP_OUTPUT)) {
+				pump_queue_read (&ps, i);
 				continue;
+			}
 
 			peek_size = pipeline_peek_size (pieces[i]);
-			len = peek_size + 4096;
-			if (!pipeline_peek (pieces[i], &len) ||
-			    len == peek_size) {
+			len = peek_size + PUMP_READ_SIZE;
+			block = pipeline_peek (pieces[i], &len);
+			if (!block && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				/* Keep reading until the pipe is empty, even
+				 * after a short read: if the writer has
+				 * already gone away, there will be no further
+				 * edge to tell us about end-of-file.
+				 */
+				pump_blocked (&ps, i, PUMP_OUTPUT);
+				continue;
+			}
+			if (!block || len == peek_size) {
 				/* Error or end-of-file; skip this pipeline
 				 * from now on.
 				 */
 				debug ("source pipeline %d returned error "
 				       "or EOF\n", i);
-				close (pieces[i]->outfd);
-				pieces[i]->outfd = -1;
+				pump_close (&ps, i, PUMP_OUTPUT);
 			} else
 				/* This is rather a large hammer. Whenever
 				 * any data is read from any source
@@ -1947,48 +5142,37 @@ void pipeline_pump (pipeline *p, ...)
 				 * sink pipelines, even if they aren't
 				 * receiving data from the source in
 				 * question. This probably results in a few
-				 * more passes around the select() loop, but
-				 * it eliminates some annoyingly fiddly
+				 * more passes around the main loop, but it
+				 * eliminates some annoyingly fiddly
 				 * bookkeeping.
 				 */
 				memset (waiting, 0, argc * sizeof *waiting);
 		}
 
+		if (ps.ring)
+			pump_batch (&ps, pos, write_error);
+
 		/* Write as much data as we can to each available sink
-		 * pipeline.
+		 * pipeline that pump_batch has not already dealt with.
 		 */
 		for (i = 0; i < argc; ++i) {
 			const char *block;
-			size_t peek_size;
+			size_t len;
 			ssize_t w;
-			size_t minpos;
 
-			if (!pieces[i]->source || pieces[i]->infd == -1)
+			if (!pump_is_sink (pieces[i]) || pieces[i]->infd == -1)
 				continue;
-			if (!FD_ISSET (pieces[i]->infd, &wfds))
+			if (!ps.writable[i])
 				continue;
-			peek_size = pipeline_peek_size (pieces[i]->source);
-			if (peek_size <= pos[i]) {
-				/* Disable reading until data is read from a
-				 * source fd or a child process exits, so
-				 * that we neither spin nor block if the
-				 * source is slow.
-				 */
-				waiting[i] = 1;
+			if (ps.ring && !(ps.unbatched[i] & PUMP_INPUT))
+				continue;
+			block = pump_pending (&ps, pos, i, &len);
+			if (!block)
 				continue;
-			}
-
-			/* peek a block from the source */
-			block = pipeline_peek (pieces[i]->source, &peek_size);
-			/* should all already be in the peek cache */
-			assert (block);
-			assert (peek_size);
 
 			/* write as much of it as will fit to the sink */
 			for (;;) {
-				w = safe_write (pieces[i]->infd,
-						block + pos[i],
-						peek_size - pos[i]);
+				w = safe_write (pieces[i]->infd, block, len);
 				if (w >= 0)
 					break;
 				if (errno == EAGAIN) {
@@ -2001,91 +5185,145 @@ void pipeline_pump (pipeline *p, ...)
 				 */
 				if (errno != EPIPE)
 					write_error[i] = errno;
-				close (pieces[i]->infd);
-				pieces[i]->infd = -1;
+				pump_close (&ps, i, PUMP_INPUT);
 				goto next_sink;
 			}
-			pos[i] += w;
-			minpos = pos[i];
-
-			/* check other sinks on the same source, and update
-			 * the source's read position if earlier data is no
-			 * longer needed by any sink
-			 */
-			for (j = 0; j < argc; ++j) {
-				if (pieces[i]->source != pieces[j]->source ||
-				    pieces[j]->infd == -1)
-					continue;
-				if (pos[j] < minpos)
-					minpos = pos[j];
-				/* If the source is dead and all data has
-				 * been written to this sink, close the
-				 * writing end of the pipe to the sink.
-				 */
-				if (pieces[j]->source->outfd == -1 &&
-				    pos[j] >= peek_size) {
-					close (pieces[j]->infd);
-					pieces[j]->infd = -1;
-				}
-			}
-
-			/* If some data has been written to all sinks,
-			 * discard it from the source's peek cache.
-			 */
-			pipeline_peek_skip (pieces[i]->source, minpos);
-			for (j = 0; j < argc; ++j) {
-				if (pieces[i]->source == pieces[j]->source)
-					pos[j] -= minpos;
-			}
+			pump_wrote (&ps, pos, i, w, len);
 next_sink:		;
 		}
 	}
 
+	lock_context ();
+	if (!--context.pumping) {
+#ifdef USE_PIDFD
+		if (!use_pidfds)
+#endif
+		{
 #ifdef SA_RESTART
-	sigaction (SIGCHLD, NULL, &sa);
-	sa.sa_flags |= SA_RESTART;
-	sigaction (SIGCHLD, &sa, NULL);
+			sigaction (SIGCHLD, NULL, &sa);
+			sa.sa_flags |= SA_RESTART;
+			sigaction (SIGCHLD, &sa, NULL);
 #endif
+		}
 
 #ifdef SIGPIPE
-	sigaction (SIGPIPE, &osa_sigpipe, NULL);
+		sigaction (SIGPIPE, &context.osa_sigpipe, NULL);
 #endif
+	}
+	unlock_context ();
 
 	for (i = 0; i < argc; ++i) {
 		int flags;
-		if (blocking_in[i] && pieces[i]->infd != -1) {
+		if ((ps.nonblocking[i] & PUMP_INPUT) &&
+		    pieces[i]->infd != -1) {
 			flags = fcntl (pieces[i]->infd, F_GETFL);
 			fcntl (pieces[i]->infd, F_SETFL, flags & ~O_NONBLOCK);
 		}
-		if (blocking_out[i] && pieces[i]->outfd != -1) {
+		if ((ps.nonblocking[i] & PUMP_OUTPUT) &&
+		    pieces[i]->outfd != -1) {
 			flags = fcntl (pieces[i]->outfd, F_GETFL);
 			fcntl (pieces[i]->outfd, F_SETFL, flags & ~O_NONBLOCK);
 		}
 	}
 
+	debug ("pipeline_pump: %llu bytes moved without copying, "
+	       "%llu bytes copied\n", ps.zero_copied, ps.copied);
+
 	for (i = 0; i < argc; ++i) {
 		if (write_error[i])
 			error (FATAL, write_error[i], "write to sink %d", i);
 	}
 
+	if (ps.ring) {
+		uring_free (ps.ring);
+		free (ps.write_len);
+		free (ps.write_result);
+		free (ps.read_result);
+		free (ps.unbatched);
+		free (ps.nowait);
+		free (ps.queued);
+	}
+	for (i = 0; i < argc; ++i) {
+		if (ps.spill[i])
+			fclose (ps.spill[i]);
+	}
+	free (ps.spill_buf);
+	free (ps.spill_end);
+	free (ps.spill_start);
+	free (ps.spill);
+	if (ps.epfd != -1)
+		close (ps.epfd);
+	free (ps.regular);
+	free (ps.spliceable);
+	free (ps.nonblocking);
+	free (ps.unpolled);
+	free (ps.registered);
+	free (ps.writable);
+	free (ps.readable);
+	free (ps.merge_left);
+	free (ps.merge_turn);
 	free (write_error);
 	free (waiting);
 	free (dying_source);
-	free (blocking_out);
-	free (blocking_in);
 	free (known_source);
-	free (pieces);
 	free (pos);
 }
 
+void pipeline_pump (pipeline *p, ...)
+{
+	va_list argv;
+	int argc, i;
+	pipeline *arg, **pieces;
+
+	/* Count pipelines and set up an array of them. */
+	va_start (argv, p);
+	argc = 0;
+	for (arg = p; arg; arg = va_arg (argv, pipeline *))
+		++argc;
+	va_end (argv);
+	pieces = xnmalloc (argc, sizeof *pieces);
+
+	va_start (argv, p);
+	for (arg = p, i = 0; i < argc; arg = va_arg (argv, pipeline *), ++i)
+		pieces[i] = arg;
+	assert (arg == NULL);
+	va_end (argv);
+
+	pump_pieces (pieces, argc);
+	free (pieces);
+}
+
+void pipeline_set_pump_budget (pipeline *p, size_t size, int policy)
+{
+	assert (policy == PIPELINE_BUDGET_BLOCK ||
+		policy == PIPELINE_BUDGET_SPILL ||
+		policy == PIPELINE_BUDGET_DROP);
+	p->pump_budget = size;
+	p->pump_policy = policy;
+}
+
+size_t pipeline_get_pump_lag (pipeline *p)
+{
+	return p->pump_lag;
+}
+
 /* ---------------------------------------------------------------------- */
 
 /* Functions to read output from pipelines. */
 
+void pipeline_set_buffer_high_water (pipeline *p, size_t size)
+{
+	p->buffer_high_water = size;
+}
+
+/* The unread data in p's buffer starts at p->buffer + p->buflen -
+ * p->peek_offset and runs to p->buffer + p->buflen.  Data before that has
+ * been consumed, but may still be referenced by the pointer most recently
+ * returned to the caller, so it may only be discarded on the next call.
+ */
 static const char *get_block (pipeline *p, size_t *len, int peek)
 {
-	size_t readstart = 0, retstart = 0;
-	size_t space = p->bufmax;
+	size_t keep = 0;
 	size_t toread = *len;
 	ssize_t r;
 
@@ -2101,34 +5339,30 @@ static const char *get_block (pipeline *p, size_t *len, int peek)
 				p->peek_offset -= toread;
 			return buffer;
 		} else {
-			readstart = p->buflen;
-			retstart = p->buflen - p->peek_offset;
-			space -= p->buflen;
-			toread -= p->peek_offset;
+			keep = p->peek_offset;
+			toread -= keep;
 		}
 	}
 
-	if (toread > space) {
-		if (p->buffer)
-			p->bufmax = readstart + toread;
-		else
-			p->bufmax = toread;
-		p->buffer = xrealloc (p->buffer, p->bufmax + 1);
+	/* The output may have been handed over to a sink by pipeline_pump,
+	 * which also closes it once it has been read to the end.
+	 */
+	if (p->outfd == -1) {
+		errno = EBADF;
+		return NULL;
 	}
 
+	make_room (p, toread);
 	if (!peek)
 		p->peek_offset = 0;
 
-	assert (p->outfd != -1);
-	r = safe_read (p->outfd, p->buffer + readstart, toread);
+	r = safe_read (p->outfd, p->buffer + p->buflen, toread);
 	if (r == -1)
 		return NULL;
-	p->buflen = readstart + r;
-	if (peek)
-		p->peek_offset += r;
+	fill_block (p, r, peek);
 	*len -= (toread - r);
 
-	return p->buffer + retstart;
+	return p->buffer + p->buflen - r - keep;
 }
 
 const char *pipeline_read (pipeline *p, size_t *len)
@@ -2157,46 +5391,124 @@ void pipeline_peek_skip (pipeline *p, size_t len)
 	}
 }
 
-/* readline and peekline repeatedly peek larger and larger buffers until
- * they find a newline or they fail. readline then adjusts the peek offset.
+/* readline, peekline, and the record functions repeatedly peek larger and
+ * larger buffers until they find a delimiter (by default a newline) or
+ * they fail. readline then adjusts the peek offset.
+ *
+ * Each search resumes where the previous one stopped, and the amount
+ * peeked doubles whenever it is all available, so finding a record of
+ * length n costs O(n) no matter how the data arrives.  Only a peek that
+ * returns no new data indicates end-of-file; a short read from a pipe just
+ * means that the writer hasn't caught up yet.
  */
 
-static const char *get_line (pipeline *p, size_t *outlen)
+/* Return a pointer to the first occurrence of the delimiter delim, of
+ * length delimlen, in the n bytes at s, or NULL if there is none.  memchr
+ * is typically vectorised by the C library, so lean on it to skip to
+ * candidate positions.
+ */
+static const char *find_delim (const char *s, size_t n,
+			       const char *delim, size_t delimlen)
 {
-	const size_t block = 4096;
-	const char *buffer = NULL, *end = NULL;
-	int i;
+	const char *end = s + n;
 
-	if (p->line_cache) {
-		free (p->line_cache);
-		p->line_cache = NULL;
+	if (delimlen == 1)
+		return memchr (s, delim[0], n);
+
+	while ((size_t) (end - s) >= delimlen) {
+		s = memchr (s, delim[0], end - s - delimlen + 1);
+		if (!s)
+			return NULL;
+		if (!memcmp (s + 1, delim + 1, delimlen - 1))
+			return s;
+		++s;
 	}
+	return NULL;
+}
 
-	if (outlen)
-		*outlen = 0;
+/* Find the next record in p's output terminated by delim, and return a
+ * pointer to it in p's buffer, setting *outlen to its length including any
+ * delimiter.  The record is not NUL-terminated.
+ */
+static const char *find_record (pipeline *p, const char *delim,
+				size_t delimlen, size_t *outlen)
+{
+	size_t want = 4096, scanned = 0;
+	const char *buffer = NULL, *end = NULL;
+
+	assert (delimlen > 0);
+	*outlen = 0;
 
-	for (i = 0; ; ++i) {
-		size_t plen = block * (i + 1);
+	for (;;) {
+		size_t plen = want, from;
 
 		buffer = get_block (p, &plen, 1);
 		if (!buffer || plen == 0)
 			return NULL;
 
-		end = memchr (buffer + block * i, '\n', plen - block * i);
-		if (!end && plen < block * (i + 1))
-			/* end of file, no newline found */
+		/* A delimiter may straddle the end of what we scanned last
+		 * time.
+		 */
+		from = scanned >= delimlen - 1 ? scanned - (delimlen - 1) : 0;
+		end = find_delim (buffer + from, plen - from, delim, delimlen);
+		if (end) {
+			end += delimlen - 1;
+			break;
+		}
+		if (plen == scanned) {
+			/* end of file, no delimiter found */
 			end = buffer + plen - 1;
-		if (end)
 			break;
+		}
+		scanned = plen;
+		if (plen == want)
+			want *= 2;
 	}
 
-	if (end) {
-		p->line_cache = xstrndup (buffer, end - buffer + 1);
-		if (outlen)
-			*outlen = end - buffer + 1;
-		return p->line_cache;
-	} else
+	*outlen = end - buffer + 1;
+	return buffer;
+}
+
+static const char *find_line (pipeline *p, size_t *outlen)
+{
+	return find_record (p, "\n", 1, outlen);
+}
+
+static const char *get_line (pipeline *p, size_t *outlen)
+{
+	const char *buffer;
+	size_t len;
+
+	if (outlen)
+		*outlen = 0;
+
+	buffer = find_line (p, &len);
+	if (!buffer)
 		return NULL;
+
+	/* Copy the line into a cache that is reused from one line to the
+	 * next, growing it geometrically and shrinking it back after
+	 * unusually long lines, so that there is no allocation per line.
+	 */
+	if (len + 1 > p->line_cache_max ||
+	    (p->line_cache_max > p->buffer_high_water &&
+	     len + 1 <= p->buffer_high_water)) {
+		size_t newmax;
+
+		if (len + 1 > p->line_cache_max)
+			newmax = (p->line_cache_max * 2 > len + 1)
+				? p->line_cache_max * 2 : len + 1;
+		else
+			newmax = p->buffer_high_water;
+		free (p->line_cache);
+		p->line_cache = xmalloc (newmax);
+		p->line_cache_max = newmax;
+	}
+	memcpy (p->line_cache, buffer, len);
+	p->line_cache[len] = '\0';
+	if (outlen)
+		*outlen = len;
+	return p->line_cache;
 }
 
 const char *pipeline_readline (pipeline *p)
@@ -2212,3 +5524,31 @@ const char *pipeline_peekline (pipeline *p)
 {
 	return get_line (p, NULL);
 }
+
+const char *pipeline_readline_view (pipeline *p, size_t *len)
+{
+	const char *buffer = find_line (p, len);
+	if (buffer)
+		p->peek_offset -= *len;
+	return buffer;
+}
+
+const char *pipeline_peekline_view (pipeline *p, size_t *len)
+{
+	return find_line (p, len);
+}
+
+const char *pipeline_readrecord (pipeline *p, const char *delim,
+				 size_t delimlen, size_t *len)
+{
+	const char *buffer = find_record (p, delim, delimlen, len);
+	if (buffer)
+		p->peek_offset -= *len;
+	return buffer;
+}
+
+const char *pipeline_peekrecord (pipeline *p, const char *delim,
+				 size_t delimlen, size_t *len)
+{
+	return find_record (p, delim, delimlen, len);
+}
@@ -32,6 +32,8 @@ extern "C" {
 #include <stdio.h>
 #include <stdarg.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 /* GCC version checking borrowed from glibc. */
 #if defined(__GNUC__) && defined(__GNUC_MINOR__)
@@ -80,10 +82,13 @@ extern "C" {
 
 typedef void pipecmd_function_type (void *);
 typedef void pipecmd_function_free_type (void *);
+typedef int pipecmd_fd_function_type (int, int, void *);
 
 struct pipecmd;
 typedef struct pipecmd pipecmd;
 
+typedef void pipecmd_exit_callback_type (pipecmd *, int, void *);
+
 struct pipeline;
 typedef struct pipeline pipeline;
 
@@ -120,6 +125,17 @@ pipecmd *pipecmd_new_function (const char *name,
 			       pipecmd_function_free_type *free_func,
 			       void *data);
 
+/* Like pipecmd_new_function, but the function is passed the file
+ * descriptors for its input and output followed by data, and should use
+ * those rather than standard input and output.  Its return value is used
+ * as the command's exit status.  Such a command may be run in a thread
+ * rather than a child process; see pipecmd_thread().
+ */
+pipecmd *pipecmd_new_fd_function (const char *name,
+				  pipecmd_fd_function_type *func,
+				  pipecmd_function_free_type *free_func,
+				  void *data);
+
 /* Construct a new command that runs a sequence of commands. The commands
  * will be executed in forked children; if any exits non-zero then it will
  * terminate the sequence, as with "&&" in shell.
@@ -174,6 +190,32 @@ void pipecmd_nice (pipecmd *cmd, int nice);
  */
 void pipecmd_discard_err (pipecmd *cmd, int discard_err);
 
+/* Set the capacity in bytes of the pipe carrying this command's output, if
+ * pipeline_start() creates one.  Defaults to 0, meaning that the pipeline's
+ * setting applies; see pipeline_set_pipe_size().
+ */
+void pipecmd_set_pipe_size (pipecmd *cmd, int size);
+
+/* Execute the file named by path, which should be absolute, rather than
+ * searching PATH for the command's name.  If path is NULL, search PATH as
+ * usual; the result of the search is remembered for as long as the file
+ * found is unchanged, for all commands with the same name and PATH.  This
+ * only has an effect on commands constructed using pipecmd_new and
+ * friends.
+ */
+void pipecmd_pin_path (pipecmd *cmd, const char *path);
+
+/* If thread is non-zero, run this command in a thread of the calling
+ * process rather than in a forked child, avoiding the cost of forking.
+ * This only has an effect on commands constructed using
+ * pipecmd_new_fd_function(), and only if they do not change their nice
+ * value, standard error, or environment, all of which are shared by the
+ * whole process; otherwise, and by default, the command is forked as
+ * usual.  A command running in a thread has no process ID, must not call
+ * exit, and should only touch its own file descriptors.
+ */
+void pipecmd_thread (pipecmd *cmd, int thread);
+
 /* Set an environment variable while running this command. */
 void pipecmd_setenv (pipecmd *cmd, const char *name, const char *value);
 
@@ -189,6 +231,13 @@ void pipecmd_unsetenv (pipecmd *cmd, const char *name);
  */
 void pipecmd_clearenv (pipecmd *cmd);
 
+/* Call func with this command, its wait status, and data as soon as
+ * pipeline_wait_all() or pipeline_try_wait_all() collects the status,
+ * rather than only once the whole pipeline has finished.
+ */
+void pipecmd_exit_callback (pipecmd *cmd, pipecmd_exit_callback_type *func,
+			    void *data);
+
 /* Add a command to a sequence. */
 void pipecmd_sequence_command (pipecmd *cmd, pipecmd *child);
 
@@ -243,10 +292,50 @@ pipeline *pipeline_join (pipeline *p1, pipeline *p2);
  * data flowing from the source to the sinks. It is primarily useful when
  * more than one sink pipeline is involved, in which case the pipelines
  * cannot simply be concatenated into one.
+ *
+ * A sink with no commands passes data straight through to its output;
+ * unless that output is a pipe for the caller to read, pipeline_pump()
+ * writes directly to it without starting any process.
+ *
+ * If a source has only one sink and pipeline_pump() starts the second of
+ * the two, it connects the source's last command directly to the sink's
+ * first (or to the destination of a sink with no commands), leaving
+ * nothing for pipeline_pump() to do.  Data left in the source's peek cache
+ * at that point prevents the direct connection; once it is made, reading
+ * from the source fails with EBADF.  Pipelines that the program starts
+ * itself are never connected directly, so starting both before calling
+ * pipeline_pump() keeps the data available for interception.
  */
 void pipeline_connect (pipeline *source, pipeline *sink, ...)
 	PIPELINE_ATTR_SENTINEL;
 
+/* Connect the output of one or more source pipelines to the input of a
+ * sink pipeline, which must not be started, such that pipeline_pump()
+ * interleaves their output.  Each source is subject to the same conditions
+ * as for pipeline_connect(), and may not have any other sinks.  May be
+ * called more than once to add further sources.  Terminate arguments with
+ * NULL.
+ *
+ * pipeline_pump() gives the sources turns at writing to the sink, passing
+ * over those with nothing to say, so that a busy source cannot starve the
+ * others.  By default each turn is a chunk of whatever the source has
+ * produced, which may break off in the middle of a line; see
+ * pipeline_set_merge_delimiter() to interleave whole lines or records
+ * instead.
+ */
+void pipeline_merge (pipeline *sink, pipeline *source, ...)
+	PIPELINE_ATTR_SENTINEL;
+
+/* Make pipeline_pump() switch between the sources merged into the sink
+ * pipeline only after a record terminated by delim, of length delimlen:
+ * for example, "\n" and 1 keep lines whole.  A record is passed on without
+ * a delimiter only once its source has ended, or if it fills the source's
+ * pump budget.  If delim is NULL, go back to interleaving arbitrary
+ * chunks.
+ */
+void pipeline_set_merge_delimiter (pipeline *sink, const char *delim,
+				   size_t delimlen);
+
 /* Add a command to a pipeline. */
 void pipeline_command (pipeline *p, pipecmd *cmd);
 
@@ -283,10 +372,24 @@ pipecmd *pipeline_set_command (pipeline *p, int n, pipecmd *cmd);
 
 /* Return the process ID of command number n from this pipeline, counting
  * from zero.  The pipeline must be started.  Return -1 if n is out of range
- * or if the command has already exited and been reaped.
+ * or if the command has already exited and been reaped, or 0 if the
+ * command is running in a thread.
  */
 pid_t pipeline_get_pid (pipeline *p, int n);
 
+/* Set *usage to the resources used by command number n of a started
+ * pipeline, counting from zero, as reported by wait4(), and *elapsed to the
+ * wall-clock time from starting the command until its exit status was
+ * collected; either pointer may be NULL.  Return 0 on success, or -1 if n
+ * is out of range or the command's exit status has not yet been collected.
+ * This remains available once pipeline_wait_all() has returned, until the
+ * pipeline is started again or freed.  Commands running in threads report
+ * the resources used by their thread where the system can measure them;
+ * resources that cannot be measured are reported as zero.
+ */
+int pipeline_get_rusage (pipeline *p, int n, struct rusage *usage,
+			 struct timeval *elapsed);
+
 /* Set file descriptors to use as the input and output of the whole
  * pipeline.  If non-negative, fd is used directly as a file descriptor.  If
  * negative, pipeline_start will create pipes and store the input writing
@@ -324,6 +427,31 @@ void pipeline_want_outfile (pipeline *p, const char *file);
  */
 void pipeline_ignore_signals (pipeline *p, int ignore_signals);
 
+/* If close_fds is non-zero, close all file descriptors other than standard
+ * input, output, and error in the pipeline's child processes, including any
+ * that the calling program has not marked close-on-exec.  Otherwise, and by
+ * default, children inherit such descriptors, although those that
+ * libpipeline creates itself are always closed.
+ */
+void pipeline_close_fds (pipeline *p, int close_fds);
+
+/* Set the capacity in bytes of the pipes that pipeline_start() creates,
+ * including those for pipeline_want_in(p, -1) and pipeline_want_out(p,
+ * -1), unless overridden for an individual command's output by
+ * pipecmd_set_pipe_size().  Defaults to 0, meaning the system default.
+ * Requests are limited to the largest size that the system allows, and
+ * may be rounded up; they are ignored where pipe sizes cannot be changed.
+ */
+void pipeline_set_pipe_size (pipeline *p, int size);
+
+/* Return the capacity in bytes of pipe number n of a started pipeline,
+ * where pipe n carries the input of command n, so pipe 0 carries the input
+ * of the whole pipeline and pipe number pipeline_get_ncommands(p) its
+ * output.  Return 0 if pipeline_start() created no such pipe or its
+ * capacity is unknown, or -1 if n is out of range.
+ */
+int pipeline_get_pipe_size (pipeline *p, int n);
+
 /* Get streams corresponding to infd and outfd respectively. The pipeline
  * must be started.
  */
@@ -354,8 +482,28 @@ typedef void pipeline_post_fork_fn (void);
  */
 void pipeline_install_post_fork (pipeline_post_fork_fn *fn);
 
-/* Start the processes in a pipeline. Installs this library's SIGCHLD
- * handler if not already installed. Calls error(FATAL) on error. */
+/* Start a spawn server: a helper process, forked from the caller, that
+ * starts processes on the caller's behalf and reports their exit statuses
+ * back.  Subsequent pipelines use it for commands that would otherwise
+ * need a forked child of the caller, such as those with a non-zero nice
+ * value, so that starting them does not involve copying the caller's
+ * address space.  Call this early, while the caller is still small.
+ * Commands started this way inherit only standard input, output, and
+ * error, as if pipeline_close_fds() had been used, and are not children of
+ * the caller.  Functions and sequences, and all commands while a post-fork
+ * handler is installed, are still forked by the caller.  Returns 0 on
+ * success, or -1 on failure with errno set.
+ */
+int pipeline_start_spawn_server (void);
+
+/* Stop the spawn server, if any.  Any pipelines that it started must
+ * already have been waited for.
+ */
+void pipeline_stop_spawn_server (void);
+
+/* Start the processes in a pipeline. Unless child processes can be tracked
+ * using process file descriptors, installs this library's SIGCHLD handler
+ * if not already installed. Calls error(FATAL) on error. */
 void pipeline_start (pipeline *p);
 
 /* Wait for a pipeline to complete.  Set *statuses to a newly-allocated
@@ -371,6 +519,22 @@ void pipeline_start (pipeline *p);
  */
 int pipeline_wait_all (pipeline *p, int **statuses, int *n_statuses);
 
+/* Return a file descriptor that becomes readable when a command in a
+ * started pipeline may have exited, for use in an event loop, which should
+ * then call pipeline_try_wait_all().  The descriptor belongs to the
+ * pipeline, and is closed once the pipeline has been waited for.  Returns
+ * -1 and sets errno if this is not supported on this system.
+ */
+int pipeline_get_wait_fd (pipeline *p);
+
+/* Like pipeline_wait_all(), but never blocks.  Collect the statuses of
+ * whichever commands have exited, and return -1 if any are still running,
+ * leaving the pipeline to be waited for again later.  Otherwise, finish
+ * and return exactly as pipeline_wait_all() does.  Like
+ * pipeline_wait_all(), this closes the pipeline's input and output.
+ */
+int pipeline_try_wait_all (pipeline *p, int **statuses, int *n_statuses);
+
 /* Wait for a pipeline to complete and return its combined exit status,
  * calculated as for pipeline_wait_all().
  */
@@ -380,15 +544,137 @@ int pipeline_wait (pipeline *p);
 int pipeline_run (pipeline *p);
 
 /* Pump data among one or more pipelines connected using pipeline_connect()
- * until all source pipelines have reached end-of-file and all data has been
- * written to all sinks (or failed). All relevant pipelines must be
- * supplied: that is, no pipeline that has been connected to a source
- * pipeline may be supplied unless that source pipeline is also supplied.
- * Automatically starts all pipelines if they are not already started, but
- * does not wait for them. Terminate arguments with NULL.
+ * or pipeline_merge() until all source pipelines have reached end-of-file
+ * and all data has been written to all sinks (or failed). All relevant
+ * pipelines must be supplied: that is, no pipeline that has been connected
+ * to a source pipeline may be supplied unless that source pipeline is also
+ * supplied.
+ * Automatically starts all pipelines if they are not already started, in
+ * the order given, except that a source's only sink is started before the
+ * source so that the two can be connected directly (see
+ * pipeline_connect()); but does not wait for them. Terminate arguments
+ * with NULL.
  */
 void pipeline_pump (pipeline *p, ...) PIPELINE_ATTR_SENTINEL;
 
+/* What pipeline_pump() does when the output of a source that some sink has
+ * yet to receive reaches its budget; see pipeline_set_pump_budget().
+ */
+#define PIPELINE_BUDGET_BLOCK	0	/* stop reading from the source */
+#define PIPELINE_BUDGET_SPILL	1	/* hold the rest in a temporary file */
+#define PIPELINE_BUDGET_DROP	2	/* disconnect the slowest sinks */
+
+/* Limit the amount of output from the source pipeline p that
+ * pipeline_pump() holds in memory for sinks that have yet to receive it to
+ * size bytes, or lift the limit if size is 0 (the default).  policy says
+ * what to do when a slow sink holds the others back for long enough to
+ * reach the limit: PIPELINE_BUDGET_BLOCK stops reading from p until that
+ * sink catches up; PIPELINE_BUDGET_SPILL carries on reading, and keeps
+ * whatever does not fit in a temporary file; and PIPELINE_BUDGET_DROP
+ * closes the input of whichever sinks are furthest behind, as if they had
+ * exited, until the rest fit.  The limit may be exceeded by up to one
+ * read.
+ */
+void pipeline_set_pump_budget (pipeline *p, size_t size, int policy);
+
+/* Return the number of bytes that pipeline_pump() has read from the source
+ * of the sink pipeline p but not yet written to p.  This may be called
+ * from an exit callback run by pipeline_pump(), or once it has returned,
+ * in which case a non-zero value means that p did not receive all of its
+ * input: it was dropped, it exited early, or writing to it failed.
+ */
+size_t pipeline_get_pump_lag (pipeline *p);
+
+/* ---------------------------------------------------------------------- */
+
+/* Functions to run batches of pipelines. */
+
+typedef struct pipeline_batch pipeline_batch;
+
+typedef void pipeline_batch_callback_type (pipeline *, int, void *);
+
+/* Construct a new batch, which runs at most max_running pipelines at a
+ * time, or as many as there are online CPUs if max_running is 0.
+ */
+pipeline_batch *pipeline_batch_new (int max_running);
+
+/* Queue a pipeline to be run by a batch, which takes ownership of it.
+ * Once the pipeline has finished, call func (if not NULL) with it, its
+ * exit status as returned by pipeline_wait(), and data, and then free it.
+ * Nothing reads the pipeline's output or writes to its input, so these
+ * should be redirected or left as standard input and output.  This may be
+ * called from func to queue more pipelines.
+ */
+void pipeline_batch_add (pipeline_batch *b, pipeline *p,
+			 pipeline_batch_callback_type *func, void *data);
+
+/* Return the number of pipelines that a batch runs at a time. */
+int pipeline_batch_get_max_running (pipeline_batch *b);
+
+/* Run all the pipelines queued in a batch, starting each as soon as there
+ * is room for it, and return once they have all finished.  Returns the
+ * number of pipelines that exited non-zero.
+ */
+int pipeline_batch_run (pipeline_batch *b);
+
+/* Destroy a batch, freeing any pipelines that it has not yet run. */
+void pipeline_batch_free (pipeline_batch *b);
+
+/* ---------------------------------------------------------------------- */
+
+/* Functions to run graphs of pipelines. */
+
+typedef struct pipeline_graph pipeline_graph;
+
+/* Construct a new, empty graph, whose vertices are pipelines and whose
+ * edges carry the output of one vertex to the input of another.
+ */
+pipeline_graph *pipeline_graph_new (void);
+
+/* Add one or more pipelines to a graph as vertices.  The graph takes
+ * ownership of them.  They must not be started, and must not be connected
+ * using pipeline_connect() or pipeline_merge(); the graph makes all the
+ * connections itself.  Terminate arguments with NULL.
+ */
+void pipeline_graph_add (pipeline_graph *g, pipeline *p, ...)
+	PIPELINE_ATTR_SENTINEL;
+
+/* Add a built-in vertex to a graph, and return it.  A tee copies its input
+ * to each of its outputs; a merge interleaves its inputs, keeping records
+ * terminated by delim of length delimlen whole if delim is non-NULL, as
+ * for pipeline_set_merge_delimiter().  Either sends its output to standard
+ * output, or wherever pipeline_want_out() says, if it has no edges out of
+ * it.  These vertices run no commands, and where possible are connected
+ * away altogether when the graph is run.
+ */
+pipeline *pipeline_graph_add_tee (pipeline_graph *g);
+pipeline *pipeline_graph_add_merge (pipeline_graph *g, const char *delim,
+				    size_t delimlen);
+
+/* Add an edge to a graph carrying the output of the vertex from to the
+ * input of the vertex to.  A vertex with more than one edge into it merges
+ * them as pipeline_merge() does; one with more than one edge out of it
+ * sends a copy of its output along each.  The graph must not contain any
+ * cycles.
+ */
+void pipeline_graph_connect (pipeline_graph *g, pipeline *from,
+			     pipeline *to);
+
+/* Connect and start every vertex of a graph, pump data along all of its
+ * edges in a single pipeline_pump() loop, and wait for each vertex in turn
+ * once everything feeding it has finished.  Returns the number of vertices
+ * that exited non-zero.  A graph can only be run once.
+ */
+int pipeline_graph_run (pipeline_graph *g);
+
+/* Return the exit status of a vertex of a graph, as returned by
+ * pipeline_wait(), or -1 if the graph has not been run.
+ */
+int pipeline_graph_get_status (pipeline_graph *g, pipeline *p);
+
+/* Destroy a graph and all of its vertices. */
+void pipeline_graph_free (pipeline_graph *g);
+
 /* ---------------------------------------------------------------------- */
 
 /* Functions to read output from pipelines. */
@@ -424,6 +710,73 @@ const char *pipeline_readline (pipeline *p);
  */
 const char *pipeline_peekline (pipeline *p);
 
+/* Read a line of data from the pipeline, returning a pointer to it in the
+ * pipeline's buffer and setting len to its length, including any
+ * terminating newline.  The line is not NUL-terminated, and is only valid
+ * until the next call to read from the pipeline.  Unlike
+ * pipeline_readline, this never allocates memory for the line.  Returns
+ * NULL at end of file.
+ */
+const char *pipeline_readline_view (pipeline *p, size_t *len);
+
+/* Look ahead in the pipeline's output for a line of data, returning it in
+ * the same way as pipeline_readline_view.  The starting position of the
+ * next read or peek is not affected by this call.
+ */
+const char *pipeline_peekline_view (pipeline *p, size_t *len);
+
+/* Read a record of data from the pipeline, terminated by the delimiter
+ * delim of length delimlen bytes, which may contain any bytes including
+ * NUL.  The record is returned in the same way as by
+ * pipeline_readline_view, with len set to its length including the
+ * delimiter; the last record in the output may lack a delimiter.  Returns
+ * NULL at end of file.
+ */
+const char *pipeline_readrecord (pipeline *p, const char *delim,
+				 size_t delimlen, size_t *len);
+
+/* Look ahead in the pipeline's output for a record of data, returning it in
+ * the same way as pipeline_readrecord.  The starting position of the next
+ * read or peek is not affected by this call.
+ */
+const char *pipeline_peekrecord (pipeline *p, const char *delim,
+				 size_t delimlen, size_t *len);
+
+/* Set the size in bytes to which the pipeline's read buffer shrinks back
+ * once it no longer holds that much unread data.  The buffer grows beyond
+ * this as necessary to satisfy large reads, peeks, or lines.  Defaults to
+ * 64 KiB.
+ */
+void pipeline_set_buffer_high_water (pipeline *p, size_t size);
+
+/* ---------------------------------------------------------------------- */
+
+/* Functions to trace pipelines. */
+
+/* Start recording timestamped events in the life of each pipeline started
+ * from now on and of its commands: pipe creation, fork, spawn, exec, first
+ * byte and end of output, exit, and reap, along with the number of bytes
+ * moved by pipeline_pump.  Events are kept in a ring of size entries (or
+ * 65536 if size is 0), the oldest being overwritten when it fills up.  This
+ * discards any events previously recorded, and should not be called while
+ * other threads are using pipelines.  Returns 0 on success, or -1 on
+ * failure with errno set.
+ *
+ * If the PIPELINE_TRACE environment variable names a file when the first
+ * pipeline is started, tracing starts then, and the events are written to
+ * that file when the process exits.
+ */
+int pipeline_trace_start (size_t size);
+
+/* Stop recording events.  Those already recorded are kept. */
+void pipeline_trace_stop (void);
+
+/* Write the recorded events to stream in the Chrome trace event JSON
+ * format, in which each pipeline appears as a process and each of its
+ * commands as a thread.  Returns 0 on success, or -1 on error.
+ */
+int pipeline_trace_dump (FILE *stream);
+
 #ifdef __cplusplus
 }
 #endif
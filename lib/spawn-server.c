@@ -0,0 +1,688 @@
+/*
+ * spawn-server.c: start commands from a small helper process
+ * Copyright (C) 2026 Colin Watson.
+ *
+ * This file is part of libpipeline.
+ *
+ * libpipeline is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * libpipeline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libpipeline; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301
+ * USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#ifdef USE_POSIX_THREADS
+#  include <pthread.h>
+#endif
+
+#include "safe-read.h"
+#include "xalloc.h"
+
+#include "pipeline-private.h"
+#include "error.h"
+
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+
+/* The spawn server is a child of the calling process, forked while that
+ * process is still small, that forks and execs commands on its behalf so
+ * that the cost of forking doesn't grow with the caller's size.
+ *
+ * Each request consists of a spawn_header, carrying the command's standard
+ * input, output, and error as SCM_RIGHTS ancillary data, followed by len
+ * bytes of NUL-terminated strings: the file to execute, then argc
+ * arguments, then envc environment entries.  The server answers each
+ * request with a SPAWN_STARTED reply, and later sends a SPAWN_EXITED reply
+ * when the command exits.
+ */
+
+struct spawn_header {
+	int nice;
+	int flags;
+	int argc;
+	int envc;
+	size_t len;
+};
+
+#define SPAWN_STARTED	1	/* value is 0, or errno if pid is -1 */
+#define SPAWN_EXITED	2	/* value is a wait status */
+
+struct spawn_reply {
+	int type;
+	pid_t pid;
+	int value;
+	struct rusage usage;	/* SPAWN_EXITED only */
+};
+
+union spawn_control {
+	struct cmsghdr cmsg;
+	char buf[CMSG_SPACE (3 * sizeof (int))];
+};
+
+static pid_t server_pid = -1;
+static int server_sock = -1;
+
+/* Exit statuses that arrived while waiting for a SPAWN_STARTED reply. */
+static struct spawn_reply *pending = NULL;
+static int n_pending = 0, max_pending = 0;
+
+#ifdef USE_POSIX_THREADS
+/* Protects all of the above, and keeps each request together with its
+ * reply.
+ */
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void lock_server (void)
+{
+#ifdef USE_POSIX_THREADS
+	pthread_mutex_lock (&server_lock);
+#endif
+}
+
+static void unlock_server (void)
+{
+#ifdef USE_POSIX_THREADS
+	pthread_mutex_unlock (&server_lock);
+#endif
+}
+
+/* Read exactly count bytes from fd.  Returns 0 on success, or -1 on error
+ * or end of file.
+ */
+static int read_all (int fd, void *buf, size_t count)
+{
+	char *p = buf;
+
+	while (count) {
+		size_t n = safe_read (fd, p, count);
+
+		if (n == SAFE_READ_ERROR || n == 0)
+			return -1;
+		p += n;
+		count -= n;
+	}
+	return 0;
+}
+
+/* Write exactly count bytes to fd, without raising SIGPIPE if the other
+ * end has gone away.  Returns 0 on success or -1 on error.
+ */
+static int send_all (int fd, const void *buf, size_t count)
+{
+	const char *p = buf;
+
+	while (count) {
+		ssize_t n = send (fd, p, count, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		count -= n;
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/* The server itself. */
+
+static int child_pipe[2] = { -1, -1 };
+
+static void server_sigchld (int signum PIPELINE_ATTR_UNUSED)
+{
+	int save_errno = errno;
+	ssize_t ret;
+
+	/* If the pipe is full, the server will wake up anyway. */
+	ret = write (child_pipe[1], "", 1);
+	(void) ret;
+	errno = save_errno;
+}
+
+/* Start the command described by hdr and strings in this forked child of
+ * the server, with its standard descriptors in fds.
+ */
+static void server_child (const struct spawn_header *hdr, const int *fds,
+			  char *strings) PIPELINE_ATTR_NORETURN;
+
+static void server_child (const struct spawn_header *hdr, const int *fds,
+			  char *strings)
+{
+	char *file = strings, *s;
+	char **argv, **envp;
+	struct sigaction sa;
+	sigset_t set;
+	int i;
+
+	argv = xnmalloc (hdr->argc + 1, sizeof *argv);
+	envp = xnmalloc (hdr->envc + 1, sizeof *envp);
+	s = file + strlen (file) + 1;
+	for (i = 0; i < hdr->argc; ++i) {
+		argv[i] = s;
+		s += strlen (s) + 1;
+	}
+	argv[hdr->argc] = NULL;
+	for (i = 0; i < hdr->envc; ++i) {
+		envp[i] = s;
+		s += strlen (s) + 1;
+	}
+	envp[hdr->envc] = NULL;
+
+	/* Give the command the signal dispositions that it would have had
+	 * if the caller had started it itself.
+	 */
+	memset (&sa, 0, sizeof sa);
+	sigemptyset (&sa.sa_mask);
+	sa.sa_handler = SIG_DFL;
+	sigaction (SIGCHLD, &sa, NULL);
+	sigaction (SIGPIPE, &sa, NULL);
+	sa.sa_handler = (hdr->flags & SPAWN_IGNORE_SIGINT) ? SIG_IGN : SIG_DFL;
+	sigaction (SIGINT, &sa, NULL);
+	sa.sa_handler = (hdr->flags & SPAWN_IGNORE_SIGQUIT) ? SIG_IGN
+							     : SIG_DFL;
+	sigaction (SIGQUIT, &sa, NULL);
+	sigemptyset (&set);
+	sigprocmask (SIG_SETMASK, &set, NULL);
+
+	/* The server's own standard descriptors are open, so received
+	 * descriptors are all above 2.
+	 */
+	for (i = 0; i < 3; ++i)
+		if (dup2 (fds[i], i) < 0) {
+			error (0, errno, "dup2 failed");
+			_exit (FATAL);
+		}
+	for (i = 0; i < 3; ++i)
+		close (fds[i]);
+
+	if (hdr->flags & SPAWN_DISCARD_ERR) {
+		int devnull = open ("/dev/null", O_WRONLY);
+		if (devnull != -1) {
+			dup2 (devnull, 2);
+			close (devnull);
+		}
+	}
+
+	if (hdr->nice)
+		if (nice (hdr->nice) < 0)
+			/* Don't worry too much. */
+			debug ("nice failed: %s\n", strerror (errno));
+
+	environ = envp;
+	execvp (file, argv);
+	error (0, errno, "can't execute %s", file);
+	_exit (EXEC_FAILED_EXIT_STATUS);
+}
+
+/* Receive a request on sock and start its command.  Returns 0 on success,
+ * or -1 if the caller has gone away.
+ */
+static int server_request (int sock)
+{
+	struct spawn_header hdr;
+	struct spawn_reply reply;
+	union spawn_control control;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	int fds[3] = { -1, -1, -1 };
+	char *strings;
+	ssize_t n;
+	int i;
+
+	iov.iov_base = &hdr;
+	iov.iov_len = sizeof hdr;
+	memset (&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof control.buf;
+	do
+		n = recvmsg (sock, &msg, 0);
+	while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR (&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS &&
+	    cmsg->cmsg_len == CMSG_LEN (sizeof fds))
+		memcpy (fds, CMSG_DATA (cmsg), sizeof fds);
+	for (i = 0; i < 3; ++i)
+		if (fds[i] != -1)
+			set_cloexec (fds[i]);
+
+	if ((size_t) n < sizeof hdr &&
+	    read_all (sock, (char *) &hdr + n, sizeof hdr - n) < 0)
+		return -1;
+	strings = xmalloc (hdr.len);
+	if (read_all (sock, strings, hdr.len) < 0)
+		return -1;
+
+	memset (&reply, 0, sizeof reply);
+	reply.type = SPAWN_STARTED;
+	if (fds[0] == -1 || fds[1] == -1 || fds[2] == -1) {
+		reply.pid = -1;
+		reply.value = EBADF;
+	} else {
+		reply.pid = fork ();
+		if (reply.pid < 0)
+			reply.value = errno;
+		else if (reply.pid == 0)
+			server_child (&hdr, fds, strings);
+	}
+
+	for (i = 0; i < 3; ++i)
+		if (fds[i] != -1)
+			close (fds[i]);
+	free (strings);
+
+	/* Send this before noticing that the command has exited, so that
+	 * the caller always learns its process ID first.
+	 */
+	return send_all (sock, &reply, sizeof reply);
+}
+
+static void server_main (int sock) PIPELINE_ATTR_NORETURN;
+
+static void server_main (int sock)
+{
+	struct sigaction sa;
+	sigset_t set;
+	int devnull;
+
+	/* Keep nothing but the socket and standard error; each command
+	 * brings its own descriptors.
+	 */
+	if (sock != 3) {
+		if (dup2 (sock, 3) < 0) {
+			error (0, errno, "dup2 failed");
+			_exit (FATAL);
+		}
+		close (sock);
+		sock = 3;
+	}
+	close_fds_from (4);
+	set_cloexec (sock);
+	devnull = open ("/dev/null", O_RDWR);
+	if (devnull != -1) {
+		dup2 (devnull, 0);
+		dup2 (devnull, 1);
+		if (devnull > 2)
+			close (devnull);
+	}
+
+	if (pipe (child_pipe) < 0) {
+		error (0, errno, "pipe failed");
+		_exit (FATAL);
+	}
+	set_cloexec (child_pipe[0]);
+	set_cloexec (child_pipe[1]);
+	fcntl (child_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl (child_pipe[1], F_SETFL, O_NONBLOCK);
+
+	/* Signals from the terminal are for the caller to deal with. */
+	memset (&sa, 0, sizeof sa);
+	sigemptyset (&sa.sa_mask);
+	sa.sa_handler = SIG_IGN;
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGQUIT, &sa, NULL);
+	sigaction (SIGPIPE, &sa, NULL);
+	sa.sa_handler = &server_sigchld;
+	sa.sa_flags = SA_NOCLDSTOP;
+	sigaction (SIGCHLD, &sa, NULL);
+	sigemptyset (&set);
+	sigprocmask (SIG_SETMASK, &set, NULL);
+
+	for (;;) {
+		struct spawn_reply reply;
+		fd_set rfds;
+		char buf[64];
+		int ret;
+
+		FD_ZERO (&rfds);
+		FD_SET (sock, &rfds);
+		FD_SET (child_pipe[0], &rfds);
+		ret = select ((sock > child_pipe[0] ? sock : child_pipe[0]) + 1,
+			      &rfds, NULL, NULL, NULL);
+		if (ret < 0 && errno != EINTR) {
+			error (0, errno, "select");
+			_exit (FATAL);
+		}
+
+		while (read (child_pipe[0], buf, sizeof buf) > 0)
+			;
+		memset (&reply, 0, sizeof reply);
+		reply.type = SPAWN_EXITED;
+		while ((reply.pid = wait_usage (-1, &reply.value, WNOHANG,
+						&reply.usage)) > 0)
+			if (send_all (sock, &reply, sizeof reply) < 0)
+				_exit (OK);
+
+		if (ret > 0 && FD_ISSET (sock, &rfds) &&
+		    server_request (sock) < 0)
+			break;
+	}
+
+	/* Commands still running carry on without us. */
+	_exit (OK);
+}
+
+/* ---------------------------------------------------------------------- */
+
+/* The caller's side. */
+
+int pipeline_start_spawn_server (void)
+{
+	int sv[2];
+	pid_t pid;
+#ifdef SO_NOSIGPIPE
+	int one = 1;
+#endif
+
+	lock_server ();
+	if (server_sock != -1) {
+		unlock_server ();
+		return 0;
+	}
+
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		unlock_server ();
+		return -1;
+	}
+	set_cloexec (sv[0]);
+	set_cloexec (sv[1]);
+#ifdef SO_NOSIGPIPE
+	setsockopt (sv[0], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof one);
+	setsockopt (sv[1], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof one);
+#endif
+
+	/* Don't let the server inherit pending output. */
+	fflush (NULL);
+
+	pid = fork ();
+	if (pid < 0) {
+		int save_errno = errno;
+		close (sv[0]);
+		close (sv[1]);
+		unlock_server ();
+		errno = save_errno;
+		return -1;
+	}
+	if (pid == 0) {
+		close (sv[0]);
+		server_main (sv[1]);
+	}
+
+	close (sv[1]);
+	server_sock = sv[0];
+	server_pid = pid;
+	unlock_server ();
+	debug ("Started spawn server, pid %d\n", (int) pid);
+	return 0;
+}
+
+void pipeline_stop_spawn_server (void)
+{
+	lock_server ();
+	if (server_sock == -1) {
+		unlock_server ();
+		return;
+	}
+
+	/* The server exits once it sees end of file. */
+	close (server_sock);
+	server_sock = -1;
+	while (waitpid (server_pid, NULL, 0) < 0 && errno == EINTR)
+		;
+	server_pid = -1;
+
+	free (pending);
+	pending = NULL;
+	n_pending = max_pending = 0;
+	unlock_server ();
+}
+
+int spawn_server_running (void)
+{
+	int ret;
+
+	lock_server ();
+	ret = (server_sock != -1);
+	unlock_server ();
+	return ret;
+}
+
+/* Return the descriptor that becomes readable when the server has
+ * something to report, or -1 if it is not running.
+ */
+int spawn_server_fd (void)
+{
+	int fd;
+
+	lock_server ();
+	fd = server_sock;
+	unlock_server ();
+	return fd;
+}
+
+/* The server has died or misbehaved; forget about it.  The statuses of
+ * any commands it was running are lost.
+ */
+static void spawn_server_lost (void)
+{
+	error (0, 0, "spawn server died");
+	close (server_sock);
+	server_sock = -1;
+	kill (server_pid, SIGKILL);
+	while (waitpid (server_pid, NULL, 0) < 0 && errno == EINTR)
+		;
+	server_pid = -1;
+}
+
+static char *append_string (char *s, const char *str)
+{
+	size_t len = strlen (str) + 1;
+
+	memcpy (s, str, len);
+	return s + len;
+}
+
+/* Ask the server to start the command described by req.  Returns its
+ * process ID, or -1 if the caller should start it some other way.  The
+ * caller must hold server_lock.
+ */
+static pid_t server_spawn (const struct spawn_request *req)
+{
+	struct spawn_header hdr;
+	struct spawn_reply reply;
+	union spawn_control control;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char *strings, *s;
+	ssize_t n;
+	int i;
+
+	if (server_sock == -1)
+		return -1;
+
+	memset (&hdr, 0, sizeof hdr);
+	hdr.nice = req->nice;
+	hdr.flags = req->flags;
+	hdr.len = strlen (req->file) + 1;
+	for (hdr.argc = 0; req->argv[hdr.argc]; ++hdr.argc)
+		hdr.len += strlen (req->argv[hdr.argc]) + 1;
+	for (hdr.envc = 0; req->envp[hdr.envc]; ++hdr.envc)
+		hdr.len += strlen (req->envp[hdr.envc]) + 1;
+
+	strings = xmalloc (hdr.len);
+	s = append_string (strings, req->file);
+	for (i = 0; i < hdr.argc; ++i)
+		s = append_string (s, req->argv[i]);
+	for (i = 0; i < hdr.envc; ++i)
+		s = append_string (s, req->envp[i]);
+
+	iov.iov_base = &hdr;
+	iov.iov_len = sizeof hdr;
+	memset (&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	memset (&control, 0, sizeof control);
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof control.buf;
+	cmsg = CMSG_FIRSTHDR (&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN (sizeof req->fds);
+	memcpy (CMSG_DATA (cmsg), req->fds, sizeof req->fds);
+
+	do
+		n = sendmsg (server_sock, &msg, MSG_NOSIGNAL);
+	while (n < 0 && errno == EINTR);
+	if (n < 0 && errno == EBADF) {
+		/* One of the descriptors was closed; nothing was sent. */
+		free (strings);
+		return -1;
+	}
+	if (n <= 0 ||
+	    send_all (server_sock, (char *) &hdr + n, sizeof hdr - n) < 0 ||
+	    send_all (server_sock, strings, hdr.len) < 0) {
+		free (strings);
+		spawn_server_lost ();
+		return -1;
+	}
+	free (strings);
+
+	/* Set aside any exit statuses that arrive before our answer. */
+	for (;;) {
+		if (read_all (server_sock, &reply, sizeof reply) < 0) {
+			spawn_server_lost ();
+			return -1;
+		}
+		if (reply.type == SPAWN_STARTED)
+			break;
+		if (n_pending >= max_pending) {
+			max_pending = max_pending ? max_pending * 2 : 4;
+			pending = xnrealloc (pending, max_pending,
+					     sizeof *pending);
+		}
+		pending[n_pending++] = reply;
+	}
+
+	if (reply.pid < 0) {
+		debug ("spawn server couldn't start \"%s\": %s\n",
+		       req->file, strerror (reply.value));
+		return -1;
+	}
+	return reply.pid;
+}
+
+pid_t spawn_server_spawn (const struct spawn_request *req)
+{
+	pid_t pid;
+
+	lock_server ();
+	pid = server_spawn (req);
+	unlock_server ();
+	return pid;
+}
+
+/* Get the next exit status reported by the server without waiting.
+ * Returns 1 and sets *pid, *status, and *usage if there was one, 0 if not,
+ * or -1 if the server has gone away.  The caller must hold server_lock.
+ */
+static int server_poll (pid_t *pid, int *status, struct rusage *usage)
+{
+	struct spawn_reply reply;
+	struct pollfd pfd;
+	int ret;
+
+	if (n_pending) {
+		*pid = pending[0].pid;
+		*status = pending[0].value;
+		*usage = pending[0].usage;
+		--n_pending;
+		memmove (pending, pending + 1, n_pending * sizeof *pending);
+		return 1;
+	}
+
+	if (server_sock == -1)
+		return -1;
+
+	pfd.fd = server_sock;
+	pfd.events = POLLIN;
+	do
+		ret = poll (&pfd, 1, 0);
+	while (ret < 0 && errno == EINTR);
+	if (ret <= 0)
+		return 0;
+
+	if (read_all (server_sock, &reply, sizeof reply) < 0 ||
+	    reply.type != SPAWN_EXITED) {
+		spawn_server_lost ();
+		return -1;
+	}
+	*pid = reply.pid;
+	*status = reply.value;
+	*usage = reply.usage;
+	return 1;
+}
+
+/* Get the next exit status reported by the server, waiting for one if
+ * block is non-zero.  Returns 1 and sets *pid, *status, and *usage if
+ * there was one, 0 if not, or -1 if the server has gone away.
+ */
+int spawn_server_wait (int block, pid_t *pid, int *status,
+		       struct rusage *usage)
+{
+	for (;;) {
+		struct pollfd pfd;
+		int ret;
+
+		lock_server ();
+		ret = server_poll (pid, status, usage);
+		pfd.fd = server_sock;
+		unlock_server ();
+		if (ret || !block)
+			return ret;
+
+		/* Wait without the lock, so that other threads can start
+		 * commands meanwhile.  One of them may take the reply we
+		 * were woken for, but then it sets it aside for us.
+		 */
+		pfd.events = POLLIN;
+		while (poll (&pfd, 1, -1) < 0 && errno == EINTR)
+			;
+	}
+}
@@ -0,0 +1,373 @@
+/*
+ * trace.c: record pipeline lifecycle events
+ * Copyright (C) 2026 Colin Watson.
+ *
+ * This file is part of libpipeline.
+ *
+ * libpipeline is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * libpipeline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libpipeline; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301
+ * USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+
+#ifdef USE_POSIX_THREADS
+#  include <pthread.h>
+#endif
+
+#include "pipeline-private.h"
+#include "error.h"
+
+/* Events are kept in a ring that every thread appends to without taking a
+ * lock: a writer claims the next slot by incrementing the ring's counter,
+ * fills it in, and then stamps it with its sequence number, so that a
+ * reader can tell complete events from those being written or overwritten.
+ * The ring is shared with forked children, so that they can record when
+ * they exec.
+ */
+
+#if defined(__ATOMIC_RELAXED)
+#  define atomic_fetch_inc(p)		__atomic_fetch_add (p, 1, __ATOMIC_RELAXED)
+#  define atomic_store_release(p, v)	__atomic_store_n (p, v, __ATOMIC_RELEASE)
+#  define atomic_load_acquire(p)	__atomic_load_n (p, __ATOMIC_ACQUIRE)
+#elif defined(__GNUC__)
+#  define atomic_fetch_inc(p)		__sync_fetch_and_add (p, 1)
+#  define atomic_store_release(p, v) \
+	do { __sync_synchronize (); *(p) = (v); } while (0)
+#  define atomic_load_acquire(p)	__sync_fetch_and_add (p, 0)
+#else
+/* Good enough for a single thread. */
+#  define atomic_fetch_inc(p)		((*(p))++)
+#  define atomic_store_release(p, v)	(*(p) = (v))
+#  define atomic_load_acquire(p)	(*(p))
+#endif
+
+#define TRACE_NAME_MAX	32
+#define TRACE_DEFAULT_SIZE 65536
+
+struct trace_record {
+	unsigned long long seq;	/* index plus one once complete, else 0 */
+	long long time;		/* microseconds */
+	enum trace_type type;
+	int pipeline;
+	int command;
+	pid_t pid;
+	long long value;
+	char name[TRACE_NAME_MAX];
+};
+
+struct trace_ring {
+	unsigned long long next;	/* index of the next event */
+	unsigned long long size;
+	struct trace_record records[1];
+};
+
+int trace_enabled = 0;
+
+static struct trace_ring *ring = NULL;
+static size_t ring_bytes = 0;
+static int ring_mapped = 0;
+static int next_pipeline_id = 0;
+
+/* Set from PIPELINE_TRACE. */
+static char *trace_file = NULL;
+static pid_t trace_file_owner;
+
+static const char *const trace_names[] = {
+	"pipeline",	/* TRACE_PIPELINE_START */
+	"pipeline",	/* TRACE_PIPELINE_END */
+	"pipe",		/* TRACE_PIPE */
+	"command",	/* TRACE_COMMAND_START */
+	"fork",		/* TRACE_FORK */
+	"spawn",	/* TRACE_SPAWN */
+	"serve",	/* TRACE_SERVE */
+	"thread",	/* TRACE_THREAD */
+	"exec",		/* TRACE_EXEC */
+	"first byte",	/* TRACE_FIRST_BYTE */
+	"EOF",		/* TRACE_EOF */
+	"exit",		/* TRACE_EXIT */
+	"reap",		/* TRACE_REAP */
+	"pump bytes"	/* TRACE_PUMP */
+};
+
+static long long trace_time (void)
+{
+	struct timeval tv;
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+		return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+	gettimeofday (&tv, NULL);
+	return (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void trace_record (enum trace_type type, int id, int command, pid_t pid,
+		   long long value, const char *name)
+{
+	struct trace_ring *r = ring;
+	struct trace_record *rec;
+	unsigned long long index;
+
+	if (!r)
+		return;
+	index = atomic_fetch_inc (&r->next);
+	rec = &r->records[index % r->size];
+	atomic_store_release (&rec->seq, 0);
+	rec->time = trace_time ();
+	rec->type = type;
+	rec->pipeline = id;
+	rec->command = command;
+	rec->pid = pid;
+	rec->value = value;
+	if (name) {
+		strncpy (rec->name, name, TRACE_NAME_MAX - 1);
+		rec->name[TRACE_NAME_MAX - 1] = '\0';
+	} else
+		rec->name[0] = '\0';
+	atomic_store_release (&rec->seq, index + 1);
+}
+
+int trace_pipeline_id (void)
+{
+	return atomic_fetch_inc (&next_pipeline_id) + 1;
+}
+
+int pipeline_trace_start (size_t size)
+{
+	struct trace_ring *r;
+	size_t bytes;
+
+	if (!size)
+		size = TRACE_DEFAULT_SIZE;
+	bytes = offsetof (struct trace_ring, records) +
+		size * sizeof (struct trace_record);
+	if ((bytes - offsetof (struct trace_ring, records)) /
+	    sizeof (struct trace_record) != size) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	trace_enabled = 0;
+	if (ring) {
+		if (ring_mapped)
+			munmap (ring, ring_bytes);
+		else
+			free (ring);
+		ring = NULL;
+	}
+
+	/* Share the ring with forked children if we can.  The pages are
+	 * only touched as events are recorded.
+	 */
+#ifdef MAP_ANONYMOUS
+	r = mmap (NULL, bytes, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (r == MAP_FAILED)
+		return -1;
+	ring_mapped = 1;
+#else
+	r = calloc (1, bytes);
+	if (!r)
+		return -1;
+	ring_mapped = 0;
+#endif
+	r->next = 0;
+	r->size = size;
+	ring = r;
+	ring_bytes = bytes;
+	trace_enabled = 1;
+	return 0;
+}
+
+void pipeline_trace_stop (void)
+{
+	trace_enabled = 0;
+}
+
+/* Write str to stream as a JSON string. */
+static void put_json_string (FILE *stream, const char *str)
+{
+	putc ('"', stream);
+	for (; *str; ++str) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			fprintf (stream, "\\%c", c);
+		else if (c < 0x20)
+			fprintf (stream, "\\u%04x", c);
+		else
+			putc (c, stream);
+	}
+	putc ('"', stream);
+}
+
+/* Write rec as one or two Chrome trace events.  Each pipeline appears as a
+ * process and each of its commands as a thread within it; pipeline_pump
+ * appears as process 0.
+ */
+static void put_event (FILE *stream, const struct trace_record *rec,
+		       int *first)
+{
+	int tid = rec->command + 1;
+	const char *name = trace_names[rec->type];
+
+	if (!*first)
+		fputs (",\n", stream);
+	*first = 0;
+
+	switch (rec->type) {
+		case TRACE_PIPELINE_START:
+			fprintf (stream, "{\"name\":\"process_name\","
+				 "\"ph\":\"M\",\"pid\":%d,"
+				 "\"args\":{\"name\":\"pipeline %d\"}},\n",
+				 rec->pipeline, rec->pipeline);
+			fprintf (stream, "{\"name\":\"%s\",\"ph\":\"B\","
+				 "\"ts\":%lld,\"pid\":%d,\"tid\":0,"
+				 "\"args\":{\"commands\":%lld}}",
+				 name, rec->time, rec->pipeline, rec->value);
+			return;
+		case TRACE_PIPELINE_END:
+			fprintf (stream, "{\"name\":\"%s\",\"ph\":\"E\","
+				 "\"ts\":%lld,\"pid\":%d,\"tid\":0,"
+				 "\"args\":{\"status\":%lld}}",
+				 name, rec->time, rec->pipeline, rec->value);
+			return;
+		case TRACE_COMMAND_START:
+			fprintf (stream, "{\"name\":\"thread_name\","
+				 "\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+				 "\"args\":{\"name\":",
+				 rec->pipeline, tid);
+			put_json_string (stream, rec->name);
+			fputs ("}},\n", stream);
+			fputs ("{\"name\":", stream);
+			put_json_string (stream, rec->name);
+			fprintf (stream, ",\"ph\":\"B\",\"ts\":%lld,"
+				 "\"pid\":%d,\"tid\":%d}",
+				 rec->time, rec->pipeline, tid);
+			return;
+		case TRACE_EXIT:
+			fprintf (stream, "{\"name\":\"%s\",\"ph\":\"E\","
+				 "\"ts\":%lld,\"pid\":%d,\"tid\":%d,"
+				 "\"args\":{\"pid\":%d,\"status\":%lld}}",
+				 name, rec->time, rec->pipeline, tid,
+				 (int) rec->pid, rec->value);
+			return;
+		case TRACE_PUMP:
+			fprintf (stream, "{\"name\":\"%s\",\"ph\":\"C\","
+				 "\"ts\":%lld,\"pid\":0,"
+				 "\"args\":{\"bytes\":%lld}}",
+				 name, rec->time, rec->value);
+			return;
+		default:
+			fprintf (stream, "{\"name\":\"%s\",\"ph\":\"i\","
+				 "\"s\":\"t\",\"ts\":%lld,\"pid\":%d,"
+				 "\"tid\":%d,\"args\":{\"pid\":%d,"
+				 "\"value\":%lld}}",
+				 name, rec->time, rec->pipeline, tid,
+				 (int) rec->pid, rec->value);
+			return;
+	}
+}
+
+int pipeline_trace_dump (FILE *stream)
+{
+	struct trace_ring *r = ring;
+	unsigned long long next, index;
+	int first = 1;
+
+	fputs ("{\"traceEvents\":[\n", stream);
+	if (r) {
+		next = atomic_load_acquire (&r->next);
+		index = next > r->size ? next - r->size : 0;
+		for (; index < next; ++index) {
+			struct trace_record *slot =
+				&r->records[index % r->size];
+			struct trace_record rec;
+
+			/* Skip events still being written, or overwritten
+			 * while we copied them.
+			 */
+			if (atomic_load_acquire (&slot->seq) != index + 1)
+				continue;
+			rec = *slot;
+			if (atomic_load_acquire (&slot->seq) != index + 1)
+				continue;
+			put_event (stream, &rec, &first);
+		}
+	}
+	fputs ("\n],\"displayTimeUnit\":\"ms\"}\n", stream);
+	return ferror (stream) ? -1 : 0;
+}
+
+static void write_trace_file (void)
+{
+	FILE *stream;
+
+	/* Forked children that exit normally must leave the file alone. */
+	if (getpid () != trace_file_owner)
+		return;
+	stream = fopen (trace_file, "w");
+	if (!stream) {
+		error (0, errno, "can't open %s", trace_file);
+		return;
+	}
+	if (pipeline_trace_dump (stream) < 0 || fclose (stream) == EOF)
+		error (0, errno, "can't write %s", trace_file);
+}
+
+static void read_trace_file (void)
+{
+	const char *pipeline_trace = getenv ("PIPELINE_TRACE");
+
+	if (!pipeline_trace || !*pipeline_trace)
+		return;
+	trace_file = strdup (pipeline_trace);
+	if (!trace_file || pipeline_trace_start (0) < 0) {
+		error (0, errno, "can't trace to %s", pipeline_trace);
+		return;
+	}
+	trace_file_owner = getpid ();
+	atexit (write_trace_file);
+}
+
+void init_trace (void)
+{
+#ifdef USE_POSIX_THREADS
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once (&once, read_trace_file);
+#else
+	static int inited = 0;
+
+	if (inited)
+		return;
+	inited = 1;
+	read_trace_file ();
+#endif
+}
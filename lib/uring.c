@@ -0,0 +1,370 @@
+/*
+ * uring.c: batch reads and writes using io_uring
+ * Copyright (C) 2026 Colin Watson.
+ *
+ * This file is part of libpipeline.
+ *
+ * libpipeline is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * libpipeline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libpipeline; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301
+ * USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <linux/io_uring.h>
+#  if defined(SYS_io_uring_setup) && defined(SYS_io_uring_enter) && \
+      defined(SYS_io_uring_register) && defined(IORING_FEAT_RW_CUR_POS) && \
+      defined(RWF_NOWAIT)
+#    define USE_IO_URING 1
+#  endif
+#endif
+
+#include "xalloc.h"
+
+#include "pipeline-private.h"
+#include "error.h"
+
+#ifdef USE_IO_URING
+
+/* We talk to the kernel directly rather than depending on liburing, since
+ * we only need a small part of what it does.  Operations are queued in
+ * the submission ring and then submitted together by uring_run, which
+ * waits for all of them to complete and stores each result where the
+ * caller asked.
+ */
+
+struct uring {
+	int fd;
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned cq_entries;
+	unsigned queued;	/* filled in but not yet submitted */
+	unsigned inflight;	/* submitted but not yet completed */
+	/* The buffers registered in each slot of a sparse table, or 0 slots
+	 * if the kernel can't register buffers that way.
+	 */
+	unsigned nbufs;
+	struct iovec *bufs;
+};
+
+#define ring_ptr(map, off) ((unsigned *) ((char *) (map) + (off)))
+
+struct uring *uring_new (unsigned entries, unsigned nbufs)
+{
+	struct io_uring_params params;
+	struct uring *ring;
+	int fd;
+
+	memset (&params, 0, sizeof params);
+#ifdef IORING_SETUP_CLAMP
+	params.flags |= IORING_SETUP_CLAMP;
+#endif
+	fd = syscall (SYS_io_uring_setup, entries, &params);
+	if (fd < 0)
+		return NULL;
+	/* Without this, reads and writes can't use the current file
+	 * position, and the kernel is probably too old to be worth it.
+	 */
+	if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+		close (fd);
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	ring = XZALLOC (struct uring);
+	ring->fd = fd;
+	ring->sq_map_len = params.sq_off.array +
+			   params.sq_entries * sizeof (unsigned);
+	ring->cq_map_len = params.cq_off.cqes +
+			   params.cq_entries * sizeof (struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_map_len > ring->sq_map_len)
+			ring->sq_map_len = ring->cq_map_len;
+		ring->cq_map_len = 0;
+	}
+	ring->sq_map = mmap (NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED)
+		goto fail;
+	if (ring->cq_map_len) {
+		ring->cq_map = mmap (NULL, ring->cq_map_len,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_map == MAP_FAILED)
+			goto fail;
+	} else
+		ring->cq_map = ring->sq_map;
+	ring->sqes_len = params.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = mmap (NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail;
+
+	ring->sq_head = ring_ptr (ring->sq_map, params.sq_off.head);
+	ring->sq_tail = ring_ptr (ring->sq_map, params.sq_off.tail);
+	ring->sq_mask = ring_ptr (ring->sq_map, params.sq_off.ring_mask);
+	ring->sq_array = ring_ptr (ring->sq_map, params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+	ring->cq_head = ring_ptr (ring->cq_map, params.cq_off.head);
+	ring->cq_tail = ring_ptr (ring->cq_map, params.cq_off.tail);
+	ring->cq_mask = ring_ptr (ring->cq_map, params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)
+		((char *) ring->cq_map + params.cq_off.cqes);
+	ring->cq_entries = params.cq_entries;
+
+#ifdef IORING_RSRC_REGISTER_SPARSE
+	if (nbufs) {
+		struct io_uring_rsrc_register reg;
+
+		memset (&reg, 0, sizeof reg);
+		reg.nr = nbufs;
+		reg.flags = IORING_RSRC_REGISTER_SPARSE;
+		if (syscall (SYS_io_uring_register, fd,
+			     IORING_REGISTER_BUFFERS2, &reg, sizeof reg) == 0) {
+			ring->nbufs = nbufs;
+			ring->bufs = xcalloc (nbufs, sizeof *ring->bufs);
+		} else
+			debug ("can't register io_uring buffers: %s\n",
+			       strerror (errno));
+	}
+#endif /* IORING_RSRC_REGISTER_SPARSE */
+
+	return ring;
+
+fail:
+	uring_free (ring);
+	return NULL;
+}
+
+void uring_free (struct uring *ring)
+{
+	int saved_errno = errno;
+
+	if (!ring)
+		return;
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap (ring->sqes, ring->sqes_len);
+	if (ring->cq_map && ring->cq_map != MAP_FAILED &&
+	    ring->cq_map != ring->sq_map)
+		munmap (ring->cq_map, ring->cq_map_len);
+	if (ring->sq_map && ring->sq_map != MAP_FAILED)
+		munmap (ring->sq_map, ring->sq_map_len);
+	close (ring->fd);
+	free (ring->bufs);
+	free (ring);
+	errno = saved_errno;
+}
+
+int uring_set_buffer (struct uring *ring, unsigned index, void *buf,
+		      size_t len)
+{
+	if (index >= ring->nbufs)
+		return -1;
+	if (ring->bufs[index].iov_base == buf &&
+	    ring->bufs[index].iov_len == len)
+		return 0;
+
+#ifdef IORING_RSRC_REGISTER_SPARSE
+	{
+		struct io_uring_rsrc_update2 update;
+		struct iovec iov;
+
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		memset (&update, 0, sizeof update);
+		update.offset = index;
+		update.data = (unsigned long) &iov;
+		update.nr = 1;
+		if (syscall (SYS_io_uring_register, ring->fd,
+			     IORING_REGISTER_BUFFERS_UPDATE, &update,
+			     sizeof update) < 0) {
+			/* Probably RLIMIT_MEMLOCK; don't keep trying. */
+			debug ("can't update io_uring buffer: %s\n",
+			       strerror (errno));
+			ring->nbufs = 0;
+			return -1;
+		}
+	}
+#endif /* IORING_RSRC_REGISTER_SPARSE */
+
+	ring->bufs[index].iov_base = buf;
+	ring->bufs[index].iov_len = len;
+	return 0;
+}
+
+/* Return a cleared submission queue entry, first running everything
+ * already queued if there is no room for another.
+ */
+static struct io_uring_sqe *get_sqe (struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, index;
+
+	if (ring->queued + ring->inflight >= ring->sq_entries &&
+	    uring_run (ring) < 0)
+		error (FATAL, errno, "io_uring_enter");
+	tail = *ring->sq_tail;
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset (sqe, 0, sizeof *sqe);
+	ring->sq_array[index] = index;
+	return sqe;
+}
+
+/* Make sqe, the entry returned by the last call to get_sqe, visible to
+ * the kernel.
+ */
+static void put_sqe (struct uring *ring)
+{
+	__atomic_store_n (ring->sq_tail, *ring->sq_tail + 1,
+			  __ATOMIC_RELEASE);
+	++ring->queued;
+}
+
+void uring_read (struct uring *ring, int fd, void *buf, size_t len,
+		 int index, int nowait, ssize_t *result)
+{
+	struct io_uring_sqe *sqe = get_sqe (ring);
+
+	if (index >= 0) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->buf_index = index;
+	} else
+		sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) buf;
+	sqe->len = len;
+	sqe->off = (__u64) -1;	/* current position */
+	sqe->rw_flags = nowait ? RWF_NOWAIT : 0;
+	sqe->user_data = (unsigned long) result;
+	put_sqe (ring);
+}
+
+void uring_write (struct uring *ring, int fd, const void *buf, size_t len,
+		  int nowait, ssize_t *result)
+{
+	struct io_uring_sqe *sqe = get_sqe (ring);
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) buf;
+	sqe->len = len;
+	sqe->off = (__u64) -1;
+	sqe->rw_flags = nowait ? RWF_NOWAIT : 0;
+	sqe->user_data = (unsigned long) result;
+	put_sqe (ring);
+}
+
+int uring_run (struct uring *ring)
+{
+	while (ring->queued || ring->inflight) {
+		unsigned head, tail;
+		long ret;
+
+		ret = syscall (SYS_io_uring_enter, ring->fd, ring->queued,
+			       ring->queued + ring->inflight,
+			       IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN &&
+		    errno != EBUSY)
+			return -1;
+		if (ret > 0) {
+			ring->queued -= ret;
+			ring->inflight += ret;
+		}
+
+		head = *ring->cq_head;
+		tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			struct io_uring_cqe *cqe =
+				&ring->cqes[head & *ring->cq_mask];
+			*(ssize_t *) (unsigned long) cqe->user_data =
+				cqe->res;
+			--ring->inflight;
+		}
+		__atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+#else /* !USE_IO_URING */
+
+struct uring {
+	int unused;
+};
+
+struct uring *uring_new (unsigned entries PIPELINE_ATTR_UNUSED,
+			 unsigned nbufs PIPELINE_ATTR_UNUSED)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void uring_free (struct uring *ring PIPELINE_ATTR_UNUSED)
+{
+}
+
+int uring_set_buffer (struct uring *ring PIPELINE_ATTR_UNUSED,
+		      unsigned index PIPELINE_ATTR_UNUSED,
+		      void *buf PIPELINE_ATTR_UNUSED,
+		      size_t len PIPELINE_ATTR_UNUSED)
+{
+	return -1;
+}
+
+void uring_read (struct uring *ring PIPELINE_ATTR_UNUSED,
+		 int fd PIPELINE_ATTR_UNUSED, void *buf PIPELINE_ATTR_UNUSED,
+		 size_t len PIPELINE_ATTR_UNUSED,
+		 int index PIPELINE_ATTR_UNUSED,
+		 int nowait PIPELINE_ATTR_UNUSED,
+		 ssize_t *result PIPELINE_ATTR_UNUSED)
+{
+	abort ();
+}
+
+void uring_write (struct uring *ring PIPELINE_ATTR_UNUSED,
+		  int fd PIPELINE_ATTR_UNUSED,
+		  const void *buf PIPELINE_ATTR_UNUSED,
+		  size_t len PIPELINE_ATTR_UNUSED,
+		  int nowait PIPELINE_ATTR_UNUSED,
+		  ssize_t *result PIPELINE_ATTR_UNUSED)
+{
+	abort ();
+}
+
+int uring_run (struct uring *ring PIPELINE_ATTR_UNUSED)
+{
+	return 0;
+}
+
+#endif /* USE_IO_URING */
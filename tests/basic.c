@@ -24,6 +24,9 @@
 #endif
 
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
 
 #include "common.h"
 
@@ -111,6 +114,107 @@ START_TEST (test_basic_wait_all)
 }
 END_TEST
 
+static void exit_callback (pipecmd *cmd PIPELINE_ATTR_UNUSED, int status,
+			   void *data)
+{
+	*(int *) data = status;
+}
+
+/* Wait for fd, if valid, to become readable. */
+static void wait_readable (int fd)
+{
+	struct pollfd pfd;
+	int ret;
+
+	if (fd == -1)
+		return;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	do
+		ret = poll (&pfd, 1, -1);
+	while (ret < 0 && errno == EINTR);
+	fail_unless (ret == 1);
+}
+
+START_TEST (test_basic_try_wait_all)
+{
+	pipeline *p;
+	pipecmd *cmd1, *cmd2;
+	int status1 = -1, status2 = -1;
+	int *statuses;
+	int n_statuses;
+	int control[2];
+	int fd, ret;
+
+	/* The first command runs until we write to the control pipe. */
+	fail_unless (pipe (control) == 0);
+	fail_unless (dup2 (control[0], 9) == 9);
+	close (control[0]);
+	cmd1 = pipecmd_new_args ("sh", "-c", "read x <&9; exit 2", NULL);
+	pipecmd_exit_callback (cmd1, exit_callback, &status1);
+	cmd2 = pipecmd_new_args ("sh", "-c", "exit 3", NULL);
+	pipecmd_exit_callback (cmd2, exit_callback, &status2);
+	p = pipeline_new_commands (cmd1, cmd2, NULL);
+	pipeline_start (p);
+	close (9);
+
+	fd = pipeline_get_wait_fd (p);
+	fail_unless (pipeline_try_wait_all (p, &statuses, &n_statuses) == -1);
+
+	/* The second command is reported as soon as it exits. */
+	while (status2 == -1) {
+		wait_readable (fd);
+		fail_unless (pipeline_try_wait_all (p, &statuses,
+						    &n_statuses) == -1);
+	}
+	fail_unless (status2 == 3 * 256);
+	fail_unless (status1 == -1);
+
+	fail_unless (write (control[1], "\n", 1) == 1);
+	close (control[1]);
+	do {
+		wait_readable (fd);
+		ret = pipeline_try_wait_all (p, &statuses, &n_statuses);
+	} while (ret == -1);
+	fail_unless (ret == 3);
+	fail_unless (status1 == 2 * 256);
+	fail_unless (n_statuses == 2);
+	fail_unless (statuses[0] == 2 * 256);
+	fail_unless (statuses[1] == 3 * 256);
+	free (statuses);
+	pipeline_free (p);
+}
+END_TEST
+
+START_TEST (test_basic_rusage)
+{
+	pipeline *p;
+	struct rusage usage;
+	struct timeval elapsed;
+
+	p = pipeline_new_command_args
+		("sh", "-c", "i=0; while [ $i -lt 20000 ]; do i=$((i+1)); done",
+		 NULL);
+	pipeline_command (p, pipecmd_new_passthrough ());
+	pipeline_command_args (p, "true", NULL);
+	pipeline_start (p);
+	fail_unless (pipeline_get_rusage (p, 0, &usage, &elapsed) == -1);
+	fail_unless (pipeline_wait (p) == 0);
+
+	/* Statuses remain available after waiting. */
+	fail_unless (pipeline_get_rusage (p, 0, &usage, &elapsed) == 0);
+	fail_unless (timerisset (&usage.ru_utime) ||
+		     timerisset (&usage.ru_stime));
+	fail_unless (usage.ru_maxrss > 0);
+	fail_unless (timerisset (&elapsed));
+	fail_unless (pipeline_get_rusage (p, 1, NULL, &elapsed) == 0);
+	fail_unless (pipeline_get_rusage (p, 2, &usage, NULL) == 0);
+	fail_unless (usage.ru_maxrss > 0);
+	fail_unless (pipeline_get_rusage (p, 3, &usage, &elapsed) == -1);
+	pipeline_free (p);
+}
+END_TEST
+
 START_TEST (test_basic_setenv)
 {
 	pipeline *p;
@@ -212,6 +316,64 @@ START_TEST (test_basic_clearenv)
 }
 END_TEST
 
+static void echo_test5 (void *data PIPELINE_ATTR_UNUSED)
+{
+	const char *value = getenv ("TEST5");
+
+	printf ("%s\n", value ? value : "");
+}
+
+START_TEST (test_basic_env_reuse)
+{
+	pipeline *p;
+	pipecmd *cmd;
+	const char *line;
+
+	unsetenv ("TEST6");
+
+	cmd = pipecmd_new_args ("sh", "-c", "echo $TEST5$TEST6", NULL);
+	pipecmd_setenv (cmd, "TEST5", "foo");
+	p = pipeline_new_commands (cmd, NULL);
+	pipeline_want_out (p, -1);
+	pipeline_start (p);
+	line = pipeline_readline (p);
+	fail_unless (!strcmp (line, "foo\n"),
+		     "setenv returned '%s', expected 'foo\n'", line);
+	pipeline_wait (p);
+
+	/* The command's environment follows changes to the parent's. */
+	setenv ("TEST6", "bar", 1);
+	pipeline_start (p);
+	line = pipeline_readline (p);
+	fail_unless (!strcmp (line, "foobar\n"),
+		     "parent setenv returned '%s', expected 'foobar\n'", line);
+	pipeline_wait (p);
+
+	/* ... and to its own. */
+	pipecmd_setenv (cmd, "TEST5", "baz");
+	pipeline_start (p);
+	line = pipeline_readline (p);
+	fail_unless (!strcmp (line, "bazbar\n"),
+		     "second setenv returned '%s', expected 'bazbar\n'", line);
+	pipeline_wait (p);
+	pipeline_free (p);
+
+	/* Function commands see the command's environment too. */
+	cmd = pipecmd_new_function ("echo_test5", echo_test5, NULL, NULL);
+	pipecmd_setenv (cmd, "TEST5", "quux");
+	p = pipeline_new_commands (cmd, NULL);
+	pipeline_want_out (p, -1);
+	pipeline_start (p);
+	line = pipeline_readline (p);
+	fail_unless (!strcmp (line, "quux\n"),
+		     "function returned '%s', expected 'quux\n'", line);
+	pipeline_wait (p);
+	pipeline_free (p);
+
+	unsetenv ("TEST6");
+}
+END_TEST
+
 START_TEST (test_basic_sequence)
 {
 	pipeline *p;
@@ -242,9 +404,12 @@ Suite *basic_suite (void)
 	TEST_CASE (s, basic, args);
 	TEST_CASE (s, basic, pipeline);
 	TEST_CASE (s, basic, wait_all);
+	TEST_CASE (s, basic, try_wait_all);
+	TEST_CASE (s, basic, rusage);
 	TEST_CASE (s, basic, setenv);
 	TEST_CASE (s, basic, unsetenv);
 	TEST_CASE (s, basic, clearenv);
+	TEST_CASE (s, basic, env_reuse);
 	TEST_CASE (s, basic, sequence);
 
 	return s;
@@ -23,13 +23,23 @@
 #  include "config.h"
 #endif
 
+#include <ctype.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#ifdef USE_POSIX_THREADS
+#  include <pthread.h>
+#endif
+
+#include "full-write.h"
+#include "safe-read.h"
+#include "xalloc.h"
 #include "xvasprintf.h"
 
 #include "common.h"
@@ -123,12 +133,439 @@ START_TEST (test_exec_function)
 }
 END_TEST
 
+static int upcase_helper (int infd, int outfd, void *data)
+{
+	char buffer[4096];
+	int r, i;
+
+	while ((r = safe_read (infd, buffer, sizeof buffer)) > 0) {
+		for (i = 0; i < r; ++i)
+			buffer[i] = toupper ((unsigned char) buffer[i]);
+		if (full_write (outfd, buffer, r) < (size_t) r)
+			break;
+	}
+
+	return *(int *) data;
+}
+
+START_TEST (test_exec_thread)
+{
+	int exit_status = 3;
+	pipeline *p;
+	pipecmd *cmd;
+	int *statuses, n_statuses;
+	const char *line;
+
+	p = pipeline_new ();
+	pipeline_command_args (p, "sh", "-c", "echo hello; echo world",
+			       NULL);
+	cmd = pipecmd_new_fd_function ("upcase", upcase_helper, NULL,
+				       &exit_status);
+	pipecmd_thread (cmd, 1);
+	pipeline_command (p, cmd);
+	pipeline_command_args (p, "cat", NULL);
+	pipeline_want_out (p, -1);
+	pipeline_start (p);
+
+	fail_unless (pipeline_get_pid (p, 0) > 0);
+	fail_unless (pipeline_get_pid (p, 1) == 0);
+	fail_unless (pipeline_get_pid (p, 2) > 0);
+
+	line = pipeline_readline (p);
+	fail_unless (line && !strcmp (line, "HELLO\n"));
+	line = pipeline_readline (p);
+	fail_unless (line && !strcmp (line, "WORLD\n"));
+	line = pipeline_readline (p);
+	fail_unless (line == NULL);
+
+	fail_unless (pipeline_wait_all (p, &statuses, &n_statuses) == 127);
+	fail_unless (n_statuses == 3);
+	fail_unless (WIFEXITED (statuses[1]));
+	fail_unless (WEXITSTATUS (statuses[1]) == 3);
+	fail_unless (statuses[0] == 0 && statuses[2] == 0);
+	free (statuses);
+	pipeline_free (p);
+}
+END_TEST
+
+START_TEST (test_exec_thread_fallback)
+{
+	int exit_status = 0;
+	pipeline *p;
+	pipecmd *cmd;
+	const char *line;
+
+	/* A command that changes its environment must be forked. */
+	cmd = pipecmd_new_fd_function ("upcase", upcase_helper, NULL,
+				       &exit_status);
+	pipecmd_thread (cmd, 1);
+	pipecmd_setenv (cmd, "TEST", "1");
+	p = pipeline_new_commands (pipecmd_new_args ("echo", "foo", NULL),
+				   cmd, NULL);
+	pipeline_want_out (p, -1);
+	pipeline_start (p);
+
+	fail_unless (pipeline_get_pid (p, 1) > 0);
+	line = pipeline_readline (p);
+	fail_unless (line && !strcmp (line, "FOO\n"));
+	fail_unless (pipeline_wait (p) == 0);
+	pipeline_free (p);
+}
+END_TEST
+
+START_TEST (test_exec_cloexec)
+{
+	pipeline *p;
+	int flags;
+
+	p = pipeline_new_command_args ("cat", NULL);
+	pipeline_want_in (p, -1);
+	pipeline_want_out (p, -1);
+	pipeline_start (p);
+
+	/* Other children should not inherit our ends of the pipes. */
+	flags = fcntl (fileno (pipeline_get_infile (p)), F_GETFD);
+	fail_unless (flags != -1 && (flags & FD_CLOEXEC));
+	flags = fcntl (fileno (pipeline_get_outfile (p)), F_GETFD);
+	fail_unless (flags != -1 && (flags & FD_CLOEXEC));
+
+	fail_unless (pipeline_wait (p) == 0);
+	pipeline_free (p);
+}
+END_TEST
+
+START_TEST (test_exec_close_fds)
+{
+	int fd = open ("/dev/null", O_WRONLY);
+	pipecmd *cmd;
+	pipeline *p;
+
+	fail_unless (fd >= 0);
+	fail_unless (dup2 (fd, 9) == 9);
+
+	cmd = pipecmd_new_args ("sh", "-c", "echo foo >&9", NULL);
+	fail_unless (pipeline_run (pipeline_new_commands (cmd, NULL)) == 0);
+
+	cmd = pipecmd_new_args ("sh", "-c", "echo foo >&9", NULL);
+	pipecmd_discard_err (cmd, 1);
+	p = pipeline_new_commands (cmd, NULL);
+	pipeline_close_fds (p, 1);
+	fail_unless (pipeline_run (p) != 0);
+
+	close (9);
+	close (fd);
+}
+END_TEST
+
+static void write_script (const char *file, const char *word)
+{
+	FILE *script;
+
+	/* Replace rather than rewrite the file, so that it changes even
+	 * within the resolution of its modification time.
+	 */
+	unlink (file);
+	script = fopen (file, "w");
+	fail_unless (script != NULL);
+	fprintf (script, "#! /bin/sh\necho %s\n", word);
+	fail_unless (fclose (script) == 0);
+	fail_unless (chmod (file, 0755) == 0);
+}
+
+static char *run_script (const char *path_var)
+{
+	pipecmd *cmd = pipecmd_new ("libpipeline-test-script");
+	pipeline *p;
+	const char *line;
+	char *ret = NULL;
+
+	pipecmd_setenv (cmd, "PATH", path_var);
+	pipecmd_discard_err (cmd, 1);
+	p = pipeline_new_commands (cmd, NULL);
+	pipeline_want_out (p, -1);
+	pipeline_start (p);
+	line = pipeline_readline (p);
+	if (line)
+		ret = xstrdup (line);
+	pipeline_wait (p);
+	pipeline_free (p);
+	return ret;
+}
+
+START_TEST (test_exec_path)
+{
+	char *script = xasprintf ("%s/libpipeline-test-script", temp_dir);
+	char *path_var = xasprintf ("/nonexistent:%s", temp_dir);
+	char *line;
+	pipecmd *cmd;
+
+	/* The command's own PATH is searched. */
+	write_script (script, "one");
+	line = run_script (path_var);
+	fail_unless (line && !strcmp (line, "one\n"));
+	free (line);
+
+	/* A remembered search is redone if its result changes. */
+	write_script (script, "two");
+	line = run_script (path_var);
+	fail_unless (line && !strcmp (line, "two\n"));
+	free (line);
+	unlink (script);
+	line = run_script (path_var);
+	fail_unless (line == NULL);
+
+	/* A pinned path is used whatever the command's name. */
+	cmd = pipecmd_new_args ("libpipeline-no-such-command", "-c", "exit 3",
+				NULL);
+	pipecmd_pin_path (cmd, "/bin/sh");
+	fail_unless (pipeline_run (pipeline_new_commands (cmd, NULL)) == 3);
+
+	free (path_var);
+	free (script);
+}
+END_TEST
+
+START_TEST (test_exec_spawn_server)
+{
+	pipeline *p;
+	pipecmd *cmd;
+	int status = 0;
+	const char *line;
+	struct rusage usage;
+
+	fail_unless (pipeline_start_spawn_server () == 0);
+
+	p = pipeline_new_command_args ("echo", "foo", NULL);
+	pipeline_command (p, pipecmd_new_fd_function ("upcase", upcase_helper,
+						      NULL, &status));
+	cmd = pipecmd_new_args ("sh", "-c", "cat; echo $TEST", NULL);
+	pipecmd_setenv (cmd, "TEST", "bar");
+	pipeline_command (p, cmd);
+	/* Commands that can't be started using posix_spawn are forked by
+	 * the server.
+	 */
+	pipecmd_nice (pipeline_get_command (p, 0), 1);
+	pipecmd_nice (cmd, 1);
+	pipeline_want_out (p, -1);
+	pipeline_start (p);
+
+	/* The server's commands are not our children. */
+	fail_unless (pipeline_get_pid (p, 0) > 0);
+	fail_unless (waitpid (pipeline_get_pid (p, 0), NULL, WNOHANG) == -1);
+	fail_unless (errno == ECHILD);
+
+	line = pipeline_readline (p);
+	fail_unless (line && !strcmp (line, "FOO\n"));
+	line = pipeline_readline (p);
+	fail_unless (line && !strcmp (line, "bar\n"));
+	fail_unless (pipeline_wait (p) == 0);
+	/* The server reports what its commands used. */
+	fail_unless (pipeline_get_rusage (p, 2, &usage, NULL) == 0);
+	fail_unless (usage.ru_maxrss > 0);
+	pipeline_free (p);
+
+	cmd = pipecmd_new_args ("sh", "-c", "exit 5", NULL);
+	pipecmd_nice (cmd, 1);
+	fail_unless (pipeline_run (pipeline_new_commands (cmd, NULL)) == 5);
+	cmd = pipecmd_new ("libpipeline-no-such-command");
+	pipecmd_nice (cmd, 1);
+	pipecmd_discard_err (cmd, 1);
+	fail_unless (pipeline_run (pipeline_new_commands (cmd, NULL)) == 255);
+
+	pipeline_stop_spawn_server ();
+
+	p = pipeline_new_command_args ("sh", "-c", "exit 6", NULL);
+	fail_unless (pipeline_run (p) == 6);
+}
+END_TEST
+
+#ifdef USE_POSIX_THREADS
+
+#define CONCURRENT_THREADS 8
+#define CONCURRENT_RUNS 40
+
+/* Run a mixture of pipelines, each of which checks that it gets back its
+ * own output and exit status.  Returns the number of failures.
+ */
+static void *concurrent_helper (void *data)
+{
+	int n = *(int *) data;
+	int zero = 0;
+	long failures = 0;
+	int i;
+
+	for (i = 0; i < CONCURRENT_RUNS; ++i) {
+		int code = (n * CONCURRENT_RUNS + i) % 100 + 1;
+		char *script = xasprintf ("echo %d; exit %d", code, code);
+		char *expected = xasprintf ("%d\n", code);
+		pipeline *p;
+		pipecmd *cmd;
+		const char *line;
+		int *statuses, n_statuses;
+
+		cmd = pipecmd_new_args ("sh", "-c", script, NULL);
+		p = pipeline_new_commands (cmd, NULL);
+		switch (i % 5) {
+			case 1:
+				/* forked, or started by the spawn server */
+				pipecmd_nice (cmd, 1);
+				break;
+			case 2:
+				/* forked without exec */
+				pipeline_command (p, pipecmd_new_fd_function
+					("upcase", upcase_helper, NULL, &zero));
+				break;
+			case 3:
+				/* in a thread */
+				cmd = pipecmd_new_fd_function
+					("upcase", upcase_helper, NULL, &zero);
+				pipecmd_thread (cmd, 1);
+				pipeline_command (p, cmd);
+				break;
+			case 4:
+				/* in a sequence, forked by a forked child */
+				pipeline_command (p, pipecmd_new_sequence
+					("cat", pipecmd_new_args ("cat", NULL),
+					 NULL));
+				break;
+		}
+		pipeline_want_out (p, -1);
+		pipeline_start (p);
+
+		line = pipeline_readline (p);
+		if (!line || strcmp (line, expected))
+			++failures;
+		pipeline_wait_all (p, &statuses, &n_statuses);
+		if (!WIFEXITED (statuses[0]) ||
+		    WEXITSTATUS (statuses[0]) != code)
+			++failures;
+		free (statuses);
+		pipeline_free (p);
+		free (expected);
+		free (script);
+	}
+
+	return (void *) failures;
+}
+
+static void run_concurrently (void)
+{
+	pthread_t threads[CONCURRENT_THREADS];
+	int ids[CONCURRENT_THREADS];
+	int i;
+
+	for (i = 0; i < CONCURRENT_THREADS; ++i) {
+		ids[i] = i;
+		fail_unless (pthread_create (&threads[i], NULL,
+					     concurrent_helper, &ids[i]) == 0);
+	}
+	for (i = 0; i < CONCURRENT_THREADS; ++i) {
+		void *failures;
+
+		fail_unless (pthread_join (threads[i], &failures) == 0);
+		fail_unless (failures == NULL,
+			     "thread %d: %ld failures", i, (long) failures);
+	}
+}
+
+START_TEST (test_exec_concurrent)
+{
+	run_concurrently ();
+
+	fail_unless (pipeline_start_spawn_server () == 0);
+	run_concurrently ();
+	pipeline_stop_spawn_server ();
+}
+END_TEST
+
+#endif /* USE_POSIX_THREADS */
+
+static void batch_helper (pipeline *p PIPELINE_ATTR_UNUSED, int status,
+			  void *data)
+{
+	*(int *) data = status;
+}
+
+static pipeline_batch *requeue_batch;
+static int requeued_status = -1;
+
+static void batch_requeue (pipeline *p PIPELINE_ATTR_UNUSED,
+			   int status PIPELINE_ATTR_UNUSED,
+			   void *data PIPELINE_ATTR_UNUSED)
+{
+	pipeline_batch_add (requeue_batch,
+			    pipeline_new_command_args ("sh", "-c", "exit 5",
+						       NULL),
+			    batch_helper, &requeued_status);
+}
+
+START_TEST (test_exec_batch)
+{
+	pipeline_batch *b;
+	int results[20];
+	int control[2];
+	char script[16];
+	int i;
+
+	b = pipeline_batch_new (0);
+	fail_unless (pipeline_batch_get_max_running (b) >= 1);
+	pipeline_batch_free (b);
+
+	b = pipeline_batch_new (3);
+	for (i = 0; i < 20; ++i) {
+		results[i] = -1;
+		snprintf (script, sizeof script, "exit %d", i % 4);
+		pipeline_batch_add (b, pipeline_new_command_args
+					("sh", "-c", script, NULL),
+				    batch_helper, &results[i]);
+	}
+	fail_unless (pipeline_batch_run (b) == 15);
+	for (i = 0; i < 20; ++i)
+		fail_unless (results[i] == i % 4);
+	pipeline_batch_free (b);
+
+	/* The first pipeline only finishes once the second has run, and
+	 * the second queues a third when it finishes.
+	 */
+	fail_unless (pipe (control) == 0);
+	fail_unless (dup2 (control[0], 9) == 9);
+	fail_unless (dup2 (control[1], 8) == 8);
+	close (control[0]);
+	close (control[1]);
+	b = requeue_batch = pipeline_batch_new (2);
+	results[0] = -1;
+	pipeline_batch_add (b, pipeline_new_command_args
+				("sh", "-c", "read x <&9", NULL),
+			    batch_helper, &results[0]);
+	pipeline_batch_add (b, pipeline_new_command_args
+				("sh", "-c", "echo >&8", NULL),
+			    batch_requeue, NULL);
+	fail_unless (pipeline_batch_run (b) == 1);
+	fail_unless (results[0] == 0);
+	fail_unless (requeued_status == 5);
+	pipeline_batch_free (b);
+	close (8);
+	close (9);
+}
+END_TEST
+
 Suite *exec_suite (void)
 {
 	Suite *s = suite_create ("Exec");
 
 	TEST_CASE (s, exec, process);
 	TEST_CASE (s, exec, function);
+	TEST_CASE (s, exec, thread);
+	TEST_CASE (s, exec, thread_fallback);
+	TEST_CASE (s, exec, cloexec);
+	TEST_CASE (s, exec, close_fds);
+	TEST_CASE_WITH_FIXTURE (s, exec, path,
+				temp_dir_setup, temp_dir_teardown);
+	TEST_CASE (s, exec, spawn_server);
+	TEST_CASE (s, exec, batch);
+#ifdef USE_POSIX_THREADS
+	TEST_CASE (s, exec, concurrent);
+#endif
 
 	return s;
 }
@@ -118,6 +118,52 @@ START_TEST (test_inspect_pid)
 }
 END_TEST
 
+START_TEST (test_inspect_trace)
+{
+	pipeline *p;
+	pipecmd *cmd;
+	const char *line;
+	FILE *trace;
+	char *buf;
+	long len;
+
+	fail_unless (pipeline_trace_start (0) == 0);
+	cmd = pipecmd_new_args ("echo", "foo", NULL);
+	/* Make sure that it's forked, so that it traces its own exec. */
+	pipecmd_nice (cmd, 1);
+	p = pipeline_new_commands (cmd, NULL);
+	pipeline_command_args (p, "cat", NULL);
+	pipeline_want_out (p, -1);
+	pipeline_start (p);
+	line = pipeline_readline (p);
+	fail_unless (line && !strcmp (line, "foo\n"));
+	fail_unless (pipeline_readline (p) == NULL);
+	fail_unless (pipeline_wait (p) == 0);
+	pipeline_free (p);
+	pipeline_trace_stop ();
+
+	trace = tmpfile ();
+	fail_unless (trace != NULL);
+	fail_unless (pipeline_trace_dump (trace) == 0);
+	len = ftell (trace);
+	buf = malloc (len + 1);
+	fail_unless (buf != NULL);
+	rewind (trace);
+	fail_unless (fread (buf, 1, len, trace) == (size_t) len);
+	buf[len] = '\0';
+	fclose (trace);
+
+	fail_unless (!strncmp (buf, "{\"traceEvents\":[", 16));
+	fail_unless (strstr (buf, "\"name\":\"echo\",\"ph\":\"B\"") != NULL);
+	fail_unless (strstr (buf, "\"name\":\"exec\"") != NULL);
+	fail_unless (strstr (buf, "\"name\":\"first byte\"") != NULL);
+	fail_unless (strstr (buf, "\"name\":\"EOF\"") != NULL);
+	fail_unless (strstr (buf, "\"name\":\"exit\",\"ph\":\"E\"") != NULL);
+	fail_unless (strstr (buf, "\"name\":\"reap\"") != NULL);
+	free (buf);
+}
+END_TEST
+
 Suite *inspect_suite (void)
 {
 	Suite *s = suite_create ("Inspect");
@@ -125,6 +171,7 @@ Suite *inspect_suite (void)
 	TEST_CASE (s, inspect, command);
 	TEST_CASE (s, inspect, pipeline);
 	TEST_CASE (s, inspect, pid);
+	TEST_CASE (s, inspect, trace);
 
 	return s;
 }
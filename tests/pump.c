@@ -23,8 +23,15 @@
 #  include "config.h"
 #endif
 
+#include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/stat.h>
 
 #include "full-write.h"
 #include "xalloc.h"
@@ -50,6 +57,7 @@ START_TEST (test_pump_connect_attaches_correctly)
 	pipeline *one = pipeline_new ();
 	pipeline *two = pipeline_new ();
 	pipeline *three = pipeline_new ();
+	pipeline *four = pipeline_new ();
 
 	pipeline_connect (one, two, three, NULL);
 	fail_unless (one->redirect_out == REDIRECT_FD);
@@ -63,7 +71,20 @@ START_TEST (test_pump_connect_attaches_correctly)
 	fail_unless (three->redirect_in == REDIRECT_FD);
 	fail_unless (three->want_in < 0);
 	fail_unless (three->want_infile == NULL);
+	/* Zero-command sinks are handled without a passthrough command. */
+	fail_unless (pipeline_get_ncommands (two) == 0);
+	fail_unless (pipeline_get_ncommands (three) == 0);
+	fail_unless (one->nsinks == 2);
 
+	/* Reconnecting a sink moves it from its old source. */
+	pipeline_connect (one, two, NULL);
+	fail_unless (one->nsinks == 2);
+	pipeline_connect (four, three, NULL);
+	fail_unless (three->source == four);
+	fail_unless (one->nsinks == 1);
+	fail_unless (four->nsinks == 1);
+
+	pipeline_free (four);
 	pipeline_free (three);
 	pipeline_free (two);
 	pipeline_free (one);
@@ -82,7 +103,7 @@ static void tee_source (void *data PIPELINE_ATTR_UNUSED)
 		full_write (fileno (stdout), buf, 256);
 }
 
-START_TEST (test_pump_tee)
+static void check_tee (void)
 {
 	pipeline *source, *sink_process, *sink_function;
 	char *process_outfile, *function_outfile;
@@ -100,6 +121,12 @@ START_TEST (test_pump_tee)
 	pipeline_want_outfile (sink_function, function_outfile);
 	pipeline_connect (source, sink_process, sink_function, NULL);
 	pipeline_pump (source, sink_process, sink_function, NULL);
+	/* The sinks may not have finished writing their output files until
+	 * they have exited.
+	 */
+	pipeline_wait (sink_function);
+	pipeline_wait (sink_process);
+	pipeline_wait (source);
 	fail_unless_files_equal (process_outfile, function_outfile);
 
 	free (function_outfile);
@@ -108,8 +135,468 @@ START_TEST (test_pump_tee)
 	pipeline_free (sink_process);
 	pipeline_free (source);
 }
+
+START_TEST (test_pump_tee)
+{
+	check_tee ();
+}
+END_TEST
+
+START_TEST (test_pump_tee_three_sinks)
+{
+	pipeline *source, *sinks[3];
+	char *outfiles[3];
+	int i;
+
+	/* With more than one sink, all but the last may receive data
+	 * before the source has been consumed.
+	 */
+	source = pipeline_new ();
+	pipeline_command (source,
+			  pipecmd_new_function ("source", tee_source,
+						NULL, NULL));
+	for (i = 0; i < 3; ++i) {
+		sinks[i] = pipeline_new_command_args ("cat", NULL);
+		outfiles[i] = xasprintf ("%s/sink%d", temp_dir, i);
+		pipeline_want_outfile (sinks[i], outfiles[i]);
+	}
+	pipeline_connect (source, sinks[0], sinks[1], sinks[2], NULL);
+	pipeline_pump (source, sinks[0], sinks[1], sinks[2], NULL);
+	for (i = 0; i < 3; ++i)
+		pipeline_wait (sinks[i]);
+	pipeline_wait (source);
+	fail_unless_files_equal (outfiles[0], outfiles[1]);
+	fail_unless_files_equal (outfiles[0], outfiles[2]);
+
+	for (i = 0; i < 3; ++i) {
+		free (outfiles[i]);
+		pipeline_free (sinks[i]);
+	}
+	pipeline_free (source);
+}
+END_TEST
+
+START_TEST (test_pump_zero_command_sinks)
+{
+	pipeline *source, *sink_process, *sink_file, *sink_fd;
+	char *process_outfile, *file_outfile, *fd_outfile;
+	int fd;
+
+	source = pipeline_new ();
+	pipeline_command (source,
+			  pipecmd_new_function ("source", tee_source,
+						NULL, NULL));
+	sink_process = pipeline_new_command_args ("cat", NULL);
+	process_outfile = xasprintf ("%s/process", temp_dir);
+	pipeline_want_outfile (sink_process, process_outfile);
+	sink_file = pipeline_new ();
+	file_outfile = xasprintf ("%s/file", temp_dir);
+	pipeline_want_outfile (sink_file, file_outfile);
+	sink_fd = pipeline_new ();
+	fd_outfile = xasprintf ("%s/fd", temp_dir);
+	fd = open (fd_outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	fail_unless (fd >= 0);
+	pipeline_want_out (sink_fd, fd);
+	pipeline_connect (source, sink_process, sink_file, sink_fd, NULL);
+	/* The caller's descriptor is left for it to pass on as it likes. */
+	pipeline_start (sink_fd);
+	fail_unless (sink_fd->infd == fd);
+	fail_unless (!(fcntl (fd, F_GETFD) & FD_CLOEXEC));
+	pipeline_pump (source, sink_process, sink_file, sink_fd, NULL);
+	pipeline_wait (sink_fd);
+	pipeline_wait (sink_file);
+	pipeline_wait (sink_process);
+	pipeline_wait (source);
+	fail_unless_files_equal (process_outfile, file_outfile);
+	fail_unless_files_equal (process_outfile, fd_outfile);
+
+	free (fd_outfile);
+	free (file_outfile);
+	free (process_outfile);
+	pipeline_free (sink_fd);
+	pipeline_free (sink_file);
+	pipeline_free (sink_process);
+	pipeline_free (source);
+}
+END_TEST
+
+START_TEST (test_pump_peeked_source)
+{
+	pipeline *source, *sink;
+	char *outfile;
+	const char *block;
+	size_t len = 1000;
+	unsigned char buf[4096];
+	FILE *out;
+	size_t got, total = 0, k;
+
+	/* Data already in the source's peek cache can't be moved without
+	 * copying it, so this goes through the buffered path.
+	 */
+	source = pipeline_new ();
+	pipeline_command (source,
+			  pipecmd_new_function ("source", tee_source,
+						NULL, NULL));
+	sink = pipeline_new_command_args ("cat", NULL);
+	outfile = xasprintf ("%s/sink", temp_dir);
+	pipeline_want_outfile (sink, outfile);
+	pipeline_connect (source, sink, NULL);
+	pipeline_start (source);
+	pipeline_start (sink);
+	block = pipeline_peek (source, &len);
+	fail_unless (block != NULL);
+	fail_unless (len > 0);
+	pipeline_pump (source, sink, NULL);
+	pipeline_wait (sink);
+	pipeline_wait (source);
+
+	out = fopen (outfile, "r");
+	fail_unless (out != NULL);
+	while ((got = fread (buf, 1, sizeof buf, out)) > 0) {
+		for (k = 0; k < got; ++k)
+			fail_unless (buf[k] == (total + k) % 256);
+		total += got;
+	}
+	fclose (out);
+	fail_unless (total == 256 * 4096);
+
+	free (outfile);
+	pipeline_free (sink);
+	pipeline_free (source);
+}
+END_TEST
+
+/* Report the pipe that standard output goes to. */
+static void inode_source (void *data PIPELINE_ATTR_UNUSED)
+{
+	struct stat st;
+
+	if (fstat (STDOUT_FILENO, &st) == 0)
+		printf ("%lu\n", (unsigned long) st.st_ino);
+}
+
+/* Say whether the source's output pipe is also our input. */
+static void inode_sink (void *data PIPELINE_ATTR_UNUSED)
+{
+	struct stat st;
+	unsigned long ino;
+
+	if (fstat (STDIN_FILENO, &st) == 0 && scanf ("%lu", &ino) == 1 &&
+	    ino == (unsigned long) st.st_ino)
+		puts ("direct");
+	else
+		puts ("copied");
+}
+
+START_TEST (test_pump_single_sink)
+{
+	pipeline *source, *sink;
+	char *outfile;
+	int started;
+	FILE *out;
+	char buf[16];
+	size_t got;
+
+	/* A source with one sink is connected to it directly if
+	 * pipeline_pump starts either of them, but not if the caller has
+	 * started both.  Bit 0 of started is set if the caller starts the
+	 * source, and bit 1 if it starts the sink.
+	 */
+	for (started = 0; started <= 3; ++started) {
+		int direct = (started != 3);
+
+		source = pipeline_new ();
+		pipeline_command (source,
+				  pipecmd_new_function ("source", inode_source,
+							NULL, NULL));
+		sink = pipeline_new ();
+		pipeline_command (sink,
+				  pipecmd_new_function ("sink", inode_sink,
+							NULL, NULL));
+		outfile = xasprintf ("%s/sink", temp_dir);
+		pipeline_want_outfile (sink, outfile);
+		pipeline_connect (source, sink, NULL);
+		if (started & 1)
+			pipeline_start (source);
+		if (started & 2)
+			pipeline_start (sink);
+		if (started & 1)
+			fail_unless (source->outfd != -1);
+		if (started & 2)
+			fail_unless (sink->infd != -1);
+		pipeline_pump (source, sink, NULL);
+		if (started == 1) {
+			/* The caller's source has been handed to the sink. */
+			size_t len = 1;
+
+			errno = 0;
+			fail_unless (pipeline_peek (source, &len) == NULL);
+			fail_unless (errno == EBADF);
+		}
+		fail_unless (pipeline_wait (sink) == 0);
+		fail_unless (pipeline_wait (source) == 0);
+		out = fopen (outfile, "r");
+		fail_unless (out != NULL);
+		got = fread (buf, 1, sizeof buf, out);
+		fclose (out);
+		if (direct)
+			fail_unless (got == 7 && !memcmp (buf, "direct\n", 7));
+		else
+			fail_unless (got == 7 && !memcmp (buf, "copied\n", 7));
+		free (outfile);
+		pipeline_free (sink);
+		pipeline_free (source);
+	}
+}
+END_TEST
+
+START_TEST (test_pump_budget)
+{
+	static const int policies[] = {
+		PIPELINE_BUDGET_BLOCK,
+		PIPELINE_BUDGET_SPILL,
+		PIPELINE_BUDGET_DROP
+	};
+	pipeline *source, *fast, *slow;
+	char *fast_outfile, *slow_outfile;
+	size_t k;
+
+	/* The slow sink holds the fast one, which writes straight to a
+	 * file, back until the source's budget runs out, at which point each
+	 * policy deals with it differently.  Never shrinking the source's
+	 * buffer lets us see how large it got.
+	 */
+	for (k = 0; k < sizeof policies / sizeof *policies; ++k) {
+		source = pipeline_new ();
+		pipeline_command (source,
+				  pipecmd_new_function ("source", tee_source,
+							NULL, NULL));
+		pipeline_set_buffer_high_water (source, (size_t) -1);
+		pipeline_set_pump_budget (source, 16384, policies[k]);
+		fast = pipeline_new ();
+		fast_outfile = xasprintf ("%s/fast", temp_dir);
+		pipeline_want_outfile (fast, fast_outfile);
+		slow = pipeline_new_command_args
+			("sh", "-c", "sleep 1; exec cat", NULL);
+		slow_outfile = xasprintf ("%s/slow", temp_dir);
+		pipeline_want_outfile (slow, slow_outfile);
+		pipeline_connect (source, fast, slow, NULL);
+		pipeline_pump (source, fast, slow, NULL);
+		fail_unless (pipeline_wait (fast) == 0);
+		fail_unless (pipeline_wait (slow) == 0);
+		pipeline_wait (source);
+		fail_unless (source->bufmax < 65536);
+		fail_unless (pipeline_get_pump_lag (fast) == 0);
+		if (policies[k] == PIPELINE_BUDGET_DROP)
+			fail_unless (pipeline_get_pump_lag (slow) > 0);
+		else {
+			fail_unless (pipeline_get_pump_lag (slow) == 0);
+			fail_unless_files_equal (fast_outfile, slow_outfile);
+		}
+		free (slow_outfile);
+		free (fast_outfile);
+		pipeline_free (slow);
+		pipeline_free (fast);
+		pipeline_free (source);
+	}
+}
 END_TEST
 
+#define MERGE_SOURCES 3
+#define MERGE_LINES 2000
+
+/* Write numbered lines, each longer than a pipe read is likely to return
+ * in one go and split across two writes, so that interleaving chunks
+ * rather than lines would tear them.
+ */
+static void merge_source (void *data)
+{
+	int n = *(int *) data;
+	char line[200];
+	int i;
+
+	for (i = 0; i < MERGE_LINES; ++i) {
+		int len = snprintf (line, sizeof line, "%d:%05d:%0*d\n",
+				    n, i, 150, 0);
+		full_write (fileno (stdout), line, len / 2);
+		full_write (fileno (stdout), line + len / 2, len - len / 2);
+	}
+}
+
+START_TEST (test_pump_merge)
+{
+	static int numbers[MERGE_SOURCES] = { 0, 1, 2 };
+	pipeline *sources[MERGE_SOURCES], *sink;
+	char *outfile;
+	FILE *out;
+	char line[256];
+	int next[MERGE_SOURCES] = { 0, 0, 0 };
+	int i;
+
+	sink = pipeline_new ();
+	outfile = xasprintf ("%s/merged", temp_dir);
+	pipeline_want_outfile (sink, outfile);
+	for (i = 0; i < MERGE_SOURCES; ++i) {
+		sources[i] = pipeline_new ();
+		pipeline_command (sources[i],
+				  pipecmd_new_function ("source", merge_source,
+							NULL, &numbers[i]));
+		pipeline_merge (sink, sources[i], NULL);
+	}
+	fail_unless (sink->nsources == MERGE_SOURCES);
+	fail_unless (sink->redirect_in == REDIRECT_FD);
+	fail_unless (sink->want_in < 0);
+	pipeline_set_merge_delimiter (sink, "\n", 1);
+	pipeline_pump (sink, sources[0], sources[1], sources[2], NULL);
+	fail_unless (pipeline_wait (sink) == 0);
+	fail_unless (pipeline_get_pump_lag (sink) == 0);
+	for (i = 0; i < MERGE_SOURCES; ++i)
+		fail_unless (pipeline_wait (sources[i]) == 0);
+
+	/* Every line arrives whole, and in order with respect to the others
+	 * from the same source.
+	 */
+	out = fopen (outfile, "r");
+	fail_unless (out != NULL);
+	while (fgets (line, sizeof line, out)) {
+		int n, number;
+
+		fail_unless (strlen (line) == 159);
+		fail_unless (sscanf (line, "%d:%d:", &n, &number) == 2);
+		fail_unless (n >= 0 && n < MERGE_SOURCES);
+		fail_unless (number == next[n]++);
+	}
+	fclose (out);
+	for (i = 0; i < MERGE_SOURCES; ++i)
+		fail_unless (next[i] == MERGE_LINES);
+
+	free (outfile);
+	for (i = 0; i < MERGE_SOURCES; ++i)
+		pipeline_free (sources[i]);
+	pipeline_free (sink);
+}
+END_TEST
+
+START_TEST (test_pump_graph)
+{
+	pipeline_graph *g;
+	pipeline *first, *second, *merge, *tee, *sort, *count, *chain, *end;
+	pipeline *source, *copy1, *copy2;
+	char *sort_outfile, *count_outfile, *end_outfile;
+	char *copy1_outfile, *copy2_outfile;
+	FILE *out;
+	char buf[16];
+	size_t got;
+
+	/* Two sources merge line by line into a tee, which feeds a sort, a
+	 * count, and a chain of two more pipelines.
+	 */
+	g = pipeline_graph_new ();
+	first = pipeline_new_command_args ("seq", "1", "1000", NULL);
+	second = pipeline_new_command_args ("seq", "1001", "2000", NULL);
+	sort = pipeline_new_command_args ("sort", "-n", NULL);
+	sort_outfile = xasprintf ("%s/sort", temp_dir);
+	pipeline_want_outfile (sort, sort_outfile);
+	count = pipeline_new_command_args ("wc", "-l", NULL);
+	count_outfile = xasprintf ("%s/count", temp_dir);
+	pipeline_want_outfile (count, count_outfile);
+	chain = pipeline_new_command_args ("sort", "-n", NULL);
+	end = pipeline_new ();
+	end_outfile = xasprintf ("%s/end", temp_dir);
+	pipeline_want_outfile (end, end_outfile);
+	pipeline_graph_add (g, first, second, sort, count, chain, end, NULL);
+	merge = pipeline_graph_add_merge (g, "\n", 1);
+	tee = pipeline_graph_add_tee (g);
+	pipeline_graph_connect (g, first, merge);
+	pipeline_graph_connect (g, second, merge);
+	pipeline_graph_connect (g, merge, tee);
+	pipeline_graph_connect (g, tee, sort);
+	pipeline_graph_connect (g, tee, count);
+	pipeline_graph_connect (g, tee, chain);
+	pipeline_graph_connect (g, chain, end);
+	fail_unless (pipeline_graph_get_status (g, sort) == -1);
+	fail_unless (pipeline_graph_run (g) == 0);
+	fail_unless (pipeline_graph_get_status (g, sort) == 0);
+	fail_unless (pipeline_graph_get_status (g, merge) == 0);
+	fail_unless_files_equal (sort_outfile, end_outfile);
+	out = fopen (sort_outfile, "r");
+	fail_unless (out != NULL);
+	got = 0;
+	while (fgets (buf, sizeof buf, out))
+		fail_unless (atoi (buf) == (int) ++got);
+	fclose (out);
+	fail_unless (got == 2000);
+	out = fopen (count_outfile, "r");
+	fail_unless (out != NULL);
+	fail_unless (fgets (buf, sizeof buf, out) != NULL);
+	fclose (out);
+	fail_unless (atoi (buf) == 2000);
+	pipeline_graph_free (g);
+
+	/* A tee with a single source is folded into it. */
+	g = pipeline_graph_new ();
+	source = pipeline_new ();
+	pipeline_command (source,
+			  pipecmd_new_function ("source", tee_source,
+						NULL, NULL));
+	copy1 = pipeline_new_command_args ("cat", NULL);
+	copy1_outfile = xasprintf ("%s/copy1", temp_dir);
+	pipeline_want_outfile (copy1, copy1_outfile);
+	copy2 = pipeline_new ();
+	copy2_outfile = xasprintf ("%s/copy2", temp_dir);
+	pipeline_want_outfile (copy2, copy2_outfile);
+	pipeline_graph_add (g, source, copy1, copy2, NULL);
+	tee = pipeline_graph_add_tee (g);
+	pipeline_graph_connect (g, source, tee);
+	pipeline_graph_connect (g, tee, copy1);
+	pipeline_graph_connect (g, tee, copy2);
+	fail_unless (pipeline_graph_run (g) == 0);
+	fail_unless (copy1->source == source);
+	fail_unless (copy2->source == source);
+	fail_unless (source->nsinks == 2);
+	fail_unless_files_equal (copy1_outfile, copy2_outfile);
+	pipeline_graph_free (g);
+
+	free (copy2_outfile);
+	free (copy1_outfile);
+	free (end_outfile);
+	free (count_outfile);
+	free (sort_outfile);
+}
+END_TEST
+
+#if defined(HAVE_EPOLL_CREATE1) && defined(HAVE_SYS_EPOLL_H)
+START_TEST (test_pump_high_fds)
+{
+	struct rlimit rl;
+	int fd, lowest;
+
+	/* Occupy all descriptors below FD_SETSIZE, so that the pipes used
+	 * by pipeline_pump can only be allocated above it.
+	 */
+	fail_unless (getrlimit (RLIMIT_NOFILE, &rl) == 0);
+	if (rl.rlim_cur < FD_SETSIZE + 64) {
+		if (rl.rlim_max != RLIM_INFINITY &&
+		    rl.rlim_max < FD_SETSIZE + 64)
+			return; /* can't test this here */
+		rl.rlim_cur = FD_SETSIZE + 64;
+		fail_unless (setrlimit (RLIMIT_NOFILE, &rl) == 0);
+	}
+	lowest = open ("/dev/null", O_RDONLY);
+	fail_unless (lowest >= 0);
+	for (fd = lowest; fd < FD_SETSIZE; ) {
+		fd = dup (lowest);
+		fail_unless (fd >= 0);
+	}
+
+	check_tee ();
+
+	for (fd = lowest; fd <= FD_SETSIZE; ++fd)
+		close (fd);
+}
+END_TEST
+#endif
+
 Suite *pump_suite (void)
 {
 	Suite *s = suite_create ("Pump");
@@ -117,6 +604,24 @@ Suite *pump_suite (void)
 	TEST_CASE (s, pump, connect_attaches_correctly);
 	TEST_CASE_WITH_FIXTURE (s, pump, tee,
 				temp_dir_setup, temp_dir_teardown);
+	TEST_CASE_WITH_FIXTURE (s, pump, tee_three_sinks,
+				temp_dir_setup, temp_dir_teardown);
+	TEST_CASE_WITH_FIXTURE (s, pump, zero_command_sinks,
+				temp_dir_setup, temp_dir_teardown);
+	TEST_CASE_WITH_FIXTURE (s, pump, peeked_source,
+				temp_dir_setup, temp_dir_teardown);
+	TEST_CASE_WITH_FIXTURE (s, pump, single_sink,
+				temp_dir_setup, temp_dir_teardown);
+	TEST_CASE_WITH_FIXTURE (s, pump, budget,
+				temp_dir_setup, temp_dir_teardown);
+	TEST_CASE_WITH_FIXTURE (s, pump, merge,
+				temp_dir_setup, temp_dir_teardown);
+	TEST_CASE_WITH_FIXTURE (s, pump, graph,
+				temp_dir_setup, temp_dir_teardown);
+#if defined(HAVE_EPOLL_CREATE1) && defined(HAVE_SYS_EPOLL_H)
+	TEST_CASE_WITH_FIXTURE (s, pump, high_fds,
+				temp_dir_setup, temp_dir_teardown);
+#endif
 
 	return s;
 }
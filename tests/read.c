@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2013 Colin Watson.
+ *
+ * This file is part of libpipeline.
+ *
+ * libpipeline is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * libpipeline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libpipeline; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301
+ * USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "full-write.h"
+
+#include "common.h"
+
+/* Include private definitions so that we can inspect the read buffer. */
+#include "pipeline-private.h"
+
+const char *program_name = "read";
+
+/* The byte at offset i of the output of pattern_source. */
+#define PATTERN(i) ((char) ((i) % 251))
+
+static void pattern_source (void *data)
+{
+	size_t total = *(size_t *) data;
+	char buf[4096];
+	size_t i;
+
+	for (i = 0; i < total; i += sizeof buf) {
+		size_t n = total - i < sizeof buf ? total - i : sizeof buf;
+		size_t j;
+
+		for (j = 0; j < n; ++j)
+			buf[j] = PATTERN (i + j);
+		full_write (fileno (stdout), buf, n);
+	}
+}
+
+static pipeline *start_pattern (size_t *total)
+{
+	pipeline *p = pipeline_new ();
+
+	pipeline_command (p, pipecmd_new_function ("pattern", pattern_source,
+						   NULL, total));
+	pipeline_want_out (p, -1);
+	pipeline_start (p);
+	return p;
+}
+
+static int check_pattern (const char *data, size_t offset, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		if (data[i] != PATTERN (offset + i))
+			return 0;
+	return 1;
+}
+
+START_TEST (test_read_peek_then_read)
+{
+	size_t total = 10000;
+	pipeline *p = start_pattern (&total);
+	const char *data;
+	size_t len;
+
+	len = 100;
+	data = pipeline_peek (p, &len);
+	fail_unless (data != NULL);
+	fail_unless (len == 100);
+	fail_unless (check_pattern (data, 0, len));
+
+	/* A read larger than the peek cache returns the peeked data
+	 * followed by new data, contiguously.
+	 */
+	len = 5000;
+	data = pipeline_read (p, &len);
+	fail_unless (data != NULL);
+	fail_unless (len > 100);
+	fail_unless (check_pattern (data, 0, len));
+
+	pipeline_wait (p);
+	pipeline_free (p);
+}
+END_TEST
+
+START_TEST (test_read_buffer_shrinks)
+{
+	size_t total = 1024 * 1024;
+	pipeline *p = start_pattern (&total);
+	size_t offset = 0, len;
+	const char *data;
+
+	pipeline_set_buffer_high_water (p, 8192);
+
+	/* Force the buffer to grow well beyond its high-water mark. */
+	while (pipeline_peek_size (p) < 256 * 1024) {
+		len = pipeline_peek_size (p) + 4096;
+		data = pipeline_peek (p, &len);
+		fail_unless (data != NULL);
+	}
+	fail_unless (p->bufmax >= 256 * 1024);
+
+	/* Reading it back in small pieces should release the memory. */
+	for (;;) {
+		len = 1000;
+		data = pipeline_read (p, &len);
+		fail_unless (data != NULL);
+		if (!len)
+			break;
+		fail_unless (check_pattern (data, offset, len));
+		offset += len;
+	}
+	fail_unless (offset == total);
+	fail_unless (p->bufmax <= 8192);
+
+	pipeline_wait (p);
+	pipeline_free (p);
+}
+END_TEST
+
+START_TEST (test_read_interleaved_bounded)
+{
+	size_t total = 4 * 1024 * 1024;
+	pipeline *p = start_pattern (&total);
+	size_t offset = 0, len;
+	const char *data;
+
+	/* Alternately peek ahead and read less than was peeked, so that
+	 * there is always unread data at the end of the buffer.
+	 */
+	for (;;) {
+		size_t cached = pipeline_peek_size (p);
+
+		len = cached + 3000;
+		data = pipeline_peek (p, &len);
+		fail_unless (data != NULL);
+		fail_unless (check_pattern (data, offset, len));
+		if (len == cached) {
+			/* end of file */
+			data = pipeline_read (p, &len);
+			fail_unless (check_pattern (data, offset, len));
+			offset += len;
+			break;
+		}
+
+		if (len > 2000) {
+			len -= 2000;
+			data = pipeline_read (p, &len);
+			fail_unless (data != NULL);
+			fail_unless (check_pattern (data, offset, len));
+			offset += len;
+		}
+		fail_unless (p->bufmax <= 65536);
+	}
+	fail_unless (offset == total);
+
+	pipeline_wait (p);
+	pipeline_free (p);
+}
+END_TEST
+
+static void lines_source (void *data PIPELINE_ATTR_UNUSED)
+{
+	fputs ("one\ntwo\n\nlast", stdout);
+}
+
+START_TEST (test_read_line_view)
+{
+	pipeline *p = pipeline_new ();
+	const char *line;
+	size_t len;
+
+	pipeline_command (p, pipecmd_new_function ("lines", lines_source,
+						   NULL, NULL));
+	pipeline_want_out (p, -1);
+	pipeline_start (p);
+
+	line = pipeline_peekline_view (p, &len);
+	fail_unless (line != NULL);
+	fail_unless (len == 4 && !memcmp (line, "one\n", 4));
+	line = pipeline_readline_view (p, &len);
+	fail_unless (line != NULL);
+	fail_unless (len == 4 && !memcmp (line, "one\n", 4));
+
+	/* Views and copies may be mixed freely. */
+	line = pipeline_readline (p);
+	fail_unless (line != NULL && !strcmp (line, "two\n"));
+
+	line = pipeline_readline_view (p, &len);
+	fail_unless (line != NULL);
+	fail_unless (len == 1 && line[0] == '\n');
+	line = pipeline_readline_view (p, &len);
+	fail_unless (line != NULL);
+	fail_unless (len == 4 && !memcmp (line, "last", 4));
+	line = pipeline_readline_view (p, &len);
+	fail_unless (line == NULL);
+	fail_unless (len == 0);
+
+	pipeline_wait (p);
+	pipeline_free (p);
+}
+END_TEST
+
+static void records_source (void *data)
+{
+	const char *which = data;
+
+	if (!strcmp (which, "nul"))
+		fwrite ("a\0bb\0\0ccc", 1, 9, stdout);
+	else {
+		/* Put a delimiter across the end of the first block that
+		 * the reader peeks.
+		 */
+		int i;
+
+		for (i = 0; i < 4095; ++i)
+			putchar ('x');
+		fputs ("--y---z", stdout);
+	}
+}
+
+static pipeline *start_records (const char *which)
+{
+	pipeline *p = pipeline_new ();
+
+	pipeline_command (p, pipecmd_new_function ("records", records_source,
+						   NULL, (void *) which));
+	pipeline_want_out (p, -1);
+	pipeline_start (p);
+	return p;
+}
+
+START_TEST (test_read_record_nul)
+{
+	pipeline *p = start_records ("nul");
+	const char *record;
+	size_t len;
+
+	record = pipeline_peekrecord (p, "", 1, &len);
+	fail_unless (record != NULL);
+	fail_unless (len == 2 && !memcmp (record, "a", 2));
+	record = pipeline_readrecord (p, "", 1, &len);
+	fail_unless (record != NULL);
+	fail_unless (len == 2 && !memcmp (record, "a", 2));
+	record = pipeline_readrecord (p, "", 1, &len);
+	fail_unless (record != NULL);
+	fail_unless (len == 3 && !memcmp (record, "bb", 3));
+	record = pipeline_readrecord (p, "", 1, &len);
+	fail_unless (record != NULL);
+	fail_unless (len == 1 && record[0] == '\0');
+	record = pipeline_readrecord (p, "", 1, &len);
+	fail_unless (record != NULL);
+	fail_unless (len == 3 && !memcmp (record, "ccc", 3));
+	record = pipeline_readrecord (p, "", 1, &len);
+	fail_unless (record == NULL);
+
+	pipeline_wait (p);
+	pipeline_free (p);
+}
+END_TEST
+
+START_TEST (test_read_record_multibyte)
+{
+	pipeline *p = start_records ("multibyte");
+	const char *record;
+	size_t len, i;
+
+	record = pipeline_readrecord (p, "--", 2, &len);
+	fail_unless (record != NULL);
+	fail_unless (len == 4097);
+	for (i = 0; i < 4095; ++i)
+		if (record[i] != 'x')
+			break;
+	fail_unless (i == 4095);
+	fail_unless (!memcmp (record + 4095, "--", 2));
+	record = pipeline_readrecord (p, "--", 2, &len);
+	fail_unless (record != NULL);
+	fail_unless (len == 3 && !memcmp (record, "y--", 3));
+	record = pipeline_readrecord (p, "--", 2, &len);
+	fail_unless (record != NULL);
+	fail_unless (len == 2 && !memcmp (record, "-z", 2));
+	record = pipeline_readrecord (p, "--", 2, &len);
+	fail_unless (record == NULL);
+
+	pipeline_wait (p);
+	pipeline_free (p);
+}
+END_TEST
+
+Suite *read_suite (void)
+{
+	Suite *s = suite_create ("Read");
+
+	TEST_CASE (s, read, peek_then_read);
+	TEST_CASE (s, read, buffer_shrinks);
+	TEST_CASE (s, read, interleaved_bounded);
+	TEST_CASE (s, read, line_view);
+	TEST_CASE (s, read, record_nul);
+	TEST_CASE (s, read, record_multibyte);
+
+	return s;
+}
+
+MAIN (read)
@@ -27,8 +27,13 @@
 #  include "config.h"
 #endif
 
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+
+#include "full-write.h"
+#include "xalloc.h"
 #include "xvasprintf.h"
 
 #include "common.h"
@@ -111,12 +116,102 @@ START_TEST (test_reading_longline)
 }
 END_TEST
 
+struct line_source {
+	size_t len;		/* length of each line, including newline */
+	int lines;		/* number of lines */
+	size_t chunk;		/* size of each write */
+	int pause;		/* pause between writes, in microseconds */
+};
+
+/* The byte at offset i of each line produced by line_source. */
+#define LINE_BYTE(i) ((char) ('a' + (i) % 26))
+
+static void line_source (void *data)
+{
+	const struct line_source *ls = data;
+	char *line = xmalloc (ls->len);
+	size_t i, off;
+	int n;
+
+	for (i = 0; i < ls->len - 1; ++i)
+		line[i] = LINE_BYTE (i);
+	line[ls->len - 1] = '\n';
+
+	for (n = 0; n < ls->lines; ++n) {
+		for (off = 0; off < ls->len; off += ls->chunk) {
+			size_t w = ls->len - off < ls->chunk
+				? ls->len - off : ls->chunk;
+			full_write (fileno (stdout), line + off, w);
+			if (ls->pause)
+				usleep (ls->pause);
+		}
+	}
+
+	free (line);
+}
+
+static void check_lines (struct line_source *ls)
+{
+	pipeline *p;
+	const char *line;
+	size_t i;
+	int n = 0;
+
+	p = pipeline_new ();
+	pipeline_command (p, pipecmd_new_function ("lines", line_source,
+						   NULL, ls));
+	pipeline_want_out (p, -1);
+	pipeline_start (p);
+	while ((line = pipeline_readline (p)) != NULL) {
+		fail_unless (strlen (line) == ls->len,
+			     "line %d has length %zu, not %zu",
+			     n, strlen (line), ls->len);
+		for (i = 0; i < ls->len - 1; ++i)
+			if (line[i] != LINE_BYTE (i))
+				break;
+		fail_unless (i == ls->len - 1, "line %d differs at %zu",
+			     n, i);
+		fail_unless (line[ls->len - 1] == '\n');
+		++n;
+	}
+	fail_unless (n == ls->lines, "read %d lines, not %d", n, ls->lines);
+	fail_unless (pipeline_wait (p) == 0);
+	pipeline_free (p);
+}
+
+START_TEST (test_reading_1k_lines)
+{
+	struct line_source ls = { 1024, 1000, 4096, 0 };
+	check_lines (&ls);
+}
+END_TEST
+
+START_TEST (test_reading_1m_lines)
+{
+	struct line_source ls = { 1024 * 1024, 8, 65536, 0 };
+	check_lines (&ls);
+}
+END_TEST
+
+/* A line that arrives in several pieces must not be mistaken for a final
+ * line without a newline just because a read from the pipe came up short.
+ */
+START_TEST (test_reading_slow_line)
+{
+	struct line_source ls = { 10000, 3, 3000, 20000 };
+	check_lines (&ls);
+}
+END_TEST
+
 Suite *reading_long_line_suite (void)
 {
 	Suite *s = suite_create ("Reading long line");
 
 	TEST_CASE_WITH_FIXTURE (s, reading, longline,
 		temp_dir_setup, temp_dir_teardown);
+	TEST_CASE (s, reading, 1k_lines);
+	TEST_CASE (s, reading, 1m_lines);
+	TEST_CASE (s, reading, slow_line);
 
 	return s;
 }
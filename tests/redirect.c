@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include "xalloc.h"
 #include "xvasprintf.h"
@@ -89,6 +90,41 @@ START_TEST (test_redirect_outfile)
 }
 END_TEST
 
+START_TEST (test_redirect_pipe_size)
+{
+	pipeline *p;
+	pipecmd *first;
+	const char *line;
+
+	first = pipecmd_new_args ("cat", NULL);
+	pipecmd_set_pipe_size (first, 256 * 1024);
+	p = pipeline_new_commands (first, pipecmd_new_args ("cat", NULL),
+				   NULL);
+	pipeline_set_pipe_size (p, 128 * 1024);
+	pipeline_want_in (p, -1);
+	pipeline_want_out (p, -1);
+	pipeline_start (p);
+
+	fail_unless (pipeline_get_pipe_size (p, -1) == -1);
+	fail_unless (pipeline_get_pipe_size (p, 3) == -1);
+#ifdef F_GETPIPE_SZ
+	/* The system may limit pipe sizes, but allows at least 64 KiB. */
+	fail_unless (pipeline_get_pipe_size (p, 0) >= 64 * 1024);
+	fail_unless (pipeline_get_pipe_size (p, 1) >=
+		     pipeline_get_pipe_size (p, 0));
+	fail_unless (pipeline_get_pipe_size (p, 2) ==
+		     pipeline_get_pipe_size (p, 0));
+#endif
+
+	fputs ("test\n", pipeline_get_infile (p));
+	fflush (pipeline_get_infile (p));
+	line = pipeline_readline (p);
+	fail_unless (line && !strcmp (line, "test\n"));
+	fail_unless (pipeline_wait (p) == 0);
+	pipeline_free (p);
+}
+END_TEST
+
 Suite *redirect_suite (void)
 {
 	Suite *s = suite_create ("Redirect");
@@ -96,6 +132,7 @@ Suite *redirect_suite (void)
 	TEST_CASE (s, redirect, files);
 	TEST_CASE_WITH_FIXTURE (s, redirect, outfile,
 				temp_dir_setup, temp_dir_teardown);
+	TEST_CASE (s, redirect, pipe_size);
 
 	return s;
 }